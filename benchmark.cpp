@@ -0,0 +1,401 @@
+#include "chacha20.hpp"  // Including ChaCha20 header
+#include "chacha20_ahead.hpp"
+#include "chacha20_async.hpp"
+#include "chacha20_poly1305.hpp"
+#include "chacha20_rng.hpp"
+#include "chacha20_session.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <cstdint>
+#include <latch>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(CHACHA20_X86)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+const std::array<std::uint32_t, 8> KEY = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                          0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+const std::array<std::uint32_t, 3> NONCE = {0x00000000, 0x0000004a, 0x00000000};
+
+// Reads the time stamp counter, 0 where there is none
+std::uint64_t cycles() {
+#if defined(CHACHA20_X86)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Reports throughput and cycles per byte of a finished benchmark
+void report(benchmark::State& state, std::size_t bytes_per_iteration, std::uint64_t elapsed_cycles) {
+    const std::int64_t bytes = static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(bytes_per_iteration);
+    state.SetBytesProcessed(bytes);
+    if (bytes > 0 && elapsed_cycles > 0) {
+        state.counters["cycles/byte"] = benchmark::Counter(static_cast<double>(elapsed_cycles) / static_cast<double>(bytes),
+                                                           benchmark::Counter::kAvgThreads);
+    }
+}
+
+// Steady-state throughput: key is set up once, every iteration encrypts the same message from block 1
+void BM_Encrypt(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+    cipher.select_kernel(kernel);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        cipher.encrypt_at(0, input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Cold key setup: every iteration constructs a new object and encrypts one message
+void BM_KeySetup(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        Chacha20 cipher(KEY, 1, NONCE);
+        cipher.select_kernel(kernel);
+        cipher.encrypt(input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// The same messages under a key prepared once, against key_setup/
+void BM_PreparedKey(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    const Chacha20::PreparedKey prepared(KEY, kernel);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        prepared.encrypt(NONCE, 1, input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Scaling over threads, each encrypting its own message with its own object
+void BM_EncryptThreads(benchmark::State& state) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        cipher.encrypt_at(0, input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Scaling of a single message split among the threads of the shared pool
+void BM_EncryptParallel(benchmark::State& state) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+    cipher.enable_parallel();
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        cipher.encrypt_at(0, input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Buffers far larger than the last level cache, output written through the caches or with non-temporal stores
+void BM_EncryptStreaming(benchmark::State& state, Chacha20Kernel kernel, bool streaming) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    Chacha20Buffer input(length, 0x5a);
+    Chacha20Buffer output(length);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+    cipher.select_kernel(kernel);
+    if (streaming) cipher.enable_streaming();
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        cipher.encrypt_at(0, input.data(), output.data(), length);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Per-message rekey: the key is set up once, every iteration starts a new message with reset()
+void BM_Reset(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+    cipher.select_kernel(kernel);
+    std::array<std::uint32_t, 3> nonce = NONCE;
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        nonce[2]++;
+        cipher.reset(nonce, 1);
+        cipher.encrypt(input, output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Many small packets with their own key and nonce, one object per packet or a single encrypt_batch() call
+void BM_Packets(benchmark::State& state, Chacha20Kernel kernel, bool batch) {
+    const std::size_t packets = 1024;
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(packets * length, 0x5a);
+    std::vector<std::uint8_t> output(packets * length);
+
+    std::vector<Chacha20::Job> jobs;
+    for (std::size_t i = 0; i < packets; ++i) {
+        const std::uint32_t id = static_cast<std::uint32_t>(i);
+        jobs.push_back({KEY, 1, {id, NONCE[1], NONCE[2]}, input.data() + i * length, output.data() + i * length, length});
+    }
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        if (batch) {
+            Chacha20::encrypt_batch(jobs, kernel);
+        } else {
+            for (const Chacha20::Job& job : jobs) {
+                Chacha20 cipher(job.key, job.block_count, job.nonce);
+                cipher.select_kernel(kernel);
+                cipher.encrypt(job.input, job.output, job.length);
+            }
+        }
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, packets * length, cycles() - start);
+}
+
+// One packet for each of many sessions kept in a Chacha20SessionTable, compare with batch/
+void BM_Sessions(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t sessions = 1024;
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(sessions * length, 0x5a);
+    std::vector<std::uint8_t> output(sessions * length);
+
+    Chacha20SessionTable table(sessions);
+    table.select_kernel(kernel);
+    std::vector<Chacha20SessionTable::Message> messages;
+    for (std::size_t i = 0; i < sessions; ++i) {
+        const std::uint32_t id = static_cast<std::uint32_t>(i);
+        table.open(i, KEY, 1, {id, NONCE[1], NONCE[2]});
+        messages.push_back({input.data() + i * length, output.data() + i * length, length});
+    }
+
+    std::array<std::uint32_t, 3> nonce = NONCE;
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        nonce[2]++;
+        for (std::size_t i = 0; i < sessions; ++i) {
+            table.reset(i, nonce, 1);
+        }
+        table.encrypt(messages);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, sessions * length, cycles() - start);
+}
+
+// Latency of one short message on the critical path, computing its keystream inline or taking it
+// from a Chacha20KeystreamAhead ring refilled outside the timed region as in idle time
+void BM_KeystreamAhead(benchmark::State& state, Chacha20Kernel kernel, bool ahead) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    const std::size_t capacity = 1024;
+    std::vector<std::uint8_t> message(length, 0x5a);
+
+    Chacha20 cipher(KEY, 1, NONCE);
+    cipher.select_kernel(kernel);
+    Chacha20KeystreamAhead<> ring(KEY, 1, NONCE, capacity, kernel);
+
+    // Idle time comes every half ring, the messages in between always find their keystream
+    const std::size_t messages_per_refill = capacity / 2 / ((length + 63) / 64);
+    std::size_t sent = 0;
+    for (auto _ : state) {
+        if (ahead) {
+            ring.encrypt(message.data(), message.data(), length);
+            if (++sent == messages_per_refill) {
+                state.PauseTiming();
+                ring.refill();
+                sent = 0;
+                state.ResumeTiming();
+            }
+        } else {
+            cipher.encrypt(message.data(), message.data(), length);
+        }
+        benchmark::DoNotOptimize(message.data());
+        benchmark::ClobberMemory();
+    }
+    // Cycles would include the refills, the reported time does not
+    report(state, length, 0);
+}
+
+// Packets submitted to an engine with a given number of workers, the submitting thread only waits
+void BM_Async(benchmark::State& state) {
+    const std::size_t packets = 1024;
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(packets * length, 0x5a);
+    std::vector<std::uint8_t> output(packets * length);
+
+    std::vector<Chacha20::Job> jobs;
+    for (std::size_t i = 0; i < packets; ++i) {
+        const std::uint32_t id = static_cast<std::uint32_t>(i);
+        jobs.push_back({KEY, 1, {id, NONCE[1], NONCE[2]}, input.data() + i * length, output.data() + i * length, length});
+    }
+
+    Chacha20AsyncEngine<> engine(static_cast<unsigned>(state.range(1)), packets);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        std::latch done(packets);
+        for (const Chacha20::Job& job : jobs) {
+            engine.submit(job, [&done](bool) { done.count_down(); });
+        }
+        done.wait();
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, packets * length, cycles() - start);
+}
+
+// Random bytes written straight into a buffer
+void BM_RngFill(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> output(length);
+
+    ChaChaRng rng(KEY);
+    rng.select_kernel(kernel);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        rng.fill(output);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+// Random 64-bit numbers one at a time through the buffer
+void BM_RngNext(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t numbers = 4096;
+
+    ChaChaRng rng(KEY);
+    rng.select_kernel(kernel);
+
+    const std::uint64_t start = cycles();
+    for (auto _ : state) {
+        std::uint64_t sum = 0;
+        for (std::size_t i = 0; i < numbers; ++i) {
+            sum += rng();
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    report(state, numbers * sizeof(std::uint64_t), cycles() - start);
+}
+
+// AEAD seal, encryption and authentication interleaved chunk by chunk
+void BM_Seal(benchmark::State& state, Chacha20Kernel kernel) {
+    const std::size_t length = static_cast<std::size_t>(state.range(0));
+    std::vector<std::uint8_t> input(length, 0x5a);
+    std::vector<std::uint8_t> output(length);
+    const std::array<std::uint8_t, 12> aad = {};
+
+    Chacha20Poly1305 aead(KEY);
+    aead.select_kernel(kernel);
+
+    const std::uint64_t start = cycles();
+    Chacha20Poly1305::tag_type tag;
+    for (auto _ : state) {
+        aead.seal(NONCE, aad, input, output, tag);
+        benchmark::DoNotOptimize(tag.data());
+        benchmark::ClobberMemory();
+    }
+    report(state, length, cycles() - start);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    for (Chacha20Kernel kernel : {Chacha20Kernel::Scalar, Chacha20Kernel::SSE2, Chacha20Kernel::AVX2, Chacha20Kernel::AVX512,
+                                  Chacha20Kernel::NEON, Chacha20Kernel::SVE2}) {
+        if (!Chacha20::kernel_supported(kernel)) continue;
+        const std::string name = Chacha20::kernel_name(kernel);
+
+        benchmark::RegisterBenchmark(("encrypt/" + name).c_str(), BM_Encrypt, kernel)
+            ->RangeMultiplier(4)->Range(16, 64 << 20);
+        benchmark::RegisterBenchmark(("bulk_cached/" + name).c_str(), BM_EncryptStreaming, kernel, false)
+            ->Arg(64 << 20)->Arg(1 << 30);
+        benchmark::RegisterBenchmark(("bulk_streaming/" + name).c_str(), BM_EncryptStreaming, kernel, true)
+            ->Arg(64 << 20)->Arg(1 << 30);
+        benchmark::RegisterBenchmark(("key_setup/" + name).c_str(), BM_KeySetup, kernel)
+            ->Arg(64)->Arg(1024);
+        benchmark::RegisterBenchmark(("prepared/" + name).c_str(), BM_PreparedKey, kernel)
+            ->Arg(64)->Arg(1024);
+        benchmark::RegisterBenchmark(("reset/" + name).c_str(), BM_Reset, kernel)
+            ->Arg(64)->Arg(1024);
+        benchmark::RegisterBenchmark(("packets/" + name).c_str(), BM_Packets, kernel, false)
+            ->Arg(64)->Arg(200)->Arg(512);
+        benchmark::RegisterBenchmark(("batch/" + name).c_str(), BM_Packets, kernel, true)
+            ->Arg(64)->Arg(200)->Arg(512);
+        benchmark::RegisterBenchmark(("sessions/" + name).c_str(), BM_Sessions, kernel)
+            ->Arg(64)->Arg(200)->Arg(512);
+        benchmark::RegisterBenchmark(("inline/" + name).c_str(), BM_KeystreamAhead, kernel, false)
+            ->Arg(16)->Arg(64)->Arg(256);
+        benchmark::RegisterBenchmark(("ahead/" + name).c_str(), BM_KeystreamAhead, kernel, true)
+            ->Arg(16)->Arg(64)->Arg(256);
+        benchmark::RegisterBenchmark(("rng_fill/" + name).c_str(), BM_RngFill, kernel)
+            ->Arg(4096)->Arg(1 << 20);
+        benchmark::RegisterBenchmark(("rng_next/" + name).c_str(), BM_RngNext, kernel);
+        benchmark::RegisterBenchmark(("seal/" + name).c_str(), BM_Seal, kernel)
+            ->RangeMultiplier(16)->Range(64, 16 << 20);
+    }
+
+    const int hardware_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    benchmark::RegisterBenchmark("encrypt_threads", BM_EncryptThreads)
+        ->Arg(1 << 20)->ThreadRange(1, hardware_threads)->UseRealTime();
+    benchmark::RegisterBenchmark("encrypt_parallel", BM_EncryptParallel)
+        ->RangeMultiplier(4)->Range(1 << 20, 64 << 20)->UseRealTime();
+    for (int threads = 1; threads <= hardware_threads; threads *= 2) {
+        benchmark::RegisterBenchmark("async", BM_Async)
+            ->Args({512, threads})->Args({64 << 10, threads})->UseRealTime();
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -7,20 +7,111 @@ file, You can obtain one at https://mozilla.org/MPL/2.0/.
 #ifndef __CHACHA20__
 #define __CHACHA20__
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
+#include <span>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
+#include "chacha20_allocator.hpp"
+#include "chacha20_thread_pool.hpp"
+#include "chacha20_trace.hpp"
+
+// SIMD kernels are picked at runtime, thus they are only built
+// where per-function target attributes and cpu detection exist
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA20_X86
+#include "chacha20_AVX.hpp"
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define CHACHA20_NEON
+#if defined(__ARM_FEATURE_SVE2)
+#define CHACHA20_SVE2
+#endif
+#include "chacha20_NEON.hpp"
+#endif
+
+// Round functions are forced inline so that unrolled rounds stay in registers
+#ifndef CHACHA20_ALWAYS_INLINE
+#if defined(__GNUC__)
+#define CHACHA20_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define CHACHA20_ALWAYS_INLINE inline
+#endif
+#endif
+
+// Kernels available to the Chacha20 front end, ordered from slowest to fastest
+// within each architecture
+enum class Chacha20Kernel {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512,
+    NEON,
+    SVE2
+};
+
+// Keeps many sessions in one table, see chacha20_session.hpp
+template<unsigned DOUBLE_ROUNDS>
+class ChachaSessionTable;
+
+// Precomputes keystream ahead of the messages, see chacha20_ahead.hpp
+template<typename Cipher>
+class Chacha20KeystreamAhead;
+
+// Offloads bulk encryption to a CUDA device, see chacha20_cuda.cuh
+template<unsigned DOUBLE_ROUNDS, bool COUNTER64>
+class ChachaCuda;
+
 // Designed accordingly to: https://datatracker.ietf.org/doc/html/rfc8439
-class Chacha20 {
+// DOUBLE_ROUNDS selects the variant, 10 double rounds make ChaCha20,
+// reduced round variants ChaCha8 and ChaCha12 are faster but weaker.
+// COUNTER64 selects the original layout by D. J. Bernstein, a 64-bit block
+// count in words 12-13 and a 64-bit nonce, instead of the 32-bit block count
+// and 96-bit nonce of RFC 8439
+template<unsigned DOUBLE_ROUNDS, bool COUNTER64 = false>
+class Chacha {
+
+    static_assert(DOUBLE_ROUNDS > 0, "at least one double round is required");
+
+    // Builds on the kernels and helpers of the class
+    template<unsigned> friend class ChachaSessionTable;
+    template<typename> friend class Chacha20KeystreamAhead;
+    template<unsigned, bool> friend class ChachaCuda;
 
     // Number of double rounds to perform
-    static constexpr unsigned int ROUNDS = 10;  
+    static constexpr unsigned int ROUNDS = DOUBLE_ROUNDS;
     static constexpr unsigned int KEY_WORDS = 8;
-    static constexpr unsigned int NONCE_WORDS = 3;
+    static constexpr unsigned int NONCE_WORDS = COUNTER64 ? 2 : 3;
     static constexpr unsigned int STATE_SIZE = 16;
+    static constexpr unsigned int BLOCK_SIZE = STATE_SIZE*4;
+
+    // encrypt_batch() gathers up to BATCH_LANES blocks of different messages per kernel call
+    static constexpr std::size_t BATCH_LANES = 16;
+
+    // Messages of at least PARALLEL_THRESHOLD bytes are split among threads
+    // once enable_parallel() is called, each thread takes PARALLEL_CHUNK_BLOCKS at a time
+    static constexpr std::size_t PARALLEL_THRESHOLD = 1 << 20;
+    static constexpr std::size_t PARALLEL_CHUNK_BLOCKS = 1024;
+
+    // Messages of at least STREAMING_THRESHOLD bytes bypass the caches once enable_streaming() is called
+    static constexpr std::size_t STREAMING_THRESHOLD = 1 << 22;
+
+    // Block count is 32 bits wide in RFC 8439 mode, 64 bits wide in COUNTER64 mode
+    using counter_type = std::conditional_t<COUNTER64, std::uint64_t, std::uint32_t>;
+
+    // Signature shared by all kernels, see xor_blocks_scalar()
+    using kernel_function = std::size_t (*)(std::uint32_t*, const std::uint8_t*, std::uint8_t*, std::size_t);
+    // Signature shared by all kernels writing keystream itself, see keystream_blocks_scalar()
+    using stream_function = std::size_t (*)(std::uint32_t*, std::uint8_t*, std::size_t);
+    // Signature shared by all kernels computing keystream of independent states, see keystream_lanes_scalar()
+    using lanes_function = std::size_t (*)(const std::uint32_t*, std::uint8_t*, std::size_t);
+    // Signature shared by all kernels computing keystream of states stored by word, see keystream_columns_scalar()
+    using columns_function = std::size_t (*)(const std::uint32_t*, std::size_t, std::uint8_t*, std::size_t);
 
     // Internal state is made of 16 32-bit words
     // They are arranges as a 4x4 matrix as follows
@@ -40,9 +131,35 @@ class Chacha20 {
 
     // Chacha variables defined upon construction
     std::array<std::uint32_t, KEY_WORDS> key;
-    std::uint32_t block_count;
+    counter_type block_count;
     std::array<std::uint32_t, NONCE_WORDS> nonce;
 
+    // Set once the block count wrapped around, no keystream is left for the nonce
+    bool exhausted;
+
+    // Kernel used by encrypt(), best_kernel() unless selected otherwise
+    Chacha20Kernel kernel;
+
+    // Serialized keystream of the block the stream is positioned in
+    // Only bytes from keystream_pos onwards are still to be used,
+    // keystream_pos == BLOCK_SIZE means there is no such block
+    std::array<std::uint8_t, BLOCK_SIZE> keystream;
+    std::size_t keystream_pos;
+
+    // Pool used for long messages, nullptr unless enable_parallel() is called
+    Chacha20ThreadPool* pool;
+    std::size_t parallel_threshold;
+
+    // Output of long messages is written with non-temporal stores, false unless enable_streaming() is called
+    bool streaming;
+    std::size_t streaming_threshold;
+
+#if defined(CHACHA20_TRACE)
+    // Instrumentation, see chacha20_trace.hpp
+    Chacha20Stats statistics;
+    Chacha20TraceHooks hooks;
+#endif
+
     /*------------------------------------------------
     Computes the result of bitwise left-rotating the value of x by s positions.
     This operation is also known as a left circular shift
@@ -51,7 +168,7 @@ class Chacha20 {
     @param s number of bits to rotate by
     @returns shifted value
     ------------------------------------------------*/
-    static inline std::uint32_t rotl(std::uint32_t x, std::uint32_t s) {
+    static CHACHA20_ALWAYS_INLINE constexpr std::uint32_t rotl(std::uint32_t x, std::uint32_t s) {
         return (x << s) | (x >> (32-s));
     }
     
@@ -61,7 +178,7 @@ class Chacha20 {
     @param x integer to be left rotated
     @returns little-endian value
     ------------------------------------------------*/
-    static inline std::uint32_t little_endian(std::uint32_t x) {
+    static constexpr std::uint32_t little_endian(std::uint32_t x) {
         return ((x & 0xFF000000) >> 24) |
                ((x & 0x00FF0000) >> 8)  |
                ((x & 0x0000FF00) << 8)  |
@@ -76,7 +193,7 @@ class Chacha20 {
     @param c word c in chacha quarter round algorithm
     @param d word d in chacha quarter round algorithm
     ------------------------------------------------*/
-    static void quarter_round(std::uint32_t& a, std::uint32_t& b, std::uint32_t& c, std::uint32_t& d) {
+    static CHACHA20_ALWAYS_INLINE constexpr void quarter_round(std::uint32_t& a, std::uint32_t& b, std::uint32_t& c, std::uint32_t& d) {
         a += b; d ^= a; d = rotl(d, 16);
         c += d; b ^= c; b = rotl(b, 12);
         a += b; d ^= a; d = rotl(d, 8);
@@ -91,7 +208,7 @@ class Chacha20 {
 
     @param state_cpy copy of internal_state to perform rounds on
     ------------------------------------------------*/
-    static void double_round(std::array<std::uint32_t, STATE_SIZE>& state_cpy) {
+    static CHACHA20_ALWAYS_INLINE constexpr void double_round(std::array<std::uint32_t, STATE_SIZE>& state_cpy) {
         // column rounds
         quarter_round(state_cpy[0], state_cpy[4], state_cpy[8], state_cpy[12]);
         quarter_round(state_cpy[1], state_cpy[5], state_cpy[9], state_cpy[13]);
@@ -105,36 +222,369 @@ class Chacha20 {
         quarter_round(state_cpy[3], state_cpy[4], state_cpy[9], state_cpy[14]);
     }
 
+    /*------------------------------------------------
+    Performs N double rounds on state_cpy, the rounds
+    are unrolled at compile time.
+
+    @param state_cpy copy of internal_state to perform rounds on
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    static CHACHA20_ALWAYS_INLINE constexpr void double_rounds(std::array<std::uint32_t, STATE_SIZE>& state_cpy) {
+        if constexpr (N > 0) {
+            double_round(state_cpy);
+            double_rounds<N - 1>(state_cpy);
+        }
+    }
+
     /*------------------------------------------------
     Performs a block operation that is runs ROUNDS
-    double_rounds on internal_state and then
-    adds the outcome with internal_state before
-    the operation.
+    double_rounds on state and then adds the outcome
+    with state before the operation.
     Does not modify block_count in any way of the state
     after the operation is applied.
 
-    @param count block count to be used along key and nonce
+    @param state 16 words of the state to be used
     @return state after block operation
     ------------------------------------------------*/
-    std::array<std::uint32_t, STATE_SIZE> chacha20_block() {
-        // modify the internal state to fit provided block_count
-        internal_state[12]++;
-        std::array<std::uint32_t, STATE_SIZE> state_cpy = internal_state;
+    static constexpr std::array<std::uint32_t, STATE_SIZE> chacha20_block(const std::uint32_t state[STATE_SIZE]) {
+        std::array<std::uint32_t, STATE_SIZE> state_cpy;
+        std::copy_n(state, STATE_SIZE, state_cpy.begin());
 
-        for(unsigned i = 0; i < ROUNDS; i++) {
-            double_round(state_cpy);
-        }
+        double_rounds<ROUNDS>(state_cpy);
 
-        // Matrix addition of state_cpy and internal_state
+        // Matrix addition of state_cpy and state
         for(size_t i = 0; i < STATE_SIZE; i++) {
-            state_cpy[i] += internal_state[i];
+            state_cpy[i] += state[i];
         }
 
         return state_cpy;
     }
 
     /*------------------------------------------------
-    Initialize internal state with given key, nonce and block count.
+    Serializes a block produced by chacha20_block()
+    into 64 bytes ordered by little-endian.
+
+    @param stream block to be serialized
+    @param bytes array to hold the result
+    ------------------------------------------------*/
+    static constexpr void serialize(const std::array<std::uint32_t, STATE_SIZE>& stream, std::array<std::uint8_t, STATE_SIZE*4>& bytes) {
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            bytes[4*i]   = static_cast<std::uint8_t>(stream[i]);
+            bytes[4*i+1] = static_cast<std::uint8_t>(stream[i] >> 8);
+            bytes[4*i+2] = static_cast<std::uint8_t>(stream[i] >> 16);
+            bytes[4*i+3] = static_cast<std::uint8_t>(stream[i] >> 24);
+        }
+    }
+
+    /*------------------------------------------------
+    XORs length bytes of input with serialized keystream.
+    Bytes are processed 64 bits at a time, the remaining
+    tail is processed one byte at a time.
+
+    @param input message to be encrypted
+    @param stream serialized keystream of at least length bytes
+    @param output buffer of at least length bytes for the result
+    @param length number of bytes to process
+    ------------------------------------------------*/
+    static inline void xor_bytes(const std::uint8_t* input, const std::uint8_t* stream, std::uint8_t* output, std::size_t length) {
+        size_t i = 0;
+        for(; i + 8 <= length; i += 8) {
+            std::uint64_t message, key_stream;
+            std::memcpy(&message, input + i, 8);
+            std::memcpy(&key_stream, stream + i, 8);
+            message ^= key_stream;
+            std::memcpy(output + i, &message, 8);
+        }
+        for(; i < length; i++) {
+            output[i] = input[i] ^ stream[i];
+        }
+    }
+
+    /*------------------------------------------------
+    @param state 16 words of a state
+    @return block count of the state
+    ------------------------------------------------*/
+    static constexpr std::uint64_t get_counter(const std::uint32_t state[STATE_SIZE]) {
+        if constexpr (COUNTER64) {
+            return state[12] | (static_cast<std::uint64_t>(state[13]) << 32);
+        }
+        return state[12];
+    }
+
+    /*------------------------------------------------
+    @param state 16 words of a state
+    @param counter block count to be stored in the state
+    ------------------------------------------------*/
+    static constexpr void set_counter(std::uint32_t state[STATE_SIZE], std::uint64_t counter) {
+        state[12] = static_cast<std::uint32_t>(counter);
+        if constexpr (COUNTER64) {
+            state[13] = static_cast<std::uint32_t>(counter >> 32);
+        }
+    }
+
+    /*------------------------------------------------
+    Advances the block count of state by one block,
+    carrying into word 13 in COUNTER64 mode.
+
+    @param state 16 words of a state
+    @return false if the block count wrapped around to 0
+    ------------------------------------------------*/
+    static constexpr bool advance(std::uint32_t state[STATE_SIZE]) {
+        if(++state[12] != 0) return true;
+        if constexpr (COUNTER64) {
+            return ++state[13] != 0;
+        }
+        return false;
+    }
+
+    /*------------------------------------------------
+    Runs kernel over whole blocks in pieces that never
+    cross a multiple of 2^32 blocks. Kernels only advance
+    word 12 of the state, thus every piece ending at such
+    a multiple carries into word 13 in COUNTER64 mode.
+
+    @param state 16 words of the state, advanced by blocks
+    @param blocks number of whole 64 byte blocks
+    @param kernel called with state, the index of the first block of the piece and its length
+    @return false if the block count wrapped around to 0
+    ------------------------------------------------*/
+    template<typename F>
+    static bool split_counter(std::uint32_t state[STATE_SIZE], std::size_t blocks, F&& kernel) {
+        bool fresh = true;
+        for(size_t done = 0; done < blocks; ) {
+            const std::uint64_t to_boundary = (std::uint64_t(1) << 32) - state[12];
+            const size_t count = static_cast<size_t>(std::min<std::uint64_t>(blocks - done, to_boundary));
+            kernel(state, done, count);
+            done += count;
+            if(count == to_boundary) {
+                // Word 12 wrapped around to 0 within the kernel
+                if constexpr (COUNTER64) {
+                    fresh = ++state[13] != 0;
+                } else {
+                    fresh = false;
+                }
+            }
+        }
+        return fresh;
+    }
+
+    /*------------------------------------------------
+    Checks whether the stream has keystream left for
+    blocks more blocks.
+
+    @param blocks number of blocks to be taken from the stream
+    @return false if the block count would wrap around
+    ------------------------------------------------*/
+    bool fits(std::uint64_t blocks) const {
+        if(exhausted) return blocks == 0;
+        return stream_fits(static_cast<counter_type>(get_counter(internal_state.data())), blocks);
+    }
+
+    /*------------------------------------------------
+    Portable kernel, encrypts whole blocks one at a time.
+    Every kernel shares this signature: it encrypts as many
+    of the given blocks as it can and advances block_count
+    in state by the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed
+    ------------------------------------------------*/
+    static std::size_t xor_blocks_scalar(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        for(size_t i = 0; i < blocks; i++, state[12]++) {
+            std::array<std::uint8_t, BLOCK_SIZE> stream_bytes;
+            serialize(chacha20_block(state), stream_bytes);
+            xor_bytes(input + BLOCK_SIZE*i, stream_bytes.data(), output + BLOCK_SIZE*i, BLOCK_SIZE);
+        }
+        return blocks;
+    }
+
+    /*------------------------------------------------
+    Portable kernel writing whole blocks of keystream
+    itself, one at a time. Every kernel of this kind shares
+    the signature: it writes as many of the given blocks
+    as it can and advances block_count in state by the
+    number of blocks written.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written
+    ------------------------------------------------*/
+    static std::size_t keystream_blocks_scalar(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        for(size_t i = 0; i < blocks; i++, state[12]++) {
+            std::array<std::uint8_t, BLOCK_SIZE> stream_bytes;
+            serialize(chacha20_block(state), stream_bytes);
+            std::copy(stream_bytes.begin(), stream_bytes.end(), output + BLOCK_SIZE*i);
+        }
+        return blocks;
+    }
+
+    /*------------------------------------------------
+    Maps a kernel onto the function writing keystream itself.
+
+    @param k kernel, must be supported by the cpu
+    @return function implementing the kernel
+    ------------------------------------------------*/
+    static stream_function get_stream_function(Chacha20Kernel k) {
+        switch(k) {
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::SSE2:   return chacha20_avx::keystream_blocks_sse2<ROUNDS>;
+            case Chacha20Kernel::AVX2:   return chacha20_avx::keystream_blocks_avx2<ROUNDS>;
+            case Chacha20Kernel::AVX512: return chacha20_avx::keystream_blocks_avx512<ROUNDS>;
+#endif
+#if defined(CHACHA20_NEON)
+            case Chacha20Kernel::NEON:   return chacha20_neon::keystream_blocks_neon<ROUNDS>;
+#endif
+#if defined(CHACHA20_SVE2)
+            case Chacha20Kernel::SVE2:   return chacha20_neon::keystream_blocks_sve2<ROUNDS>;
+#endif
+            default:                     return keystream_blocks_scalar;
+        }
+    }
+
+    /*------------------------------------------------
+    Portable kernel computing one block of keystream for
+    each of count independent states, one at a time.
+    Every kernel of this kind shares the signature: it
+    serves as many of the states as it can and leaves
+    them unchanged.
+
+    @param states count states of 16 words each, one after another
+    @param keystream buffer of at least count*64 bytes, block i belongs to state i
+    @param count number of states
+    @return number of states processed
+    ------------------------------------------------*/
+    static std::size_t keystream_lanes_scalar(const std::uint32_t* states, std::uint8_t* keystream, std::size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            std::array<std::uint8_t, BLOCK_SIZE> stream_bytes;
+            serialize(chacha20_block(states + STATE_SIZE*i), stream_bytes);
+            std::copy(stream_bytes.begin(), stream_bytes.end(), keystream + BLOCK_SIZE*i);
+        }
+        return count;
+    }
+
+    /*------------------------------------------------
+    Maps a kernel onto the function computing keystream
+    of independent states.
+
+    @param k kernel, must be supported by the cpu
+    @return function implementing the kernel
+    ------------------------------------------------*/
+    static lanes_function get_lanes_function(Chacha20Kernel k) {
+        switch(k) {
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::SSE2:   return chacha20_avx::keystream_lanes_sse2<ROUNDS>;
+            case Chacha20Kernel::AVX2:   return chacha20_avx::keystream_lanes_avx2<ROUNDS>;
+            case Chacha20Kernel::AVX512: return chacha20_avx::keystream_lanes_avx512<ROUNDS>;
+#endif
+#if defined(CHACHA20_NEON)
+            // SVE2 has no fixed number of lanes to gather independent states into
+            case Chacha20Kernel::NEON:
+            case Chacha20Kernel::SVE2:   return chacha20_neon::keystream_lanes_neon<ROUNDS>;
+#endif
+            default:                     return keystream_lanes_scalar;
+        }
+    }
+
+    /*------------------------------------------------
+    Portable kernel computing one block of keystream for
+    each of count independent states stored by word rather
+    than by state, one at a time. Words 0-3 are the
+    constants, word 4+r of state j is rows[stride*r + j].
+    Every kernel of this kind shares the signature: it
+    serves as many of the states as it can and leaves
+    them unchanged.
+
+    @param rows words 4-15 of the states, one row of stride words per state word
+    @param stride distance between rows in words
+    @param keystream buffer of at least count*64 bytes, block j belongs to state j
+    @param count number of states
+    @return number of states processed
+    ------------------------------------------------*/
+    static std::size_t keystream_columns_scalar(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream, std::size_t count) {
+        std::array<std::uint32_t, STATE_SIZE> state;
+        std::copy(CONSTANT_WORDS.begin(), CONSTANT_WORDS.end(), state.begin());
+        for(size_t j = 0; j < count; j++) {
+            for(size_t i = 4; i < STATE_SIZE; i++) {
+                state[i] = rows[stride*(i - 4) + j];
+            }
+            std::array<std::uint8_t, BLOCK_SIZE> stream_bytes;
+            serialize(chacha20_block(state.data()), stream_bytes);
+            std::copy(stream_bytes.begin(), stream_bytes.end(), keystream + BLOCK_SIZE*j);
+        }
+        secure_zero(state);
+        return count;
+    }
+
+    /*------------------------------------------------
+    Maps a kernel onto the function computing keystream
+    of states stored by word.
+
+    @param k kernel, must be supported by the cpu
+    @return function implementing the kernel
+    ------------------------------------------------*/
+    static columns_function get_columns_function(Chacha20Kernel k) {
+        switch(k) {
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::SSE2:   return chacha20_avx::keystream_columns_sse2<ROUNDS>;
+            case Chacha20Kernel::AVX2:   return chacha20_avx::keystream_columns_avx2<ROUNDS>;
+            case Chacha20Kernel::AVX512: return chacha20_avx::keystream_columns_avx512<ROUNDS>;
+#endif
+#if defined(CHACHA20_NEON)
+            case Chacha20Kernel::NEON:
+            case Chacha20Kernel::SVE2:   return chacha20_neon::keystream_columns_neon<ROUNDS>;
+#endif
+            default:                     return keystream_columns_scalar;
+        }
+    }
+
+    /*------------------------------------------------
+    Maps a kernel onto the function implementing it.
+
+    @param k kernel, must be supported by the cpu
+    @return function implementing the kernel
+    ------------------------------------------------*/
+    static kernel_function get_kernel_function(Chacha20Kernel k) {
+        switch(k) {
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::SSE2:   return chacha20_avx::xor_blocks_sse2<ROUNDS>;
+            case Chacha20Kernel::AVX2:   return chacha20_avx::xor_blocks_avx2<ROUNDS>;
+            case Chacha20Kernel::AVX512: return chacha20_avx::xor_blocks_avx512<ROUNDS>;
+#endif
+#if defined(CHACHA20_NEON)
+            case Chacha20Kernel::NEON:   return chacha20_neon::xor_blocks_neon<ROUNDS>;
+#endif
+#if defined(CHACHA20_SVE2)
+            case Chacha20Kernel::SVE2:   return chacha20_neon::xor_blocks_sve2<ROUNDS>;
+#endif
+            default:                     return xor_blocks_scalar;
+        }
+    }
+
+    /*------------------------------------------------
+    Maps a kernel onto the function implementing it for
+    output that is not read again soon, see enable_streaming().
+    Kernels without such a variant map onto their usual function.
+
+    @param k kernel, must be supported by the cpu
+    @return function implementing the kernel
+    ------------------------------------------------*/
+    static kernel_function get_streaming_function(Chacha20Kernel k) {
+        switch(k) {
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::AVX2:   return chacha20_avx::xor_blocks_stream_avx2<ROUNDS>;
+            case Chacha20Kernel::AVX512: return chacha20_avx::xor_blocks_stream_avx512<ROUNDS>;
+#endif
+            default:                     return get_kernel_function(k);
+        }
+    }
+
+    /*------------------------------------------------
+    Initialize a state with given key, nonce and block count.
 
     The ChaCha20 state is initialized as follows: (https://datatracker.ietf.org/doc/html/rfc8439)
 
@@ -158,31 +608,48 @@ class Chacha20 {
        bbbbbbbb  nnnnnnnn  nnnnnnnn  nnnnnnnn
 
     c=constant k=key b=blockcount n=nonce
+
+    In COUNTER64 mode words 12-13 are the block count, least
+    significant word first, and words 14-15 are the nonce.
+
+    @param state state to be initialized
+    @param key 256-bit key
+    @param block_count block count of the first block
+    @param nonce 96-bit nonce
     ------------------------------------------------*/
-    void init() {
+    static constexpr void init_state(std::array<std::uint32_t, STATE_SIZE>& state, const std::array<std::uint32_t, KEY_WORDS>& key,
+                           counter_type block_count, const std::array<std::uint32_t, NONCE_WORDS>& nonce) {
         // Assign constant words
-        internal_state[0] = CONSTANT_WORDS[0];
-        internal_state[1] = CONSTANT_WORDS[1];
-        internal_state[2] = CONSTANT_WORDS[2];
-        internal_state[3] = CONSTANT_WORDS[3];
+        state[0] = CONSTANT_WORDS[0];
+        state[1] = CONSTANT_WORDS[1];
+        state[2] = CONSTANT_WORDS[2];
+        state[3] = CONSTANT_WORDS[3];
 
         // Assign key and translate them into little-endian
-        internal_state[4] = little_endian(key[0]);
-        internal_state[5] = little_endian(key[1]);
-        internal_state[6] = little_endian(key[2]);
-        internal_state[7] = little_endian(key[3]);
-        internal_state[8] = little_endian(key[4]);
-        internal_state[9] = little_endian(key[5]);
-        internal_state[10] = little_endian(key[6]);
-        internal_state[11] = little_endian(key[7]);
-
-        // Assign block_count
-        internal_state[12] = block_count;
+        state[4] = little_endian(key[0]);
+        state[5] = little_endian(key[1]);
+        state[6] = little_endian(key[2]);
+        state[7] = little_endian(key[3]);
+        state[8] = little_endian(key[4]);
+        state[9] = little_endian(key[5]);
+        state[10] = little_endian(key[6]);
+        state[11] = little_endian(key[7]);
+
+        // Assign block_count, least significant word first
+        set_counter(state.data(), block_count);
 
         // Assign nonce and translate them into little-endian
-        internal_state[13] = little_endian(nonce[0]);
-        internal_state[14] = little_endian(nonce[1]);
-        internal_state[15] = little_endian(nonce[2]);
+        for(size_t i = 0; i < NONCE_WORDS; i++) {
+            state[16 - NONCE_WORDS + i] = little_endian(nonce[i]);
+        }
+    }
+
+    /*------------------------------------------------
+    Initialize internal state with the key, nonce and
+    block count given upon construction, see init_state().
+    ------------------------------------------------*/
+    void init() {
+        init_state(internal_state, key, block_count, nonce);
     }
 
     /*------------------------------------------------
@@ -191,14 +658,233 @@ class Chacha20 {
     @param arr Array to be zeroed
     ------------------------------------------------*/
     template<typename T, size_t N>
-    void secure_zero(std::array<T, N>& arr) {
+    static void secure_zero(std::array<T, N>& arr) {
         volatile T* p = reinterpret_cast<volatile T*>(arr.data());
         for (size_t i = 0; i < N; ++i) {
             p[i] = 0;
         }
     }
 
+    /*------------------------------------------------
+    Encrypts whole blocks with the selected kernel,
+    whatever it leaves is done by the portable one.
+
+    @param state 16 words of the state, advanced by blocks
+    @param input Message for encryption or decryption
+    @param output Buffer of at least blocks*64 bytes for the result
+    @param blocks number of whole 64 byte blocks to process
+    @param stream true to write output with non-temporal stores where the kernel supports it
+    @return false if the block count wrapped around to 0
+    ------------------------------------------------*/
+    bool xor_blocks(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks, bool stream = false) const {
+        const kernel_function kernel_fn = stream ? get_streaming_function(kernel) : get_kernel_function(kernel);
+        return split_counter(state, blocks, [&](std::uint32_t* piece_state, size_t first, size_t count) {
+            const std::uint8_t* piece_input = input + BLOCK_SIZE*first;
+            std::uint8_t* piece_output = output + BLOCK_SIZE*first;
+            const size_t done = kernel_fn(piece_state, piece_input, piece_output, count);
+            xor_blocks_scalar(piece_state, piece_input + BLOCK_SIZE*done, piece_output + BLOCK_SIZE*done, count - done);
+        });
+    }
+
+    /*------------------------------------------------
+    Encrypts whole blocks on the threads of pool. Blocks are
+    split into chunks of PARALLEL_CHUNK_BLOCKS, each chunk
+    is encrypted by the selected kernel on its own copy of
+    the state with the block_count the chunk starts at.
+    Afterwards block_count is advanced by blocks.
+
+    @param input Message for encryption or decryption
+    @param output Buffer of at least blocks*64 bytes for the result
+    @param blocks number of whole 64 byte blocks to process
+    @param stream true to write output with non-temporal stores, see xor_blocks()
+    @return false if the block count wrapped around to 0
+    ------------------------------------------------*/
+    bool xor_blocks_parallel(const std::uint8_t* input, std::uint8_t* output, std::size_t blocks, bool stream) {
+        const size_t chunks = (blocks + PARALLEL_CHUNK_BLOCKS - 1) / PARALLEL_CHUNK_BLOCKS;
+        const std::uint64_t counter = get_counter(internal_state.data());
+
+        pool->parallel_for(chunks, [&](size_t chunk) {
+            const size_t first = chunk * PARALLEL_CHUNK_BLOCKS;
+            const size_t count = std::min(PARALLEL_CHUNK_BLOCKS, blocks - first);
+
+            std::array<std::uint32_t, STATE_SIZE> state = internal_state;
+            set_counter(state.data(), counter + first);
+            xor_blocks(state.data(), input + BLOCK_SIZE*first, output + BLOCK_SIZE*first, count, stream);
+            secure_zero(state);
+        });
+
+        set_counter(internal_state.data(), counter + blocks);
+        return COUNTER64 ? get_counter(internal_state.data()) != 0 : internal_state[12] != 0;
+    }
+
+    /*------------------------------------------------
+    @param length number of bytes to be processed from the current stream position
+    @return number of blocks of keystream to be computed for them
+    ------------------------------------------------*/
+    std::uint64_t blocks_needed(std::size_t length) const {
+        const size_t leftover = std::min(BLOCK_SIZE - keystream_pos, length);
+        return (static_cast<std::uint64_t>(length - leftover) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    /*------------------------------------------------
+    Encrypts length bytes starting at the current stream
+    position. Remaining keystream of the current block is
+    used first, then whole blocks go through the selected
+    kernel and the keystream of the last partial block is
+    kept in keystream.
+    Nothing is processed if the block count would wrap around.
+
+    @param input Message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the message does not fit into the rest of the stream
+    ------------------------------------------------*/
+    bool process(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        if(!fits(blocks_needed(length))) return false;
+#if defined(CHACHA20_TRACE)
+        Chacha20TraceScope trace(hooks, statistics, length, blocks_needed(length), kernel);
+#endif
+
+        // Remaining keystream of the current block
+        const size_t leftover = std::min(BLOCK_SIZE - keystream_pos, length);
+        xor_bytes(input, keystream.data() + keystream_pos, output, leftover);
+        keystream_pos += leftover;
+        input += leftover;
+        output += leftover;
+        length -= leftover;
+
+        const size_t blocks = length / BLOCK_SIZE;
+        if(blocks > 0) {
+            const bool stream = streaming && length >= streaming_threshold;
+            if(pool != nullptr && length >= parallel_threshold) {
+                exhausted = !xor_blocks_parallel(input, output, blocks, stream);
+            } else {
+                exhausted = !xor_blocks(internal_state.data(), input, output, blocks, stream);
+            }
+        }
+
+        // Last partial block
+        const size_t message_idx = BLOCK_SIZE*blocks;
+        if(message_idx < length) {
+            serialize(chacha20_block(internal_state.data()), keystream);
+            exhausted = !advance(internal_state.data());
+            keystream_pos = length - message_idx;
+            xor_bytes(input + message_idx, keystream.data(), output + message_idx, keystream_pos);
+        }
+        return true;
+    }
+
 public:
+    // Independent message for encrypt_batch(), key and nonce are ordered
+    // the same way as for the constructor
+    struct Job {
+        std::array<std::uint32_t, KEY_WORDS> key;
+        counter_type block_count;
+        std::array<std::uint32_t, NONCE_WORDS> nonce;
+        const std::uint8_t* input;
+        std::uint8_t* output;
+        std::size_t length;
+    };
+
+    // Key set up once and never modified, so any number of threads may
+    // encrypt under it at the same time without locks or copies of the key.
+    // Every call keeps its state on its own stack, there is no shared block
+    // count, each message names its nonce and block count itself.
+    class PreparedKey {
+
+        // Words 0-11 of the state, constants and key in state (little-endian) notation.
+        // Aligned so that data written next to the key never shares its cache line
+        alignas(64) std::array<std::uint32_t, 12> words;
+        kernel_function kernel_fn;
+
+    public:
+        /*------------------------------------------------
+        Key is ordered the same way as for the Chacha
+        constructor.
+
+        @param key 256-bit key
+        @param k kernel used by encrypt(), the portable one if k is not supported
+        ------------------------------------------------*/
+        explicit PreparedKey(const std::array<std::uint32_t, KEY_WORDS>& key, Chacha20Kernel k = best_kernel()):
+        kernel_fn ( get_kernel_function(kernel_supported(k) ? k : Chacha20Kernel::Scalar)) {
+            std::array<std::uint32_t, STATE_SIZE> state = {};
+            init_state(state, key, 0, {});
+            std::copy_n(state.begin(), words.size(), words.begin());
+            secure_zero(state);
+        }
+
+        /*------------------------------------------------
+        Upon destruction 0 all sensetive data
+        ------------------------------------------------*/
+        ~PreparedKey() {
+            secure_zero(words);
+        }
+
+        /*------------------------------------------------
+        Performs encryption/decryption of length bytes from
+        input into output, the same as Chacha::encrypt() on
+        an object constructed with this key, nonce and
+        block_count. Reentrant, the key is only read.
+        input and output may point to the same buffer.
+
+        @param nonce nonce of the message, must not be repeated for the same key
+        @param block_count block count of the first block of the message
+        @param input Message for encryption or decryption
+        @param output Buffer of at least length bytes for the result
+        @param length Number of bytes to process
+        @return false if the message runs past the end of the stream, nothing is processed then
+        ------------------------------------------------*/
+        bool encrypt(const std::array<std::uint32_t, NONCE_WORDS>& nonce, counter_type block_count,
+                     const std::uint8_t* input, std::uint8_t* output, std::size_t length) const {
+            const std::uint64_t blocks = (static_cast<std::uint64_t>(length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if(!stream_fits(block_count, blocks)) return false;
+
+            std::array<std::uint32_t, STATE_SIZE> state;
+            std::copy(words.begin(), words.end(), state.begin());
+            set_counter(state.data(), block_count);
+            for(size_t i = 0; i < NONCE_WORDS; i++) {
+                state[16 - NONCE_WORDS + i] = little_endian(nonce[i]);
+            }
+
+            const size_t whole = length / BLOCK_SIZE;
+            split_counter(state.data(), whole, [&](std::uint32_t* piece_state, size_t first, size_t count) {
+                const std::uint8_t* piece_input = input + BLOCK_SIZE*first;
+                std::uint8_t* piece_output = output + BLOCK_SIZE*first;
+                const size_t done = kernel_fn(piece_state, piece_input, piece_output, count);
+                xor_blocks_scalar(piece_state, piece_input + BLOCK_SIZE*done, piece_output + BLOCK_SIZE*done, count - done);
+            });
+
+            // Last partial block
+            const size_t message_idx = BLOCK_SIZE*whole;
+            if(message_idx < length) {
+                std::array<std::uint8_t, BLOCK_SIZE> keystream;
+                serialize(chacha20_block(state.data()), keystream);
+                xor_bytes(input + message_idx, keystream.data(), output + message_idx, length - message_idx);
+                secure_zero(keystream);
+            }
+            secure_zero(state);
+            return true;
+        }
+
+        /*------------------------------------------------
+        Performs encryption/decryption of input into output,
+        see encrypt(nonce, block_count, input, output, length).
+        Only the first input.size() bytes of output are
+        written, if output is shorter only output.size()
+        bytes are processed.
+
+        @param nonce nonce of the message, must not be repeated for the same key
+        @param block_count block count of the first block of the message
+        @param input Message for encryption or decryption
+        @param output Buffer for the result
+        @return false if the message runs past the end of the stream, nothing is processed then
+        ------------------------------------------------*/
+        bool encrypt(const std::array<std::uint32_t, NONCE_WORDS>& nonce, counter_type block_count,
+                     std::span<const std::uint8_t> input, std::span<std::uint8_t> output) const {
+            return encrypt(nonce, block_count, input.data(), output.data(), std::min(input.size(), output.size()));
+        }
+    };
+
     /*------------------------------------------------
     Since chacha works on words both key and nonce are
     separated into an array of 32bit unsigned ints.
@@ -207,56 +893,650 @@ public:
     The least significant word is array's last element.
 
     key consists of 256bits (8*32)
-    block count consits of 32bits
-    nonce consists of 96bits (3*32)
+    block count consits of 32bits, 64bits in COUNTER64 mode
+    nonce consists of 96bits (3*32), 64bits (2*32) in COUNTER64 mode
     ------------------------------------------------*/
-    explicit Chacha20(const std::array<std::uint32_t, KEY_WORDS>& key, std::uint32_t block_count, const std::array<std::uint32_t, NONCE_WORDS>& nonce):
-    key ( key), block_count ( block_count-1), nonce ( nonce) {
+    explicit Chacha(const std::array<std::uint32_t, KEY_WORDS>& key, counter_type block_count, const std::array<std::uint32_t, NONCE_WORDS>& nonce):
+    key ( key), block_count ( block_count), nonce ( nonce), exhausted ( false), kernel ( best_kernel()), keystream_pos ( BLOCK_SIZE),
+    pool ( nullptr), parallel_threshold ( PARALLEL_THRESHOLD), streaming ( false), streaming_threshold ( STREAMING_THRESHOLD) {
         init();
     }
 
+    /*------------------------------------------------
+    HChaCha function (https://datatracker.ietf.org/doc/html/draft-irtf-cfrg-xchacha)
+    derives a subkey from key and the first 128 bits of an
+    extended nonce. The state is initialized like in init()
+    with the 128-bit nonce in words 12-15, then ROUNDS
+    double rounds are performed without the final addition.
+    The subkey is made of words 0-3 and 12-15 of the result.
+
+    Words of key, nonce and the returned subkey are ordered
+    the same way as the constructor expects them.
+
+    @param key 256-bit key
+    @param nonce first 128 bits of the extended nonce
+    @return 256-bit subkey
+    ------------------------------------------------*/
+    static std::array<std::uint32_t, KEY_WORDS> hchacha(const std::array<std::uint32_t, KEY_WORDS>& key, const std::array<std::uint32_t, 4>& nonce) {
+        std::array<std::uint32_t, STATE_SIZE> state;
+        for(size_t i = 0; i < 4; i++) {
+            state[i] = CONSTANT_WORDS[i];
+            state[12 + i] = little_endian(nonce[i]);
+        }
+        for(size_t i = 0; i < KEY_WORDS; i++) {
+            state[4 + i] = little_endian(key[i]);
+        }
+
+        double_rounds<ROUNDS>(state);
+
+        std::array<std::uint32_t, KEY_WORDS> subkey;
+        for(size_t i = 0; i < 4; i++) {
+            subkey[i] = little_endian(state[i]);
+            subkey[4 + i] = little_endian(state[12 + i]);
+        }
+        secure_zero(state);
+        return subkey;
+    }
+
+    /*------------------------------------------------
+    Computes the first N bytes of keystream for key,
+    block count and nonce with the scalar block function.
+    The function is constexpr, so the keystream of fixed
+    keys can be computed and checked during compilation,
+    e.g. against the RFC 8439 test vectors in a static_assert.
+    The block count wraps silently, N is to be small
+    enough for the keystream to fit.
+
+    @param key 256-bit key
+    @param block_count block count of the first block
+    @param nonce 96-bit nonce, 64-bit in COUNTER64 mode
+    @tparam N number of bytes of keystream
+    @return keystream
+    ------------------------------------------------*/
+    template<std::size_t N>
+    static constexpr std::array<std::uint8_t, N> constant_keystream(const std::array<std::uint32_t, KEY_WORDS>& key, counter_type block_count,
+                                                                    const std::array<std::uint32_t, NONCE_WORDS>& nonce) {
+        std::array<std::uint32_t, STATE_SIZE> state = {};
+        init_state(state, key, block_count, nonce);
+
+        std::array<std::uint8_t, N> output = {};
+        std::array<std::uint8_t, BLOCK_SIZE> block = {};
+        for(std::size_t pos = 0; pos < N; pos += BLOCK_SIZE) {
+            serialize(chacha20_block(state.data()), block);
+            advance(state.data());
+            for(std::size_t i = 0; i < BLOCK_SIZE && pos + i < N; i++) {
+                output[pos + i] = block[i];
+            }
+        }
+        return output;
+    }
+
+    /*------------------------------------------------
+    Checks whether the cpu running the program supports
+    the given kernel.
+
+    @param k kernel to be checked
+    @return true if k can be used
+    ------------------------------------------------*/
+    static bool kernel_supported(Chacha20Kernel k) {
+        switch(k) {
+            case Chacha20Kernel::Scalar: return true;
+#if defined(CHACHA20_X86)
+            case Chacha20Kernel::SSE2:   return __builtin_cpu_supports("sse2");
+            case Chacha20Kernel::AVX2:   return __builtin_cpu_supports("avx2");
+            case Chacha20Kernel::AVX512: return __builtin_cpu_supports("avx512f");
+#endif
+#if defined(CHACHA20_NEON)
+            case Chacha20Kernel::NEON:   return true;
+#endif
+#if defined(CHACHA20_SVE2)
+            case Chacha20Kernel::SVE2:   return chacha20_neon::sve2_supported();
+#endif
+            default:                     return false;
+        }
+    }
+
+    /*------------------------------------------------
+    Checks whether a message of blocks blocks starting
+    at block_count fits before the block count wraps
+    around, at 2^32 or at 2^64 in COUNTER64 mode.
+
+    @param block_count block count of the first block of the message
+    @param blocks number of blocks of the message
+    @return false if the keystream of the message would repeat
+    ------------------------------------------------*/
+    static constexpr bool stream_fits(counter_type block_count, std::uint64_t blocks) {
+        const std::uint64_t available = COUNTER64 ? ~static_cast<std::uint64_t>(block_count) + 1
+                                                  : (std::uint64_t(1) << 32) - block_count;
+        // A 64-bit count starting at 0 leaves 2^64 blocks, more than the above can express
+        return (COUNTER64 && available == 0) || blocks <= available;
+    }
+
+    /*------------------------------------------------
+    Detects the fastest kernel supported by the cpu.
+    Detection is done once, upon the first call.
+    SVE2 is never picked, its gathers and scatters are
+    not known to beat NEON, select_kernel() opts in.
+
+    @return fastest supported kernel
+    ------------------------------------------------*/
+    static Chacha20Kernel best_kernel() {
+        static const Chacha20Kernel best = [] {
+#if defined(CHACHA20_X86)
+            __builtin_cpu_init();
+#endif
+            for(Chacha20Kernel k : {Chacha20Kernel::AVX512, Chacha20Kernel::AVX2, Chacha20Kernel::SSE2,
+                                    Chacha20Kernel::NEON}) {
+                if(kernel_supported(k)) return k;
+            }
+            return Chacha20Kernel::Scalar;
+        }();
+        return best;
+    }
+
+    /*------------------------------------------------
+    Returns human readable name of a kernel.
+
+    @param k kernel
+    @return name of the kernel
+    ------------------------------------------------*/
+    static const char* kernel_name(Chacha20Kernel k) {
+        switch(k) {
+            case Chacha20Kernel::Scalar: return "scalar";
+            case Chacha20Kernel::SSE2:   return "SSE2";
+            case Chacha20Kernel::AVX2:   return "AVX2";
+            case Chacha20Kernel::AVX512: return "AVX-512";
+            case Chacha20Kernel::NEON:   return "NEON";
+            case Chacha20Kernel::SVE2:   return "SVE2";
+        }
+        return "unknown";
+    }
+
+    /*------------------------------------------------
+    Overrides the kernel picked by best_kernel() for this
+    object, the output is the same regardless of the kernel.
+
+    @param k kernel to be used by encrypt()
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        if(!kernel_supported(k)) return false;
+        kernel = k;
+        return true;
+    }
+
+#if defined(CHACHA20_TRACE)
+    /*------------------------------------------------
+    Counters of every encrypt(), update() and generate()
+    call made on this object since construction or the
+    last reset_stats(). Calls refused for running past
+    the end of the stream are not counted.
+
+    @return counters of this object
+    ------------------------------------------------*/
+    const Chacha20Stats& stats() const {
+        return statistics;
+    }
+
+    /*------------------------------------------------
+    Sets all counters of this object back to 0.
+    ------------------------------------------------*/
+    void reset_stats() {
+        statistics = Chacha20Stats();
+    }
+
+    /*------------------------------------------------
+    Installs callbacks run before and after every
+    encrypt(), update() and generate() call.
+
+    @param new_hooks callbacks, null ones are skipped
+    ------------------------------------------------*/
+    void set_trace_hooks(const Chacha20TraceHooks& new_hooks) {
+        hooks = new_hooks;
+    }
+#endif
+
+    /*------------------------------------------------
+    @return kernel used by encrypt()
+    ------------------------------------------------*/
+    Chacha20Kernel selected_kernel() const {
+        return kernel;
+    }
+
+    /*------------------------------------------------
+    Lets encrypt() split messages of at least threshold
+    bytes among the threads of thread_pool. Shorter
+    messages are encrypted on the calling thread, skipping
+    the threading overhead. The output is the same as
+    without parallel encryption.
+
+    @param thread_pool pool to run on, must outlive this object
+    @param threshold minimal message length in bytes to be split
+    ------------------------------------------------*/
+    void enable_parallel(Chacha20ThreadPool& thread_pool = Chacha20ThreadPool::shared(), std::size_t threshold = PARALLEL_THRESHOLD) {
+        pool = &thread_pool;
+        parallel_threshold = threshold;
+    }
+
+    /*------------------------------------------------
+    Makes encrypt() run on the calling thread only.
+    ------------------------------------------------*/
+    void disable_parallel() {
+        pool = nullptr;
+    }
+
+    /*------------------------------------------------
+    Makes encrypt() and update() write the output of
+    messages of at least threshold bytes with non-temporal
+    stores and prefetch their input ahead, for output that
+    is not read again soon. Memory bound messages much larger
+    than the last level cache then no longer evict the data
+    of other code from the caches. Only whole 64 byte blocks
+    of output aligned to the vector width of the AVX2 and
+    AVX-512 kernels are streamed, other output and kernels
+    are not affected.
+
+    @param threshold minimum message length in bytes to bypass the caches
+    ------------------------------------------------*/
+    void enable_streaming(std::size_t threshold = STREAMING_THRESHOLD) {
+        streaming = true;
+        streaming_threshold = threshold;
+    }
+
+    /*------------------------------------------------
+    Makes encrypt() write its output through the caches.
+    ------------------------------------------------*/
+    void disable_streaming() {
+        streaming = false;
+    }
+
     /*------------------------------------------------
     Upon destruction 0 all sensetive data
     ------------------------------------------------*/
-    ~Chacha20() {
+    ~Chacha() {
         secure_zero(key);
         block_count = 0;
         secure_zero(nonce);
-        
+        secure_zero(internal_state);
+        secure_zero(keystream);
     }
 
     /*------------------------------------------------
-    Performs encryption/decryption on the given message.
-    Function successively calls chacha20_block() with
-    the same key and nonce while incrementing the 
-    block_count of inner state after each call.
-    The result is concatenated and ordered by little-endian 
-    then XORed with the message resulting in encryption.
-    Encrypted message is guaranteed to have the same 
-    length as the input message.
+    Encrypts/decrypts many independent messages, each with
+    its own key, nonce and block count. Blocks of different
+    messages are packed into the lanes of a single kernel
+    call, BATCH_LANES at a time, so even messages of one
+    block keep every lane busy. Runs of BATCH_LANES whole
+    blocks of longer messages go through the kernel used
+    by encrypt() instead. The output of every job is the
+    same as encrypting it on its own. Jobs that do not fit
+    before the block count wraps around are left untouched.
 
-    @param message Message for encryption or decryption
-    @return Encrypted/Decrypted message
-    ------------------------------------------------*/
-    std::vector<std::uint8_t> encrypt(const std::vector<std::uint8_t>& message) {
-        std::vector<std::uint8_t> output(message.size()); // length of output always == length of input
-        size_t message_idx = 0;
-
-        while(message_idx < message.size()) {
-            std::array<std::uint32_t, STATE_SIZE> stream = chacha20_block();
-            // Iteration is done by byte not word, thus STATE_SIZE*4 since STATE_SIZE is measured in words
-            for(size_t stream_idx = 0; stream_idx < STATE_SIZE*4 && message_idx < message.size(); stream_idx++, message_idx++) {
-                /*  Apply XOR on each byte of the word after 4 full iterations of the for loop.
-                    stream[stream_idx/4] word has 4 bytes, so XOR must be applied 4 times for each word in stream.
-                    >>8*(i%4) shifts by 0 8 16 24 so that XOR is applied through all bytes of word.
-                    Word is XORed with a byte, thus only the least significant byte is XORed each time.
-                */
-                output[message_idx] = message[message_idx] ^ (stream[stream_idx/4]>>(8*(stream_idx%4)));
+    @param jobs messages to be processed, input and output of a job may be the same buffer
+    @param k kernel to be used, the portable one if k is not supported
+    @return false if any job was left untouched
+    ------------------------------------------------*/
+    static bool encrypt_batch(std::span<const Job> jobs, Chacha20Kernel k = best_kernel()) {
+        if(!kernel_supported(k)) k = Chacha20Kernel::Scalar;
+        const kernel_function kernel_fn = get_kernel_function(k);
+        const lanes_function lanes_fn = get_lanes_function(k);
+
+        // Blocks waiting for a kernel call
+        struct Slot {
+            const std::uint8_t* input;
+            std::uint8_t* output;
+            std::size_t length;
+        };
+        std::array<std::uint32_t, STATE_SIZE*BATCH_LANES> states;
+        std::array<std::uint8_t, BLOCK_SIZE*BATCH_LANES> stream;
+        std::array<Slot, BATCH_LANES> slots;
+        size_t used = 0;
+
+        auto flush = [&] {
+            const size_t done = lanes_fn(states.data(), stream.data(), used);
+            keystream_lanes_scalar(states.data() + STATE_SIZE*done, stream.data() + BLOCK_SIZE*done, used - done);
+            for(size_t i = 0; i < used; i++) {
+                xor_bytes(slots[i].input, stream.data() + BLOCK_SIZE*i, slots[i].output, slots[i].length);
+            }
+            used = 0;
+        };
+
+        bool all = true;
+        for(const Job& job : jobs) {
+            const std::uint64_t needed = (static_cast<std::uint64_t>(job.length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if(!stream_fits(job.block_count, needed)) {
+                all = false;
+                continue;
+            }
+
+            std::array<std::uint32_t, STATE_SIZE> state;
+            init_state(state, job.key, job.block_count, job.nonce);
+
+            // Runs of whole lanes of blocks are not worth gathering
+            const size_t blocks = job.length / BLOCK_SIZE;
+            const size_t bulk = blocks - blocks % BATCH_LANES;
+            split_counter(state.data(), bulk, [&](std::uint32_t* piece_state, size_t first, size_t count) {
+                const std::uint8_t* piece_input = job.input + BLOCK_SIZE*first;
+                std::uint8_t* piece_output = job.output + BLOCK_SIZE*first;
+                const size_t done = kernel_fn(piece_state, piece_input, piece_output, count);
+                xor_blocks_scalar(piece_state, piece_input + BLOCK_SIZE*done, piece_output + BLOCK_SIZE*done, count - done);
+            });
+
+            for(size_t pos = BLOCK_SIZE*bulk; pos < job.length; pos += BLOCK_SIZE, advance(state.data())) {
+                std::copy(state.begin(), state.end(), states.begin() + STATE_SIZE*used);
+                slots[used] = {job.input + pos, job.output + pos, std::min<size_t>(BLOCK_SIZE, job.length - pos)};
+                if(++used == BATCH_LANES) flush();
             }
+            secure_zero(state);
         }
+        flush();
 
+        secure_zero(states);
+        secure_zero(stream);
+        return all;
+    }
+
+    /*------------------------------------------------
+    Starts a new message with the same key. Only the
+    block count and nonce words 12-15 of the state are
+    rewritten, the constant and key words are kept, thus
+    it is much cheaper than constructing a new object.
+    Keystream left from the previous message is discarded.
+
+    @param new_nonce nonce of the new message, must not be repeated for the same key
+    @param new_block_count block count the new message starts at
+    ------------------------------------------------*/
+    void reset(const std::array<std::uint32_t, NONCE_WORDS>& new_nonce, counter_type new_block_count) {
+        nonce = new_nonce;
+        block_count = new_block_count;
+        keystream_pos = BLOCK_SIZE;
+        exhausted = false;
+
+        set_counter(internal_state.data(), block_count);
+        for(size_t i = 0; i < NONCE_WORDS; i++) {
+            internal_state[16 - NONCE_WORDS + i] = little_endian(nonce[i]);
+        }
+    }
+
+    /*------------------------------------------------
+    Positions the stream at byte_offset, measured from the
+    start of the block given upon construction. The block
+    count and the offset within the block are computed
+    directly, thus seeking costs the same for any offset.
+    The next call to encrypt() starts at byte_offset.
+
+    Since block count is a 32bit word, the stream ends
+    256 gigabytes past block 0. In COUNTER64 mode the
+    block count carries into word 13 instead, and the
+    stream ends at block 2^64 - 1.
+
+    @param byte_offset position in the keystream
+    @return false if byte_offset lies past the end of the stream, the position is then left unchanged
+    ------------------------------------------------*/
+    bool seek(std::uint64_t byte_offset) {
+        const std::uint64_t blocks = byte_offset / BLOCK_SIZE;
+        const size_t block_offset = byte_offset % BLOCK_SIZE;
+        const std::uint64_t target = static_cast<std::uint64_t>(block_count) + blocks;
+        bool at_end;
+        if constexpr (COUNTER64) {
+            // Blocks left before the 64bit block count wraps around, none of them are short of 2^64 for block_count 0
+            const std::uint64_t remaining = 0 - static_cast<std::uint64_t>(block_count);
+            at_end = block_count != 0 && blocks == remaining;
+            if(block_count != 0 && (blocks > remaining || (at_end && block_offset != 0))) return false;
+        } else {
+            at_end = target == (std::uint64_t(1) << 32);
+            if(target > (std::uint64_t(1) << 32) || (at_end && block_offset != 0)) return false;
+        }
+
+        set_counter(internal_state.data(), target);
+        exhausted = at_end;
+        keystream_pos = BLOCK_SIZE;
+
+        // Landing inside a block, the part of it before byte_offset is skipped
+        if(block_offset != 0) {
+            serialize(chacha20_block(internal_state.data()), keystream);
+            exhausted = !advance(internal_state.data());
+            keystream_pos = block_offset;
+        }
+        return true;
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of length bytes of the
+    message found at byte_offset within the whole message.
+    Equivalent to seek(byte_offset) followed by encrypt().
+
+    @param byte_offset position of input within the whole message
+    @param input Part of the message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the part lies past the end of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool encrypt_at(std::uint64_t byte_offset, const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        return seek(byte_offset) && encrypt(input, output, length);
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of the part of the
+    message found at byte_offset within the whole message.
+    Only the first input.size() bytes of output are written,
+    if output is shorter only output.size() bytes are processed.
+
+    @param byte_offset position of input within the whole message
+    @param input Part of the message for encryption or decryption
+    @param output Buffer for the result
+    @return false if the part lies past the end of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool encrypt_at(std::uint64_t byte_offset, std::span<const std::uint8_t> input, std::span<std::uint8_t> output) {
+        return encrypt_at(byte_offset, input.data(), output.data(), std::min(input.size(), output.size()));
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of length bytes from
+    input into output. Whole blocks are encrypted by the
+    selected kernel with the same key and nonce while
+    incrementing the block_count of inner state after each block.
+    The result is concatenated and ordered by little-endian 
+    then XORed with the input resulting in encryption.
+    No memory is allocated. input and output may point
+    to the same buffer, resulting in in-place encryption.
+    Encryption starts at the position set by seek(), or
+    at a fresh block otherwise. Keystream left unused in
+    the last block is discarded.
+    A message running past the end of the stream, where the
+    32bit block count would wrap around and repeat keystream,
+    is not processed at all.
+
+    @param input Message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the message does not fit into the rest of the stream
+    ------------------------------------------------*/
+    bool encrypt(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        if(!process(input, output, length)) return false;
+        keystream_pos = BLOCK_SIZE;
+        return true;
+    }
+
+    /*------------------------------------------------
+    Performs incremental encryption/decryption of length
+    bytes from input into output. Unlike encrypt(), keystream
+    left unused in the last block is kept for the next call,
+    thus feeding a message in pieces of any size results in
+    the same output as encrypting it at once.
+    input and output may point to the same buffer.
+
+    @param input Next piece of the message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the piece does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool update(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        return process(input, output, length);
+    }
+
+    /*------------------------------------------------
+    Performs incremental encryption/decryption of input
+    into a caller provided output buffer, see update().
+    Only the first input.size() bytes of output are written,
+    if output is shorter only output.size() bytes are processed.
+
+    @param input Next piece of the message for encryption or decryption
+    @param output Buffer for the result
+    @return false if the piece does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool update(std::span<const std::uint8_t> input, std::span<std::uint8_t> output) {
+        return update(input.data(), output.data(), std::min(input.size(), output.size()));
+    }
+
+    /*------------------------------------------------
+    Performs incremental in-place encryption/decryption
+    of buffer, see update().
+
+    @param buffer Next piece of the message to be overwritten
+    @return false if the piece does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool update(std::span<std::uint8_t> buffer) {
+        return update(buffer.data(), buffer.data(), buffer.size());
+    }
+
+    /*------------------------------------------------
+    Writes the next length bytes of keystream itself into
+    output, the same as update() over an all zero message
+    but without reading or XORing any input. Like update(),
+    keystream left unused in the last block is kept for
+    the next call.
+
+    @param output Buffer of at least length bytes for the keystream
+    @param length Number of bytes to write
+    @return false if the stream has less than length bytes left, nothing is written then
+    ------------------------------------------------*/
+    bool generate(std::uint8_t* output, std::size_t length) {
+        if(!fits(blocks_needed(length))) return false;
+#if defined(CHACHA20_TRACE)
+        Chacha20TraceScope trace(hooks, statistics, length, blocks_needed(length), kernel);
+#endif
+
+        // Remaining keystream of the current block
+        const size_t leftover = std::min(BLOCK_SIZE - keystream_pos, length);
+        std::copy_n(keystream.begin() + keystream_pos, leftover, output);
+        keystream_pos += leftover;
+        output += leftover;
+        length -= leftover;
+
+        // Whole blocks go through the selected kernel, whatever it leaves is done by the portable one
+        const size_t blocks = length / BLOCK_SIZE;
+        if(blocks > 0) {
+            const stream_function stream_fn = get_stream_function(kernel);
+            exhausted = !split_counter(internal_state.data(), blocks, [&](std::uint32_t* state, size_t first, size_t count) {
+                std::uint8_t* piece = output + BLOCK_SIZE*first;
+                const size_t done = stream_fn(state, piece, count);
+                keystream_blocks_scalar(state, piece + BLOCK_SIZE*done, count - done);
+            });
+        }
+
+        // Last partial block
+        const size_t message_idx = BLOCK_SIZE*blocks;
+        if(message_idx < length) {
+            serialize(chacha20_block(internal_state.data()), keystream);
+            exhausted = !advance(internal_state.data());
+            keystream_pos = length - message_idx;
+            std::copy_n(keystream.begin(), keystream_pos, output + message_idx);
+        }
+        return true;
+    }
+
+    /*------------------------------------------------
+    Fills buffer with the next bytes of keystream, see generate().
+
+    @param buffer Buffer to be overwritten with keystream
+    @return false if the stream has less than buffer.size() bytes left, nothing is written then
+    ------------------------------------------------*/
+    bool generate(std::span<std::uint8_t> buffer) {
+        return generate(buffer.data(), buffer.size());
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of input into a caller
+    provided output buffer. Only the first input.size()
+    bytes of output are written, if output is shorter
+    only output.size() bytes are processed.
+
+    @param input Message for encryption or decryption
+    @param output Buffer for the result
+    @return false if the message does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool encrypt(std::span<const std::uint8_t> input, std::span<std::uint8_t> output) {
+        return encrypt(input.data(), output.data(), std::min(input.size(), output.size()));
+    }
+
+    /*------------------------------------------------
+    Performs in-place encryption/decryption of buffer.
+
+    @param buffer Message to be overwritten with its encryption or decryption
+    @return false if the message does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool encrypt(std::span<std::uint8_t> buffer) {
+        return encrypt(buffer.data(), buffer.data(), buffer.size());
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption on the given message.
+    Encrypted message is guaranteed to have the same 
+    length as the input message. The result uses the
+    allocator of message, Chacha20Buffer messages thus
+    give 64 byte aligned, pooled results.
+
+    @param message Message for encryption or decryption
+    @return Encrypted/Decrypted message, empty if the message does not fit into the rest of the stream
+    @tparam Allocator allocator of message and of the result
+    ------------------------------------------------*/
+    template<typename Allocator>
+    std::vector<std::uint8_t, Allocator> encrypt(const std::vector<std::uint8_t, Allocator>& message) {
+        std::vector<std::uint8_t, Allocator> output(message); // length of output always == length of input
+        if(!encrypt(output.data(), output.data(), output.size())) return {};
         return output;
     }
 };
 
+using Chacha8 = Chacha<4>;
+using Chacha12 = Chacha<6>;
+using Chacha20 = Chacha<10>;
+
+// Original ChaCha20 with a 64-bit block count and a 64-bit nonce, streams run for 2^70 bytes
+using Chacha20Djb = Chacha<10, true>;
+
+// XChaCha variant with a 192-bit nonce (https://datatracker.ietf.org/doc/html/draft-irtf-cfrg-xchacha)
+// Nonces are long enough to be picked at random for every message
+template<unsigned DOUBLE_ROUNDS>
+class XChacha : public Chacha<DOUBLE_ROUNDS> {
+
+    static constexpr unsigned int KEY_WORDS = 8;
+    static constexpr unsigned int NONCE_WORDS = 6;
+
+public:
+    /*------------------------------------------------
+    Key and nonce words are ordered the same way as
+    for Chacha. The first 128 bits of the nonce derive
+    a subkey through hchacha(), the subkey and the last
+    64 bits of the nonce are then used as a regular
+    Chacha key and nonce.
+
+    key consists of 256bits (8*32)
+    block count consits of 32bits
+    nonce consists of 192bits (6*32)
+    ------------------------------------------------*/
+    explicit XChacha(const std::array<std::uint32_t, KEY_WORDS>& key, std::uint32_t block_count, const std::array<std::uint32_t, NONCE_WORDS>& nonce):
+    Chacha<DOUBLE_ROUNDS>(Chacha<DOUBLE_ROUNDS>::hchacha(key, {nonce[0], nonce[1], nonce[2], nonce[3]}), block_count, {0, nonce[4], nonce[5]}) {
+    }
+
+    // A new extended nonce derives a new subkey, which requires a new object
+    void reset(const std::array<std::uint32_t, 3>&, std::uint32_t) = delete;
+
+    // Jobs carry 96-bit nonces, extended nonces are not supported in batches
+    static bool encrypt_batch(std::span<const typename Chacha<DOUBLE_ROUNDS>::Job>, Chacha20Kernel) = delete;
+};
+
+using XChacha20 = XChacha<10>;
+
 #endif /* #ifndef __CHACHA20__ */
@@ -1,305 +1,1397 @@
-/*
-This Source Code Form is subject to the terms of the Mozilla Public
-License, v. 2.0. If a copy of the MPL was not distributed with this
-file, You can obtain one at https://mozilla.org/MPL/2.0/.
-*/
-
-#ifndef __CHACHA20_AVX__
-#define __CHACHA20_AVX__
-
-#include <array>
-#include <cstdint>
-#include <cmath>
-#include <immintrin.h>
-#include <stdexcept>
-#include <vector>
-
-// Designed accordingly to: https://datatracker.ietf.org/doc/html/rfc8439
-class Chacha20 {
-
-    // Number of double rounds to perform
-    static constexpr unsigned int ROUNDS = 10;  
-    static constexpr unsigned int KEY_WORDS = 8;
-    static constexpr unsigned int NONCE_WORDS = 3;
-    static constexpr unsigned int STATE_SIZE = 16;
-    static constexpr unsigned int ROW_SIZE = 4;
-
-    // Internal state is made of 16 32-bit words
-    // They are arranged as a 2 4x4 matrix as follows
-    // 0 1 2 3 0 1 2 3
-    // 4 5 6 7 4 5 6 7
-    // 8 9 A B 8 9 A B
-    // C D E F C D E F
-    // It is stored by rows and each row is stored twice for optimization used in double rounds
-    // The only difference is block_count which is 1 greater in the second block
-    // Using C style array, since std::array doesn't support aligment
-    __m256i internal_state[ROW_SIZE] alignas(32);
-
-    // Default constant words to be used for context initialization
-    static constexpr std::array<std::uint32_t, 4> CONSTANT_WORDS = {
-        0x61707865, // "expa"
-        0x3320646e, // "nd 3"
-        0x79622d32, // "2-by"
-        0x6b206574  // "te k"
-    };
-
-    // Chacha variables defined upon construction
-    std::array<std::uint32_t, KEY_WORDS> key;
-    std::uint32_t block_count;
-    std::array<std::uint32_t, NONCE_WORDS> nonce;
-
-    /*------------------------------------------------
-    Computes the result of bitwise left-rotating the value of x by s positions.
-    This operation is also known as a left circular shift
-
-    @param x integer to be left rotated
-    @param s number of bits to rotate by
-    @returns shifted value
-    ------------------------------------------------*/
-    static inline __m256i rotl_avx2(__m256i x, std::uint32_t s) {
-        return _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - s));
-    }
-    
-    /*------------------------------------------------
-    Computes the result of bitwise right-rotating the value of x by s positions.
-    This operation is also known as a right circular shift
-
-    @param x integer to be right rotated
-    @param s number of bits to rotate by
-    @returns shifted value
-    ------------------------------------------------*/
-    static inline __m256i rotr_avx2(__m256i x, std::uint32_t s) {
-        return _mm256_or_si256(_mm256_slli_epi32(x, 32-s), _mm256_srli_epi32(x, s));
-    }
-
-    /*------------------------------------------------
-    Computes the little-endian notation of a word x
-
-    @param x integer to be left rotated
-    @returns little-endian value
-    ------------------------------------------------*/
-    static inline std::uint32_t little_endian(std::uint32_t x) {
-        return ((x & 0xFF000000) >> 24) |
-               ((x & 0x00FF0000) >> 8)  |
-               ((x & 0x0000FF00) << 8)  |
-               ((x & 0x000000FF) << 24);
-    }
-
-    /*------------------------------------------------
-    ChaCha20 double round function implemented with
-    AVX2 256bit optimization. Thus it calculates
-    two next states at the same time.
-
-    @param rows array of 256 rows where first 128 bits will be
-           first for chacha20 block and last 128 second chacha20 block
-    ------------------------------------------------*/
-    static void double_round(__m256i state_cpy[ROW_SIZE]) {
-        // Calculate columns
-        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
-        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
-        state_cpy[3] = rotl_avx2(state_cpy[3], 16);
-        
-        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
-        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
-        state_cpy[1] = rotl_avx2(state_cpy[1], 12);
-        
-        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
-        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
-        state_cpy[3] = rotl_avx2(state_cpy[3], 8);
-        
-        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
-        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
-        state_cpy[1] = rotl_avx2(state_cpy[1], 7);
-        
-        // Shift so columns will now represent diagonals
-        state_cpy[1] = _mm256_permutevar8x32_epi32(state_cpy[1], _mm256_set_epi32(6,5,4,7,2,1,0,3));
-        state_cpy[2] = _mm256_permutevar8x32_epi32(state_cpy[2], _mm256_set_epi32(5,4,7,6,1,0,3,2));
-        state_cpy[3] = _mm256_permutevar8x32_epi32(state_cpy[3], _mm256_set_epi32(4,7,6,5,0,3,2,1));
-        
-        // Calculate diagonals
-        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
-        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
-        state_cpy[3] = rotl_avx2(state_cpy[3], 16);
-        
-        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
-        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
-        state_cpy[1] = rotl_avx2(state_cpy[1], 12);
-        
-        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
-        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
-        state_cpy[3] = rotl_avx2(state_cpy[3], 8);
-        
-        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
-        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
-        state_cpy[1] = rotl_avx2(state_cpy[1], 7);
-        
-        // Shift back so state is in it's original order
-        state_cpy[1] = _mm256_permutevar8x32_epi32(state_cpy[1], _mm256_set_epi32(4,7,6,5,0,3,2,1));
-        state_cpy[2] = _mm256_permutevar8x32_epi32(state_cpy[2], _mm256_set_epi32(5,4,7,6,1,0,3,2));
-        state_cpy[3] = _mm256_permutevar8x32_epi32(state_cpy[3], _mm256_set_epi32(6,5,4,7,2,1,0,3));
-    }
-
-    /*------------------------------------------------
-    Performs a block operation that is runs ROUNDS
-    double_rounds on internal_state and then
-    adds the outcome with internal_state before
-    the operation.
-    Does not modify block_count in any way of the state
-    after the operation is applied.
-
-    @param count block count to be used along key and nonce
-    @param output array to hold the result
-    ------------------------------------------------*/
-    void chacha20_block(__m256i output[ROW_SIZE]) {
-        // modify the internal state to fit provided block_count
-        // and increment block_count by 1 in second calculated state
-        internal_state[3] = _mm256_add_epi32(internal_state[3], _mm256_set_epi32(2, 0, 0, 0, 2, 0, 0, 0));
-        for (size_t i = 0; i < ROW_SIZE; i++) {
-            output[i] = internal_state[i];
-        }
-
-        #pragma vector always
-        for(unsigned i = 0; i < ROUNDS; i++) {
-            double_round(output);
-        }
-
-        // Matrix addition of output and internal_state for both states at once
-        for(size_t i = 0; i < ROW_SIZE; i++) {
-            output[i] = _mm256_add_epi32(output[i], internal_state[i]);
-        }
-    }
-
-    /*------------------------------------------------
-    Initialize internal state with given key, nonce and block count.
-
-    The ChaCha20 state is initialized as follows: (https://datatracker.ietf.org/doc/html/rfc8439)
-
-    The first four words (0-3) are constants: 0x61707865, 0x3320646e,
-      0x79622d32, 0x6b206574.
-
-    The next eight words (4-11) are taken from the 256-bit key by
-      reading the bytes in little-endian order, in 4-byte chunks.
-
-    Word 12 is a block counter.  Since each block is 64-byte, a 32-bit
-      word is enough for 256 gigabytes of data.
-
-    Words 13-15 are a nonce, which MUST not be repeated for the same
-      key.  The 13th word is the first 32 bits of the input nonce taken
-      as a little-endian integer, while the 15th word is the last 32
-      bits.
-
-       cccccccc  cccccccc  cccccccc  cccccccc
-       kkkkkkkk  kkkkkkkk  kkkkkkkk  kkkkkkkk
-       kkkkkkkk  kkkkkkkk  kkkkkkkk  kkkkkkkk
-       bbbbbbbb  nnnnnnnn  nnnnnnnn  nnnnnnnn
-
-    c=constant k=key b=blockcount n=nonce
-    ------------------------------------------------*/
-    void init() {
-        // Assign constant words
-        internal_state[0] = _mm256_set_epi32(CONSTANT_WORDS[0], CONSTANT_WORDS[1], CONSTANT_WORDS[2], CONSTANT_WORDS[3],
-                                        CONSTANT_WORDS[0], CONSTANT_WORDS[1], CONSTANT_WORDS[2], CONSTANT_WORDS[3]);
-
-        // Assign key and translate them into little-endian
-        internal_state[1] = _mm256_set_epi32(little_endian(key[0]), little_endian(key[1]), little_endian(key[2]), little_endian(key[3]), 
-                                        little_endian(key[0]), little_endian(key[1]), little_endian(key[2]), little_endian(key[3]));
-        internal_state[2] = _mm256_set_epi32(little_endian(key[4]), little_endian(key[5]), little_endian(key[6]), little_endian(key[7]), 
-                                        little_endian(key[4]), little_endian(key[5]), little_endian(key[6]), little_endian(key[7]));
-        // Assign block_count and nonce
-        // Block_count-2 since block_count is incremented by 2 before encryption by chacha20_block
-        // Block_count-1 since second block should be 1 greater than first block
-        internal_state[3] = _mm256_set_epi32(block_count-2, little_endian(nonce[0]), little_endian(nonce[1]), little_endian(nonce[2]),
-                                        block_count-1, little_endian(nonce[0]), little_endian(nonce[1]), little_endian(nonce[2]));
-    }
-
-    /*------------------------------------------------
-    Sets all bits of arr to 0 in a cryptographically safe way.
-
-    @param arr Array to be zeroed
-    ------------------------------------------------*/
-    template<typename T, size_t N>
-    void secure_zero(std::array<T, N>& arr) {
-        volatile T* p = reinterpret_cast<volatile T*>(arr.data());
-        for (size_t i = 0; i < N; ++i) {
-            p[i] = 0;
-        }
-    }
-
-public:
-    /*------------------------------------------------
-    Since chacha works on words both key and nonce are
-    separated into an array of 32bit unsigned ints.
-    Words within arrays are to be ordered by big-endian.
-    The most significant word is array's first element.
-    The least significant word is array's last element.
-
-    key consists of 256bits (8*32)
-    block count consits of 32bits
-    nonce consists of 96bits (3*32)
-    ------------------------------------------------*/
-    explicit Chacha20(const std::array<std::uint32_t, KEY_WORDS>& key, std::uint32_t block_count, const std::array<std::uint32_t, NONCE_WORDS>& nonce):
-    key ( key), block_count ( block_count), nonce ( nonce) {
-        init();
-    }
-
-    /*------------------------------------------------
-    Upon destruction 0 all sensetive data
-    ------------------------------------------------*/
-    ~Chacha20() {
-        secure_zero(key);
-        block_count = 0;
-        secure_zero(nonce);
-        
-    }
-
-    /*------------------------------------------------
-    Performs encryption/decryption on the given message.
-    Function successively calls chacha20_block() with
-    the same key and nonce while incrementing the 
-    block_count of inner state after each call.
-    The result is concatenated and ordered by little-endian 
-    then XORed with the message resulting in encryption.
-    Encrypted message is guaranteed to have the same 
-    length as the input message.
-
-    @param message Message for encryption or decryption
-    @return Encrypted/Decrypted message
-    ------------------------------------------------*/
-    std::vector<std::uint8_t> encrypt(const std::vector<std::uint8_t>& message) {
-        std::vector<std::uint8_t> output(message.size()); // length of output always == length of input
-        size_t message_idx = 0;
-
-        #pragma vector always
-        while(message_idx < message.size()) {
-            __m256i stream[ROW_SIZE] alignas(32);
-            chacha20_block(stream);
-            // translate stream into a friendly type
-            // elements are in reverse order
-            std::array<std::array<std::uint32_t, ROW_SIZE*2>, 4> stream_arr alignas(32);
-            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&stream_arr[0]), stream[0]);
-            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&stream_arr[1]), stream[1]);
-            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&stream_arr[2]), stream[2]);
-            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&stream_arr[3]), stream[3]);
-
-            // Iteration is done by byte not word, thus STATE_SIZE*4 since STATE_SIZE is measured in words
-            // Since stream has 2 states, we multiply it further by 2 STATE_SIZE*4*2 = STATE_SIZE*8
-            #pragma vector always
-            for(size_t stream_idx = 0, row = 0, corr = 0, arr_idx = 0;
-                stream_idx < STATE_SIZE*8 && message_idx < message.size();
-                stream_idx++, message_idx++, arr_idx++
-            ) {
-                /*  Apply XOR on each byte of the word after 4 full iterations of the for loop.
-                    Word is XORed with a byte, thus only the least significant byte is XORed each time.
-                    Since stream_arr is in reverse order, we iterate from the back
-                */     
-                if(arr_idx/4 == ROW_SIZE) row++, arr_idx = 0;      
-                if(row == ROW_SIZE) corr = ROW_SIZE, row = 0; 
-                output[message_idx] = message[message_idx] ^ (stream_arr[row][7-arr_idx/4-corr]>>(8*(stream_idx%4)));
-            }
-        }
-
-        return output;
-    }
-};
-
-#endif /* #ifndef __CHACHA20_AVX__ */
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_AVX__
+#define __CHACHA20_AVX__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+// x86 SIMD kernels used by the Chacha20 front end in chacha20.hpp.
+// Every kernel is compiled with its own target attribute, so the
+// binary does not need to be built with -mavx2 or -mavx512f.
+// The front end checks the CPU at runtime before calling any of them.
+#define CHACHA20_TARGET_SSE2   __attribute__((target("sse2")))
+#define CHACHA20_TARGET_AVX2   __attribute__((target("avx2")))
+#define CHACHA20_TARGET_AVX512 __attribute__((target("avx512f")))
+
+// Round helpers are forced inline, otherwise fully unrolled rounds
+// make GCC keep them out of line and pass registers through memory
+#ifndef CHACHA20_ALWAYS_INLINE
+#define CHACHA20_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+// GCC 12 reports its own AVX-512 intrinsics as using uninitialized values
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+namespace chacha20_avx {
+
+    static constexpr unsigned int STATE_SIZE = 16;
+    static constexpr unsigned int ROW_SIZE = 4;
+    static constexpr unsigned int BLOCK_SIZE = STATE_SIZE*4;
+
+    // Words 0-3 of every state, the column kernels do not read them from memory
+    static constexpr std::uint32_t CONSTANT_WORDS[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+    // Streaming kernels prefetch input this many bytes ahead of the block being encrypted,
+    // the hardware prefetcher stops at 4 KiB pages while these cover the start of the next one
+    static constexpr std::size_t PREFETCH_DISTANCE = 2048;
+
+    /*------------------------------------------------
+    @param p buffer
+    @param alignment power of 2
+    @return true if p is a multiple of alignment
+    ------------------------------------------------*/
+    static inline bool is_aligned(const void* p, std::size_t alignment) {
+        return (reinterpret_cast<std::uintptr_t>(p) & (alignment - 1)) == 0;
+    }
+
+    /*------------------------------------------------
+    Computes the result of bitwise left-rotating the value of x by S positions
+    for each of the 4 words in x. A rotation by 16 swaps the 16 bit halves
+    of every word with two word shuffles, leaving the shift unit free,
+    other amounts need two shifts and an OR since SSE2 has no byte shuffle.
+    S is a template parameter so every rotate site picks its instructions
+    at compile time.
+
+    @param x words to be left rotated
+    @tparam S number of bits to rotate by
+    @returns shifted value
+    ------------------------------------------------*/
+    template<int S>
+    CHACHA20_TARGET_SSE2
+    static CHACHA20_ALWAYS_INLINE __m128i rotl_sse2(__m128i x) {
+        if constexpr (S == 16) {
+            return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        } else {
+            return _mm_or_si128(_mm_slli_epi32(x, S), _mm_srli_epi32(x, 32 - S));
+        }
+    }
+
+    /*------------------------------------------------
+    Computes the result of bitwise left-rotating the value of x by S positions
+    for each of the 8 words in x. Rotations by whole bytes (8 and 16) are a
+    single vpshufb, which runs on the shuffle port instead of the shift
+    port both other rotations compete for.
+
+    @param x words to be left rotated
+    @tparam S number of bits to rotate by
+    @returns shifted value
+    ------------------------------------------------*/
+    template<int S>
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE __m256i rotl_avx2(__m256i x) {
+        if constexpr (S == 16) {
+            const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                                   2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+            return _mm256_shuffle_epi8(x, rot16);
+        } else if constexpr (S == 8) {
+            const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                                  3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+            return _mm256_shuffle_epi8(x, rot8);
+        } else {
+            return _mm256_or_si256(_mm256_slli_epi32(x, S), _mm256_srli_epi32(x, 32 - S));
+        }
+    }
+
+    /*------------------------------------------------
+    Computes the result of bitwise left-rotating the value of x by S positions
+    for each of the 16 words in x with a single vprold.
+    S is a template parameter since vprold takes an immediate.
+
+    @param x words to be left rotated
+    @tparam S number of bits to rotate by
+    @returns shifted value
+    ------------------------------------------------*/
+    template<int S>
+    CHACHA20_TARGET_AVX512
+    static CHACHA20_ALWAYS_INLINE __m512i rotl_avx512(__m512i x) {
+        return _mm512_rol_epi32(x, S);
+    }
+
+    /*------------------------------------------------
+    ChaCha20 quarter round applied to 4 independent blocks
+    at once. Each register holds the same word of 4 blocks,
+    one block per 32 bit lane.
+
+    @param a word a of 4 blocks in chacha quarter round algorithm
+    @param b word b of 4 blocks in chacha quarter round algorithm
+    @param c word c of 4 blocks in chacha quarter round algorithm
+    @param d word d of 4 blocks in chacha quarter round algorithm
+    ------------------------------------------------*/
+    CHACHA20_TARGET_SSE2
+    static CHACHA20_ALWAYS_INLINE void quarter_round_x4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = rotl_sse2<16>(d);
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = rotl_sse2<12>(b);
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = rotl_sse2<8>(d);
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = rotl_sse2<7>(b);
+    }
+
+    /*------------------------------------------------
+    ChaCha20 quarter round applied to 8 independent blocks
+    at once. Each register holds the same word of 8 blocks,
+    one block per 32 bit lane.
+
+    @param a word a of 8 blocks in chacha quarter round algorithm
+    @param b word b of 8 blocks in chacha quarter round algorithm
+    @param c word c of 8 blocks in chacha quarter round algorithm
+    @param d word d of 8 blocks in chacha quarter round algorithm
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void quarter_round_x8(__m256i& a, __m256i& b, __m256i& c, __m256i& d) {
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = rotl_avx2<16>(d);
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = rotl_avx2<12>(b);
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = rotl_avx2<8>(d);
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = rotl_avx2<7>(b);
+    }
+
+    /*------------------------------------------------
+    ChaCha20 quarter round applied to 16 independent blocks
+    at once, rotations are done with a single vprold.
+
+    @param a word a of 16 blocks in chacha quarter round algorithm
+    @param b word b of 16 blocks in chacha quarter round algorithm
+    @param c word c of 16 blocks in chacha quarter round algorithm
+    @param d word d of 16 blocks in chacha quarter round algorithm
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX512
+    static CHACHA20_ALWAYS_INLINE void quarter_round_x16(__m512i& a, __m512i& b, __m512i& c, __m512i& d) {
+        a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = rotl_avx512<16>(d);
+        c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = rotl_avx512<12>(b);
+        a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = rotl_avx512<8>(d);
+        c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = rotl_avx512<7>(b);
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on 4 blocks sliced by columns,
+    alternating between columns and diagonals. The rounds
+    are unrolled at compile time.
+
+    @param x array of 16 registers, each holding one word of 4 blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    CHACHA20_TARGET_SSE2
+    static CHACHA20_ALWAYS_INLINE void double_rounds_x4(__m128i x[STATE_SIZE]) {
+        if constexpr (N > 0) {
+            // column rounds
+            quarter_round_x4(x[0], x[4], x[8],  x[12]);
+            quarter_round_x4(x[1], x[5], x[9],  x[13]);
+            quarter_round_x4(x[2], x[6], x[10], x[14]);
+            quarter_round_x4(x[3], x[7], x[11], x[15]);
+
+            // diagonal rounds
+            quarter_round_x4(x[0], x[5], x[10], x[15]);
+            quarter_round_x4(x[1], x[6], x[11], x[12]);
+            quarter_round_x4(x[2], x[7], x[8],  x[13]);
+            quarter_round_x4(x[3], x[4], x[9],  x[14]);
+
+            double_rounds_x4<N - 1>(x);
+        }
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on 8 blocks sliced by columns,
+    alternating between columns and diagonals. The rounds
+    are unrolled at compile time.
+
+    @param x array of 16 registers, each holding one word of 8 blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void double_rounds_x8(__m256i x[STATE_SIZE]) {
+        if constexpr (N > 0) {
+            // column rounds
+            quarter_round_x8(x[0], x[4], x[8],  x[12]);
+            quarter_round_x8(x[1], x[5], x[9],  x[13]);
+            quarter_round_x8(x[2], x[6], x[10], x[14]);
+            quarter_round_x8(x[3], x[7], x[11], x[15]);
+
+            // diagonal rounds
+            quarter_round_x8(x[0], x[5], x[10], x[15]);
+            quarter_round_x8(x[1], x[6], x[11], x[12]);
+            quarter_round_x8(x[2], x[7], x[8],  x[13]);
+            quarter_round_x8(x[3], x[4], x[9],  x[14]);
+
+            double_rounds_x8<N - 1>(x);
+        }
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on 16 blocks sliced by columns,
+    alternating between columns and diagonals. The rounds
+    are unrolled at compile time.
+
+    @param x array of 16 registers, each holding one word of 16 blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    CHACHA20_TARGET_AVX512
+    static CHACHA20_ALWAYS_INLINE void double_rounds_x16(__m512i x[STATE_SIZE]) {
+        if constexpr (N > 0) {
+            // column rounds
+            quarter_round_x16(x[0], x[4], x[8],  x[12]);
+            quarter_round_x16(x[1], x[5], x[9],  x[13]);
+            quarter_round_x16(x[2], x[6], x[10], x[14]);
+            quarter_round_x16(x[3], x[7], x[11], x[15]);
+
+            // diagonal rounds
+            quarter_round_x16(x[0], x[5], x[10], x[15]);
+            quarter_round_x16(x[1], x[6], x[11], x[12]);
+            quarter_round_x16(x[2], x[7], x[8],  x[13]);
+            quarter_round_x16(x[3], x[4], x[9],  x[14]);
+
+            double_rounds_x16<N - 1>(x);
+        }
+    }
+
+    /*------------------------------------------------
+    ChaCha20 double round function implemented with
+    AVX2 256bit optimization. Thus it calculates
+    two next states at the same time.
+
+    @param rows array of 256 rows where first 128 bits will be
+           first for chacha20 block and last 128 second chacha20 block
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void double_round(__m256i state_cpy[ROW_SIZE]) {
+        // Calculate columns
+        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
+        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
+        state_cpy[3] = rotl_avx2<16>(state_cpy[3]);
+
+        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
+        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
+        state_cpy[1] = rotl_avx2<12>(state_cpy[1]);
+
+        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
+        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
+        state_cpy[3] = rotl_avx2<8>(state_cpy[3]);
+
+        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
+        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
+        state_cpy[1] = rotl_avx2<7>(state_cpy[1]);
+
+        // Shift so columns will now represent diagonals
+        // Both blocks are rotated within their own 128 bit lane
+        state_cpy[1] = _mm256_shuffle_epi32(state_cpy[1], _MM_SHUFFLE(0,3,2,1));
+        state_cpy[2] = _mm256_shuffle_epi32(state_cpy[2], _MM_SHUFFLE(1,0,3,2));
+        state_cpy[3] = _mm256_shuffle_epi32(state_cpy[3], _MM_SHUFFLE(2,1,0,3));
+
+        // Calculate diagonals
+        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
+        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
+        state_cpy[3] = rotl_avx2<16>(state_cpy[3]);
+
+        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
+        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
+        state_cpy[1] = rotl_avx2<12>(state_cpy[1]);
+
+        state_cpy[0] = _mm256_add_epi32(state_cpy[0], state_cpy[1]);
+        state_cpy[3] = _mm256_xor_si256(state_cpy[3], state_cpy[0]);
+        state_cpy[3] = rotl_avx2<8>(state_cpy[3]);
+
+        state_cpy[2] = _mm256_add_epi32(state_cpy[2], state_cpy[3]);
+        state_cpy[1] = _mm256_xor_si256(state_cpy[1], state_cpy[2]);
+        state_cpy[1] = rotl_avx2<7>(state_cpy[1]);
+
+        // Shift back so state is in it's original order
+        state_cpy[1] = _mm256_shuffle_epi32(state_cpy[1], _MM_SHUFFLE(2,1,0,3));
+        state_cpy[2] = _mm256_shuffle_epi32(state_cpy[2], _MM_SHUFFLE(1,0,3,2));
+        state_cpy[3] = _mm256_shuffle_epi32(state_cpy[3], _MM_SHUFFLE(0,3,2,1));
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on a pair of blocks held by
+    rows, unrolled at compile time.
+
+    @param x array of 4 rows of both blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void double_rounds(__m256i x[ROW_SIZE]) {
+        if constexpr (N > 0) {
+            double_round(x);
+            double_rounds<N - 1>(x);
+        }
+    }
+
+    /*------------------------------------------------
+    Transposes 4 registers holding one word of 4 blocks each
+    into 4 registers holding 4 consecutive words of one block.
+    After the call x[i] holds the words of block i.
+
+    @param x array of 4 registers to be transposed in place
+    ------------------------------------------------*/
+    CHACHA20_TARGET_SSE2
+    static CHACHA20_ALWAYS_INLINE void transpose_x4(__m128i x[4]) {
+        const __m128i t0 = _mm_unpacklo_epi32(x[0], x[1]);
+        const __m128i t1 = _mm_unpackhi_epi32(x[0], x[1]);
+        const __m128i t2 = _mm_unpacklo_epi32(x[2], x[3]);
+        const __m128i t3 = _mm_unpackhi_epi32(x[2], x[3]);
+        x[0] = _mm_unpacklo_epi64(t0, t2);
+        x[1] = _mm_unpackhi_epi64(t0, t2);
+        x[2] = _mm_unpacklo_epi64(t1, t3);
+        x[3] = _mm_unpackhi_epi64(t1, t3);
+    }
+
+    /*------------------------------------------------
+    Transposes 8 registers holding one word of 8 blocks each
+    into 8 registers holding 8 consecutive words of one block.
+    After the call x[i] holds the words of block i.
+
+    @param x array of 8 registers to be transposed in place
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void transpose_x8(__m256i x[8]) {
+        // Interleave words of register pairs within 128 bit lanes
+        const __m256i t0 = _mm256_unpacklo_epi32(x[0], x[1]);
+        const __m256i t1 = _mm256_unpackhi_epi32(x[0], x[1]);
+        const __m256i t2 = _mm256_unpacklo_epi32(x[2], x[3]);
+        const __m256i t3 = _mm256_unpackhi_epi32(x[2], x[3]);
+        const __m256i t4 = _mm256_unpacklo_epi32(x[4], x[5]);
+        const __m256i t5 = _mm256_unpackhi_epi32(x[4], x[5]);
+        const __m256i t6 = _mm256_unpacklo_epi32(x[6], x[7]);
+        const __m256i t7 = _mm256_unpackhi_epi32(x[6], x[7]);
+
+        // Each 128 bit lane now holds 4 words of a single block
+        const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+        const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+        const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+        const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+        const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+        const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+        const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+        const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+        // Join lower lanes for blocks 0-3, upper lanes for blocks 4-7
+        x[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        x[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        x[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        x[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        x[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        x[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        x[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        x[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    /*------------------------------------------------
+    Transposes 16 registers holding one word of 16 blocks each
+    into 16 registers holding all words of one block.
+    After the call x[i] holds the words of block i.
+
+    @param x array of 16 registers to be transposed in place
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX512
+    static CHACHA20_ALWAYS_INLINE void transpose_x16(__m512i x[STATE_SIZE]) {
+        // 4x4 transpose within every 128 bit lane for each group of 4 words
+        // u[4*g+j] lane k holds words 4g..4g+3 of block 4k+j
+        __m512i u[STATE_SIZE];
+        for(size_t g = 0; g < 4; g++) {
+            const __m512i t0 = _mm512_unpacklo_epi32(x[4*g],     x[4*g + 1]);
+            const __m512i t1 = _mm512_unpackhi_epi32(x[4*g],     x[4*g + 1]);
+            const __m512i t2 = _mm512_unpacklo_epi32(x[4*g + 2], x[4*g + 3]);
+            const __m512i t3 = _mm512_unpackhi_epi32(x[4*g + 2], x[4*g + 3]);
+            u[4*g]     = _mm512_unpacklo_epi64(t0, t2);
+            u[4*g + 1] = _mm512_unpackhi_epi64(t0, t2);
+            u[4*g + 2] = _mm512_unpacklo_epi64(t1, t3);
+            u[4*g + 3] = _mm512_unpackhi_epi64(t1, t3);
+        }
+
+        // 4x4 transpose of 128 bit lanes across word groups
+        for(size_t j = 0; j < 4; j++) {
+            const __m512i s0 = _mm512_shuffle_i32x4(u[j],     u[4 + j],  _MM_SHUFFLE(1, 0, 1, 0));
+            const __m512i s1 = _mm512_shuffle_i32x4(u[j],     u[4 + j],  _MM_SHUFFLE(3, 2, 3, 2));
+            const __m512i s2 = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], _MM_SHUFFLE(1, 0, 1, 0));
+            const __m512i s3 = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], _MM_SHUFFLE(3, 2, 3, 2));
+            x[j]      = _mm512_shuffle_i32x4(s0, s2, _MM_SHUFFLE(2, 0, 2, 0));
+            x[4 + j]  = _mm512_shuffle_i32x4(s0, s2, _MM_SHUFFLE(3, 1, 3, 1));
+            x[8 + j]  = _mm512_shuffle_i32x4(s1, s3, _MM_SHUFFLE(2, 0, 2, 0));
+            x[12 + j] = _mm512_shuffle_i32x4(s1, s3, _MM_SHUFFLE(3, 1, 3, 1));
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts 4 consecutive blocks (256 bytes) of input.
+    The state is sliced by columns, every register holds
+    one word of the state for 4 blocks, thus rounds need
+    no diagonal shuffles. The result is transposed back
+    into blocks before the XOR.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input 256 bytes to be encrypted
+    @param output buffer of at least 256 bytes for the result
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true>
+    CHACHA20_TARGET_SSE2
+    static inline void chacha20_blocks4(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output) {
+        __m128i words[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            words[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+        }
+        // Every lane gets its own block_count
+        words[12] = _mm_add_epi32(words[12], _mm_setr_epi32(0, 1, 2, 3));
+
+        __m128i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm_add_epi32(x[i], words[i]);
+        }
+
+        // x[4*g+j] now holds words 4g..4g+3 of block j
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                __m128i stream = x[4*g + j];
+                if constexpr (XOR) {
+                    stream = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input + BLOCK_SIZE*j + 16*g)), stream);
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output + BLOCK_SIZE*j + 16*g), stream);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts 8 consecutive blocks (512 bytes) of input.
+    The state is sliced by columns the same way as
+    in chacha20_blocks4().
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input 512 bytes to be encrypted
+    @param output buffer of at least 512 bytes for the result
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    @tparam ALIGNED true if input and output are 32 byte aligned, aligned loads and stores are used then
+    @tparam STREAM true to prefetch input ahead and write output with non-temporal stores
+                   bypassing the caches, output must be 32 byte aligned then
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true, bool ALIGNED = false, bool STREAM = false>
+    CHACHA20_TARGET_AVX2
+    static inline void chacha20_blocks8(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output) {
+        __m256i words[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            words[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+        }
+        // Every lane gets its own block_count
+        words[12] = _mm256_add_epi32(words[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+        __m256i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        if constexpr (XOR && STREAM) {
+            for(size_t i = 0; i < 8; i++) {
+                _mm_prefetch(reinterpret_cast<const char*>(input + PREFETCH_DISTANCE + BLOCK_SIZE*i), _MM_HINT_T0);
+            }
+        }
+
+        double_rounds_x8<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm256_add_epi32(x[i], words[i]);
+        }
+
+        // x[0..7] now holds words 0-7 of block i, x[8..15] words 8-15
+        transpose_x8(x);
+        transpose_x8(x + 8);
+
+        for(size_t i = 0; i < 8; i++) {
+            __m256i* out = reinterpret_cast<__m256i*>(output + BLOCK_SIZE*i);
+            __m256i low = x[i], high = x[i + 8];
+            if constexpr (XOR) {
+                const __m256i* in = reinterpret_cast<const __m256i*>(input + BLOCK_SIZE*i);
+                if constexpr (ALIGNED) {
+                    low = _mm256_xor_si256(_mm256_load_si256(in), low);
+                    high = _mm256_xor_si256(_mm256_load_si256(in + 1), high);
+                } else {
+                    low = _mm256_xor_si256(_mm256_loadu_si256(in), low);
+                    high = _mm256_xor_si256(_mm256_loadu_si256(in + 1), high);
+                }
+            }
+            if constexpr (STREAM) {
+                _mm256_stream_si256(out,     low);
+                _mm256_stream_si256(out + 1, high);
+            } else if constexpr (ALIGNED) {
+                _mm256_store_si256(out,     low);
+                _mm256_store_si256(out + 1, high);
+            } else {
+                _mm256_storeu_si256(out,     low);
+                _mm256_storeu_si256(out + 1, high);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts 16 consecutive blocks (1024 bytes) of input
+    using AVX-512, the state is sliced by columns the same
+    way as in chacha20_blocks4().
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input 1024 bytes to be encrypted
+    @param output buffer of at least 1024 bytes for the result
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    @tparam ALIGNED true if input and output are 64 byte aligned, aligned loads and stores are used then
+    @tparam STREAM true to prefetch input ahead and write output with non-temporal stores
+                   bypassing the caches, output must be 64 byte aligned then
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true, bool ALIGNED = false, bool STREAM = false>
+    CHACHA20_TARGET_AVX512
+    static inline void chacha20_blocks16(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output) {
+        __m512i words[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            words[i] = _mm512_set1_epi32(static_cast<int>(state[i]));
+        }
+        // Every lane gets its own block_count
+        words[12] = _mm512_add_epi32(words[12], _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+
+        __m512i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        if constexpr (XOR && STREAM) {
+            for(size_t i = 0; i < STATE_SIZE; i++) {
+                _mm_prefetch(reinterpret_cast<const char*>(input + PREFETCH_DISTANCE + BLOCK_SIZE*i), _MM_HINT_T0);
+            }
+        }
+
+        double_rounds_x16<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm512_add_epi32(x[i], words[i]);
+        }
+
+        transpose_x16(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            __m512i stream = x[i];
+            if constexpr (XOR) {
+                const __m512i in = ALIGNED ? _mm512_load_si512(input + BLOCK_SIZE*i) : _mm512_loadu_si512(input + BLOCK_SIZE*i);
+                stream = _mm512_xor_si512(in, stream);
+            }
+            if constexpr (STREAM) {
+                _mm512_stream_si512(reinterpret_cast<__m512i*>(output + BLOCK_SIZE*i), stream);
+            } else if constexpr (ALIGNED) {
+                _mm512_store_si512(output + BLOCK_SIZE*i, stream);
+            } else {
+                _mm512_storeu_si512(output + BLOCK_SIZE*i, stream);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts pairs of consecutive blocks, 128 bytes of input
+    per pair. Each row of the 4x4 state matrix is held in a
+    single register twice, the first block of a pair occupies
+    the lower 128 bits and the second block the upper 128 bits.
+    The rows are loaded once and the block count is advanced
+    within the register, thus between pairs only input and
+    output are touched in memory.
+    This kernel serves messages too short for chacha20_blocks8().
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input pairs*128 bytes to be encrypted
+    @param output buffer of at least pairs*128 bytes for the result
+    @param pairs number of pairs of blocks
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true>
+    CHACHA20_TARGET_AVX2
+    static inline void chacha20_blocks2(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t pairs) {
+        __m256i rows[ROW_SIZE];
+        for(size_t i = 0; i < ROW_SIZE; i++) {
+            rows[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + ROW_SIZE*i)));
+        }
+        // block_count of the second block is 1 greater than of the first one
+        rows[3] = _mm256_add_epi32(rows[3], _mm256_setr_epi32(0, 0, 0, 0, 1, 0, 0, 0));
+        const __m256i next_pair = _mm256_setr_epi32(2, 0, 0, 0, 2, 0, 0, 0);
+
+        for(size_t pair = 0; pair < pairs; pair++) {
+            __m256i x[ROW_SIZE];
+            for(size_t i = 0; i < ROW_SIZE; i++) {
+                x[i] = rows[i];
+            }
+
+            double_rounds<ROUNDS>(x);
+
+            // Matrix addition of x and rows for both states at once
+            for(size_t i = 0; i < ROW_SIZE; i++) {
+                x[i] = _mm256_add_epi32(x[i], rows[i]);
+            }
+
+            // Regroup rows by lane so that each block is XORed contiguously,
+            // straight out of the working registers
+            const __m256i ordered[ROW_SIZE] = {
+                _mm256_permute2x128_si256(x[0], x[1], 0x20),
+                _mm256_permute2x128_si256(x[2], x[3], 0x20),
+                _mm256_permute2x128_si256(x[0], x[1], 0x31),
+                _mm256_permute2x128_si256(x[2], x[3], 0x31)
+            };
+            for(size_t i = 0; i < ROW_SIZE; i++) {
+                __m256i stream = ordered[i];
+                if constexpr (XOR) {
+                    stream = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + 2*BLOCK_SIZE*pair + 32*i)), stream);
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 2*BLOCK_SIZE*pair + 32*i), stream);
+            }
+
+            rows[3] = _mm256_add_epi32(rows[3], next_pair);
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts as many whole blocks as the SSE2 kernel can,
+    4 blocks at a time. Afterwards block_count in state
+    is advanced by the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    inline std::size_t xor_blocks_sse2(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        for(; blocks - done >= 4; done += 4, state[12] += 4) {
+            chacha20_blocks4<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Encrypts as many whole blocks as the AVX2 kernels can,
+    8 blocks at a time and then the remainder 2 blocks at
+    a time. Afterwards block_count in state is advanced by
+    the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    inline std::size_t xor_blocks_avx2(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(input, 32) && is_aligned(output, 32)) {
+            for(; blocks - done >= 8; done += 8, state[12] += 8) {
+                chacha20_blocks8<ROUNDS, true, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+            }
+        }
+        for(; blocks - done >= 8; done += 8, state[12] += 8) {
+            chacha20_blocks8<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+        }
+        const std::size_t pairs = (blocks - done) / 2;
+        chacha20_blocks2<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done, pairs);
+        state[12] += static_cast<std::uint32_t>(2*pairs);
+        return done + 2*pairs;
+    }
+
+    /*------------------------------------------------
+    Encrypts as many whole blocks as the AVX-512 kernel can,
+    16 blocks at a time, the remainder is passed on to the
+    AVX2 kernels. Afterwards block_count in state is
+    advanced by the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    inline std::size_t xor_blocks_avx512(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(input, 64) && is_aligned(output, 64)) {
+            for(; blocks - done >= 16; done += 16, state[12] += 16) {
+                chacha20_blocks16<ROUNDS, true, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+            }
+        }
+        for(; blocks - done >= 16; done += 16, state[12] += 16) {
+            chacha20_blocks16<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+        }
+        return done + xor_blocks_avx2<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+    /*------------------------------------------------
+    Encrypts whole blocks like xor_blocks_avx2(), but for
+    output that is not read again soon: input is prefetched
+    ahead and 8 blocks at a time are written with
+    non-temporal stores, so neither evicts other data from
+    the caches. Output that is not 32 byte aligned goes
+    through xor_blocks_avx2() instead.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    inline std::size_t xor_blocks_stream_avx2(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(output, 32)) {
+            if(is_aligned(input, 32)) {
+                for(; blocks - done >= 8; done += 8, state[12] += 8) {
+                    chacha20_blocks8<ROUNDS, true, true, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+                }
+            }
+            for(; blocks - done >= 8; done += 8, state[12] += 8) {
+                chacha20_blocks8<ROUNDS, true, false, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+            }
+            // Non-temporal stores are weakly ordered, they are to be visible once the call returns
+            _mm_sfence();
+        }
+        return done + xor_blocks_avx2<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+    /*------------------------------------------------
+    Encrypts whole blocks like xor_blocks_avx512() with
+    prefetched input and non-temporal stores, 16 blocks at
+    a time, see xor_blocks_stream_avx2(). Output that is
+    not 64 byte aligned goes through xor_blocks_stream_avx2().
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    inline std::size_t xor_blocks_stream_avx512(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(output, 64)) {
+            if(is_aligned(input, 64)) {
+                for(; blocks - done >= 16; done += 16, state[12] += 16) {
+                    chacha20_blocks16<ROUNDS, true, true, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+                }
+            }
+            for(; blocks - done >= 16; done += 16, state[12] += 16) {
+                chacha20_blocks16<ROUNDS, true, false, true>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+            }
+            _mm_sfence();
+        }
+        return done + xor_blocks_stream_avx2<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+    /*------------------------------------------------
+    Writes as many whole blocks of keystream itself as
+    the SSE2 kernel can, 4 blocks at a time. Every kernel
+    of this kind shares the signature and advances
+    block_count in state by the number of blocks written.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    inline std::size_t keystream_blocks_sse2(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        for(; blocks - done >= 4; done += 4, state[12] += 4) {
+            chacha20_blocks4<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Writes as many whole blocks of keystream itself as
+    the AVX2 kernels can, 8 blocks at a time and then
+    the remainder 2 blocks at a time.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    inline std::size_t keystream_blocks_avx2(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(output, 32)) {
+            for(; blocks - done >= 8; done += 8, state[12] += 8) {
+                chacha20_blocks8<ROUNDS, false, true>(state, nullptr, output + BLOCK_SIZE*done);
+            }
+        }
+        for(; blocks - done >= 8; done += 8, state[12] += 8) {
+            chacha20_blocks8<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done);
+        }
+        const std::size_t pairs = (blocks - done) / 2;
+        chacha20_blocks2<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done, pairs);
+        state[12] += static_cast<std::uint32_t>(2*pairs);
+        return done + 2*pairs;
+    }
+
+    /*------------------------------------------------
+    Writes as many whole blocks of keystream itself as
+    the AVX-512 kernel can, 16 blocks at a time, the
+    remainder is passed on to the AVX2 kernels.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    inline std::size_t keystream_blocks_avx512(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        if(is_aligned(output, 64)) {
+            for(; blocks - done >= 16; done += 16, state[12] += 16) {
+                chacha20_blocks16<ROUNDS, false, true>(state, nullptr, output + BLOCK_SIZE*done);
+            }
+        }
+        for(; blocks - done >= 16; done += 16, state[12] += 16) {
+            chacha20_blocks16<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done);
+        }
+        return done + keystream_blocks_avx2<ROUNDS>(state, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 4
+    independent states, which may differ in any word.
+    The states are transposed into the column sliced
+    layout of chacha20_blocks4(), thus the lanes of a
+    register belong to different messages.
+
+    @param states 4 states of 16 words each, one after another
+    @param keystream buffer of at least 256 bytes, block i belongs to state i
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    static inline void chacha20_lanes4(const std::uint32_t* states, std::uint8_t* keystream) {
+        // words[4*g+j] holds words 4g..4g+3 of state j, the transpose slices them by word
+        __m128i words[STATE_SIZE];
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                words[4*g + j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(states + STATE_SIZE*j + 4*g));
+            }
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(words + 4*g);
+        }
+
+        __m128i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm_add_epi32(x[i], words[i]);
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(keystream + BLOCK_SIZE*j + 16*g), x[4*g + j]);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 8
+    independent states, see chacha20_lanes4().
+
+    @param states 8 states of 16 words each, one after another
+    @param keystream buffer of at least 512 bytes, block i belongs to state i
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    static inline void chacha20_lanes8(const std::uint32_t* states, std::uint8_t* keystream) {
+        // words[i] holds words 0-7 of state i and words[8+i] words 8-15, the transpose slices them by word
+        __m256i words[STATE_SIZE];
+        for(size_t i = 0; i < 8; i++) {
+            words[i]     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + STATE_SIZE*i));
+            words[i + 8] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + STATE_SIZE*i + 8));
+        }
+        transpose_x8(words);
+        transpose_x8(words + 8);
+
+        __m256i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x8<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm256_add_epi32(x[i], words[i]);
+        }
+        transpose_x8(x);
+        transpose_x8(x + 8);
+
+        for(size_t i = 0; i < 8; i++) {
+            __m256i* out = reinterpret_cast<__m256i*>(keystream + BLOCK_SIZE*i);
+            _mm256_storeu_si256(out,     x[i]);
+            _mm256_storeu_si256(out + 1, x[i + 8]);
+        }
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 16
+    independent states using AVX-512, see chacha20_lanes4().
+
+    @param states 16 states of 16 words each, one after another
+    @param keystream buffer of at least 1024 bytes, block i belongs to state i
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    static inline void chacha20_lanes16(const std::uint32_t* states, std::uint8_t* keystream) {
+        // words[i] holds state i, the transpose slices them by word
+        __m512i words[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            words[i] = _mm512_loadu_si512(states + STATE_SIZE*i);
+        }
+        transpose_x16(words);
+
+        __m512i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x16<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm512_add_epi32(x[i], words[i]);
+        }
+        transpose_x16(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            _mm512_storeu_si512(keystream + BLOCK_SIZE*i, x[i]);
+        }
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    independent states as the SSE2 kernel can, 4 at a time.
+    Every kernel of this kind shares the signature, the
+    states are left unchanged.
+
+    @param states count states of 16 words each, one after another
+    @param keystream buffer of at least count*64 bytes, block i belongs to state i
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    inline std::size_t keystream_lanes_sse2(const std::uint32_t* states, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 4; done += 4) {
+            chacha20_lanes4<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    independent states as the AVX2 kernel can, 8 at a
+    time, the remainder is passed on to the SSE2 kernel.
+
+    @param states count states of 16 words each, one after another
+    @param keystream buffer of at least count*64 bytes, block i belongs to state i
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    inline std::size_t keystream_lanes_avx2(const std::uint32_t* states, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 8; done += 8) {
+            chacha20_lanes8<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done);
+        }
+        return done + keystream_lanes_sse2<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done, count - done);
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    independent states as the AVX-512 kernel can, 16 at
+    a time, the remainder is passed on to the AVX2 kernel.
+
+    @param states count states of 16 words each, one after another
+    @param keystream buffer of at least count*64 bytes, block i belongs to state i
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    inline std::size_t keystream_lanes_avx512(const std::uint32_t* states, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 16; done += 16) {
+            chacha20_lanes16<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done);
+        }
+        return done + keystream_lanes_avx2<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done, count - done);
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 4
+    independent states stored by word rather than by
+    state: word 4+r of state j is rows[stride*r + j].
+    Words of 4 states are thus loaded with one load each
+    and need no transpose before the rounds, words 0-3
+    are the constants.
+
+    @param rows words 4-15 of the states, one row of stride words per state word
+    @param stride distance between rows in words
+    @param keystream buffer of at least 256 bytes, block j belongs to state j
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    static inline void chacha20_columns4(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream) {
+        __m128i words[STATE_SIZE];
+        for(size_t i = 0; i < 4; i++) {
+            words[i] = _mm_set1_epi32(static_cast<int>(CONSTANT_WORDS[i]));
+        }
+        for(size_t i = 4; i < STATE_SIZE; i++) {
+            words[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + stride*(i - 4)));
+        }
+
+        __m128i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm_add_epi32(x[i], words[i]);
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(keystream + BLOCK_SIZE*j + 16*g), x[4*g + j]);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 8
+    independent states stored by word, see chacha20_columns4().
+
+    @param rows words 4-15 of the states, one row of stride words per state word
+    @param stride distance between rows in words
+    @param keystream buffer of at least 512 bytes, block j belongs to state j
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    static inline void chacha20_columns8(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream) {
+        __m256i words[STATE_SIZE];
+        for(size_t i = 0; i < 4; i++) {
+            words[i] = _mm256_set1_epi32(static_cast<int>(CONSTANT_WORDS[i]));
+        }
+        for(size_t i = 4; i < STATE_SIZE; i++) {
+            words[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows + stride*(i - 4)));
+        }
+
+        __m256i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x8<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm256_add_epi32(x[i], words[i]);
+        }
+        transpose_x8(x);
+        transpose_x8(x + 8);
+
+        for(size_t j = 0; j < 8; j++) {
+            __m256i* out = reinterpret_cast<__m256i*>(keystream + BLOCK_SIZE*j);
+            _mm256_storeu_si256(out,     x[j]);
+            _mm256_storeu_si256(out + 1, x[j + 8]);
+        }
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 16
+    independent states stored by word using AVX-512,
+    see chacha20_columns4().
+
+    @param rows words 4-15 of the states, one row of stride words per state word
+    @param stride distance between rows in words
+    @param keystream buffer of at least 1024 bytes, block j belongs to state j
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    static inline void chacha20_columns16(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream) {
+        __m512i words[STATE_SIZE];
+        for(size_t i = 0; i < 4; i++) {
+            words[i] = _mm512_set1_epi32(static_cast<int>(CONSTANT_WORDS[i]));
+        }
+        for(size_t i = 4; i < STATE_SIZE; i++) {
+            words[i] = _mm512_loadu_si512(rows + stride*(i - 4));
+        }
+
+        __m512i x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x16<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = _mm512_add_epi32(x[i], words[i]);
+        }
+        transpose_x16(x);
+
+        for(size_t j = 0; j < STATE_SIZE; j++) {
+            _mm512_storeu_si512(keystream + BLOCK_SIZE*j, x[j]);
+        }
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    states stored by word as the SSE2 kernel can, 4 at a
+    time. Every kernel of this kind shares the signature,
+    the states are left unchanged.
+
+    @param rows words 4-15 of the states, word 4+r of state j is rows[stride*r + j]
+    @param stride distance between rows in words
+    @param keystream buffer of at least count*64 bytes, block j belongs to state j
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_SSE2
+    inline std::size_t keystream_columns_sse2(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 4; done += 4) {
+            chacha20_columns4<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    states stored by word as the AVX2 kernel can, 8 at a
+    time, the remainder is passed on to the SSE2 kernel.
+
+    @param rows words 4-15 of the states, word 4+r of state j is rows[stride*r + j]
+    @param stride distance between rows in words
+    @param keystream buffer of at least count*64 bytes, block j belongs to state j
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX2
+    inline std::size_t keystream_columns_avx2(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 8; done += 8) {
+            chacha20_columns8<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done);
+        }
+        return done + keystream_columns_sse2<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done, count - done);
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    states stored by word as the AVX-512 kernel can, 16
+    at a time, the remainder is passed on to the AVX2 kernel.
+
+    @param rows words 4-15 of the states, word 4+r of state j is rows[stride*r + j]
+    @param stride distance between rows in words
+    @param keystream buffer of at least count*64 bytes, block j belongs to state j
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    CHACHA20_TARGET_AVX512
+    inline std::size_t keystream_columns_avx512(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 16; done += 16) {
+            chacha20_columns16<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done);
+        }
+        return done + keystream_columns_avx2<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done, count - done);
+    }
+
+    // Poly1305 works on 130-bit numbers held as 5 limbs of 26 bits,
+    // the AVX2 kernel keeps one limb of 4 numbers per register
+    static constexpr unsigned int POLY1305_LIMBS = 5;
+    static constexpr unsigned int POLY1305_BLOCK_SIZE = 16;
+
+    /*------------------------------------------------
+    Splits 4 consecutive 16 byte Poly1305 blocks into limbs,
+    lane i of every limb belongs to block i. The 2^128
+    bit is set in every block.
+
+    @param m 64 bytes of message
+    @param limbs holds the result
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void poly1305_load_avx2(const std::uint8_t* m, __m256i limbs[POLY1305_LIMBS]) {
+        const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+
+        // Low and high 64 bits of blocks 0 and 1, then of blocks 2 and 3
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m + 32));
+
+        // Unpacking yields the order of blocks 0 2 1 3, the permutation restores it
+        const __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+        limbs[0] = _mm256_and_si256(lo, mask);
+        limbs[1] = _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask);
+        limbs[2] = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask);
+        limbs[3] = _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask);
+        limbs[4] = _mm256_or_si256(_mm256_srli_epi64(hi, 40), _mm256_set1_epi64x(1 << 24));
+    }
+
+    /*------------------------------------------------
+    Multiplies 4 accumulators by 4 multipliers modulo
+    2^130-5, the result is partially reduced so that
+    every limb fits in 26 bits plus a small carry.
+
+    @param h accumulators, overwritten with the result
+    @param r multipliers
+    @param s multipliers times 5, used for limbs wrapping past 2^130
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    static CHACHA20_ALWAYS_INLINE void poly1305_multiply_avx2(__m256i h[POLY1305_LIMBS], const __m256i r[POLY1305_LIMBS], const __m256i s[POLY1305_LIMBS]) {
+        const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+
+        __m256i d[POLY1305_LIMBS];
+        for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+            d[i] = _mm256_setzero_si256();
+            for(unsigned j = 0; j < POLY1305_LIMBS; j++) {
+                // Limb j of h times limb i-j of r, wrapping around the top multiplies by 5
+                const __m256i m = j <= i ? r[i - j] : s[POLY1305_LIMBS + i - j];
+                d[i] = _mm256_add_epi64(d[i], _mm256_mul_epu32(h[j], m));
+            }
+        }
+
+        __m256i c = _mm256_srli_epi64(d[0], 26);
+        h[0] = _mm256_and_si256(d[0], mask);
+        for(unsigned i = 1; i < POLY1305_LIMBS; i++) {
+            d[i] = _mm256_add_epi64(d[i], c);
+            c = _mm256_srli_epi64(d[i], 26);
+            h[i] = _mm256_and_si256(d[i], mask);
+        }
+        h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+        c = _mm256_srli_epi64(h[0], 26);
+        h[0] = _mm256_and_si256(h[0], mask);
+        h[1] = _mm256_add_epi64(h[1], c);
+    }
+
+    /*------------------------------------------------
+    Absorbs as many whole Poly1305 blocks as the AVX2
+    kernel can, 4 blocks at a time. Four accumulators
+    are each multiplied by r^4 per step, at the end they
+    are multiplied by r^4, r^3, r^2 and r and summed up,
+    which equals absorbing the blocks one at a time.
+
+    @param h 5 limbs of the accumulator, updated in place
+    @param powers limbs of r, r^2, r^3 and r^4, 5 per power
+    @param m message
+    @param blocks number of whole 16 byte blocks available in m
+    @return number of blocks processed, the rest must be done by the caller
+    ------------------------------------------------*/
+    CHACHA20_TARGET_AVX2
+    inline std::size_t poly1305_blocks_avx2(std::uint32_t h[POLY1305_LIMBS], const std::uint32_t powers[4*POLY1305_LIMBS], const std::uint8_t* m, std::size_t blocks) {
+        const std::size_t groups = blocks / 4;
+        if(groups == 0) return 0;
+
+        __m256i r4[POLY1305_LIMBS], s4[POLY1305_LIMBS], rn[POLY1305_LIMBS], sn[POLY1305_LIMBS];
+        for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+            r4[i] = _mm256_set1_epi64x(powers[3*POLY1305_LIMBS + i]);
+            rn[i] = _mm256_set_epi64x(powers[i], powers[POLY1305_LIMBS + i], powers[2*POLY1305_LIMBS + i], powers[3*POLY1305_LIMBS + i]);
+            s4[i] = _mm256_add_epi64(r4[i], _mm256_slli_epi64(r4[i], 2));
+            sn[i] = _mm256_add_epi64(rn[i], _mm256_slli_epi64(rn[i], 2));
+        }
+
+        // The accumulator joins the first block
+        __m256i acc[POLY1305_LIMBS];
+        poly1305_load_avx2(m, acc);
+        for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+            acc[i] = _mm256_add_epi64(acc[i], _mm256_set_epi64x(0, 0, 0, h[i]));
+        }
+
+        for(std::size_t g = 1; g < groups; g++) {
+            __m256i limbs[POLY1305_LIMBS];
+            poly1305_load_avx2(m + 4*POLY1305_BLOCK_SIZE*g, limbs);
+            poly1305_multiply_avx2(acc, r4, s4);
+            for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+                acc[i] = _mm256_add_epi64(acc[i], limbs[i]);
+            }
+        }
+        poly1305_multiply_avx2(acc, rn, sn);
+
+        // Sum of the lanes, limbs are carried once more to fit in 26 bits
+        std::uint64_t sum[POLY1305_LIMBS];
+        for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+            alignas(32) std::uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc[i]);
+            sum[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+        std::uint64_t c = 0;
+        for(unsigned i = 0; i < POLY1305_LIMBS; i++) {
+            sum[i] += c;
+            c = sum[i] >> 26;
+            h[i] = static_cast<std::uint32_t>(sum[i] & 0x3ffffff);
+        }
+        h[0] += static_cast<std::uint32_t>(c * 5);
+        h[1] += h[0] >> 26;
+        h[0] &= 0x3ffffff;
+
+        return 4*groups;
+    }
+
+} // namespace chacha20_avx
+
+#pragma GCC diagnostic pop
+
+#endif /* #ifndef __CHACHA20_AVX__ */
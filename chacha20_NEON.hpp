@@ -0,0 +1,536 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_NEON__
+#define __CHACHA20_NEON__
+
+#include <cstddef>
+#include <cstdint>
+#include <arm_neon.h>
+
+#if defined(__ARM_FEATURE_SVE2)
+#include <arm_sve.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+// AArch64 SIMD kernels used by the Chacha20 front end in chacha20.hpp.
+// NEON is part of every AArch64 cpu, thus its kernels need no runtime
+// check. The SVE2 kernels use intrinsics that only exist when the
+// binary is built for SVE2 (e.g. -march=armv9-a), the front end still
+// checks the cpu before calling them.
+
+// Round helpers are forced inline, otherwise fully unrolled rounds
+// make GCC keep them out of line and pass registers through memory
+#ifndef CHACHA20_ALWAYS_INLINE
+#define CHACHA20_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+// Older kernel headers do not name the SVE2 hwcap bit
+#if defined(__linux__) && !defined(HWCAP2_SVE2)
+#define HWCAP2_SVE2 (1 << 1)
+#endif
+
+namespace chacha20_neon {
+
+    static constexpr unsigned int STATE_SIZE = 16;
+    static constexpr unsigned int BLOCK_SIZE = STATE_SIZE*4;
+
+    // Words 0-3 of every state, the column kernel does not read them from memory
+    static constexpr std::uint32_t CONSTANT_WORDS[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+    /*------------------------------------------------
+    Computes the result of bitwise left-rotating the value of x by S positions
+    for each of the 4 words in x. The bits shifted out are inserted back
+    with a single vsri, a rotation by 16 swaps the halves of every word.
+
+    @param x words to be left rotated
+    @tparam S number of bits to rotate by
+    @returns shifted value
+    ------------------------------------------------*/
+    template<int S>
+    static CHACHA20_ALWAYS_INLINE uint32x4_t rotl_neon(uint32x4_t x) {
+        if constexpr (S == 16) {
+            return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(x)));
+        } else {
+            return vsriq_n_u32(vshlq_n_u32(x, S), x, 32 - S);
+        }
+    }
+
+    /*------------------------------------------------
+    ChaCha20 quarter round applied to 4 independent blocks
+    at once. Each register holds the same word of 4 blocks,
+    one block per 32 bit lane.
+
+    @param a word a of 4 blocks in chacha quarter round algorithm
+    @param b word b of 4 blocks in chacha quarter round algorithm
+    @param c word c of 4 blocks in chacha quarter round algorithm
+    @param d word d of 4 blocks in chacha quarter round algorithm
+    ------------------------------------------------*/
+    static CHACHA20_ALWAYS_INLINE void quarter_round_x4(uint32x4_t& a, uint32x4_t& b, uint32x4_t& c, uint32x4_t& d) {
+        a = vaddq_u32(a, b); d = veorq_u32(d, a); d = rotl_neon<16>(d);
+        c = vaddq_u32(c, d); b = veorq_u32(b, c); b = rotl_neon<12>(b);
+        a = vaddq_u32(a, b); d = veorq_u32(d, a); d = rotl_neon<8>(d);
+        c = vaddq_u32(c, d); b = veorq_u32(b, c); b = rotl_neon<7>(b);
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on 4 blocks sliced by columns,
+    alternating between columns and diagonals. The rounds
+    are unrolled at compile time.
+
+    @param x array of 16 registers, each holding one word of 4 blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    static CHACHA20_ALWAYS_INLINE void double_rounds_x4(uint32x4_t x[STATE_SIZE]) {
+        if constexpr (N > 0) {
+            // column rounds
+            quarter_round_x4(x[0], x[4], x[8],  x[12]);
+            quarter_round_x4(x[1], x[5], x[9],  x[13]);
+            quarter_round_x4(x[2], x[6], x[10], x[14]);
+            quarter_round_x4(x[3], x[7], x[11], x[15]);
+
+            // diagonal rounds
+            quarter_round_x4(x[0], x[5], x[10], x[15]);
+            quarter_round_x4(x[1], x[6], x[11], x[12]);
+            quarter_round_x4(x[2], x[7], x[8],  x[13]);
+            quarter_round_x4(x[3], x[4], x[9],  x[14]);
+
+            double_rounds_x4<N - 1>(x);
+        }
+    }
+
+    /*------------------------------------------------
+    Transposes 4 registers holding one word of 4 blocks each
+    into 4 registers holding 4 consecutive words of one block.
+    After the call x[i] holds the words of block i.
+
+    @param x array of 4 registers to be transposed in place
+    ------------------------------------------------*/
+    static CHACHA20_ALWAYS_INLINE void transpose_x4(uint32x4_t x[4]) {
+        const uint64x2_t t0 = vreinterpretq_u64_u32(vtrn1q_u32(x[0], x[1]));
+        const uint64x2_t t1 = vreinterpretq_u64_u32(vtrn2q_u32(x[0], x[1]));
+        const uint64x2_t t2 = vreinterpretq_u64_u32(vtrn1q_u32(x[2], x[3]));
+        const uint64x2_t t3 = vreinterpretq_u64_u32(vtrn2q_u32(x[2], x[3]));
+        x[0] = vreinterpretq_u32_u64(vtrn1q_u64(t0, t2));
+        x[1] = vreinterpretq_u32_u64(vtrn1q_u64(t1, t3));
+        x[2] = vreinterpretq_u32_u64(vtrn2q_u64(t0, t2));
+        x[3] = vreinterpretq_u32_u64(vtrn2q_u64(t1, t3));
+    }
+
+    /*------------------------------------------------
+    Encrypts 4 consecutive blocks (256 bytes) of input.
+    The state is sliced by columns, every register holds
+    one word of the state for 4 blocks, thus rounds need
+    no diagonal shuffles. The result is transposed back
+    into blocks before the XOR.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input 256 bytes to be encrypted
+    @param output buffer of at least 256 bytes for the result
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true>
+    static inline void chacha20_blocks4(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output) {
+        static const std::uint32_t lane_offsets[4] = {0, 1, 2, 3};
+
+        uint32x4_t words[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            words[i] = vdupq_n_u32(state[i]);
+        }
+        // Every lane gets its own block_count
+        words[12] = vaddq_u32(words[12], vld1q_u32(lane_offsets));
+
+        uint32x4_t x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = vaddq_u32(x[i], words[i]);
+        }
+
+        // x[4*g+j] now holds words 4g..4g+3 of block j
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                uint8x16_t stream = vreinterpretq_u8_u32(x[4*g + j]);
+                if constexpr (XOR) {
+                    stream = veorq_u8(vld1q_u8(input + BLOCK_SIZE*j + 16*g), stream);
+                }
+                vst1q_u8(output + BLOCK_SIZE*j + 16*g, stream);
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 4
+    independent states, which may differ in any word.
+    The states are transposed into the column sliced
+    layout of chacha20_blocks4(), thus the lanes of a
+    register belong to different messages.
+
+    @param states 4 states of 16 words each, one after another
+    @param keystream buffer of at least 256 bytes, block i belongs to state i
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    static inline void chacha20_lanes4(const std::uint32_t* states, std::uint8_t* keystream) {
+        // words[4*g+j] holds words 4g..4g+3 of state j, the transpose slices them by word
+        uint32x4_t words[STATE_SIZE];
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                words[4*g + j] = vld1q_u32(states + STATE_SIZE*j + 4*g);
+            }
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(words + 4*g);
+        }
+
+        uint32x4_t x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = vaddq_u32(x[i], words[i]);
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                vst1q_u8(keystream + BLOCK_SIZE*j + 16*g, vreinterpretq_u8_u32(x[4*g + j]));
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Encrypts as many whole blocks as the NEON kernel can,
+    4 blocks at a time. Afterwards block_count in state
+    is advanced by the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t xor_blocks_neon(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        for(; blocks - done >= 4; done += 4, state[12] += 4) {
+            chacha20_blocks4<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Writes as many whole blocks of keystream itself as
+    the NEON kernel can, 4 blocks at a time.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t keystream_blocks_neon(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        std::size_t done = 0;
+        for(; blocks - done >= 4; done += 4, state[12] += 4) {
+            chacha20_blocks4<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    independent states as the NEON kernel can, 4 at a time.
+
+    @param states count states of 16 words each, one after another
+    @param keystream buffer of at least count*64 bytes, block i belongs to state i
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t keystream_lanes_neon(const std::uint32_t* states, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 4; done += 4) {
+            chacha20_lanes4<ROUNDS>(states + STATE_SIZE*done, keystream + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+    /*------------------------------------------------
+    Computes one block of keystream for each of 4
+    independent states stored by word rather than by
+    state: word 4+r of state j is rows[stride*r + j].
+    Words of 4 states are thus loaded with one load each
+    and need no transpose before the rounds, words 0-3
+    are the constants.
+
+    @param rows words 4-15 of the states, one row of stride words per state word
+    @param stride distance between rows in words
+    @param keystream buffer of at least 256 bytes, block j belongs to state j
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    static inline void chacha20_columns4(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream) {
+        uint32x4_t words[STATE_SIZE];
+        for(size_t i = 0; i < 4; i++) {
+            words[i] = vdupq_n_u32(CONSTANT_WORDS[i]);
+        }
+        for(size_t i = 4; i < STATE_SIZE; i++) {
+            words[i] = vld1q_u32(rows + stride*(i - 4));
+        }
+
+        uint32x4_t x[STATE_SIZE];
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = words[i];
+        }
+
+        double_rounds_x4<ROUNDS>(x);
+
+        for(size_t i = 0; i < STATE_SIZE; i++) {
+            x[i] = vaddq_u32(x[i], words[i]);
+        }
+        for(size_t g = 0; g < 4; g++) {
+            transpose_x4(x + 4*g);
+        }
+
+        for(size_t j = 0; j < 4; j++) {
+            for(size_t g = 0; g < 4; g++) {
+                vst1q_u8(keystream + BLOCK_SIZE*j + 16*g, vreinterpretq_u8_u32(x[4*g + j]));
+            }
+        }
+    }
+
+    /*------------------------------------------------
+    Computes keystream blocks for as many of the given
+    states stored by word as the NEON kernel can, 4 at a time.
+
+    @param rows words 4-15 of the states, word 4+r of state j is rows[stride*r + j]
+    @param stride distance between rows in words
+    @param keystream buffer of at least count*64 bytes, block j belongs to state j
+    @param count number of states
+    @return number of states processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t keystream_columns_neon(const std::uint32_t* rows, std::size_t stride, std::uint8_t* keystream, std::size_t count) {
+        std::size_t done = 0;
+        for(; count - done >= 4; done += 4) {
+            chacha20_columns4<ROUNDS>(rows + done, stride, keystream + BLOCK_SIZE*done);
+        }
+        return done;
+    }
+
+#if defined(__ARM_FEATURE_SVE2)
+
+    /*------------------------------------------------
+    Checks whether the cpu running the program has SVE2.
+
+    @return true if the SVE2 kernels can be used
+    ------------------------------------------------*/
+    inline bool sve2_supported() {
+#if defined(__linux__)
+        return (getauxval(AT_HWCAP2) & HWCAP2_SVE2) != 0;
+#else
+        return false;
+#endif
+    }
+
+    /*------------------------------------------------
+    ChaCha20 quarter round applied to as many independent
+    blocks as an SVE vector has 32 bit lanes. XOR and
+    rotation are fused into a single xar, which rotates
+    right, thus left rotations by s become right ones by 32-s.
+
+    @param a word a of the blocks in chacha quarter round algorithm
+    @param b word b of the blocks in chacha quarter round algorithm
+    @param c word c of the blocks in chacha quarter round algorithm
+    @param d word d of the blocks in chacha quarter round algorithm
+    ------------------------------------------------*/
+    static CHACHA20_ALWAYS_INLINE void quarter_round_sve2(svuint32_t& a, svuint32_t& b, svuint32_t& c, svuint32_t& d) {
+        const svbool_t pg = svptrue_b32();
+        a = svadd_u32_x(pg, a, b); d = svxar_n_u32(d, a, 16);
+        c = svadd_u32_x(pg, c, d); b = svxar_n_u32(b, c, 20);
+        a = svadd_u32_x(pg, a, b); d = svxar_n_u32(d, a, 24);
+        c = svadd_u32_x(pg, c, d); b = svxar_n_u32(b, c, 25);
+    }
+
+    /*------------------------------------------------
+    Performs N double rounds on blocks sliced by columns as
+    double_rounds_x4() does. The rounds are unrolled at
+    compile time, SVE registers cannot be held in arrays,
+    thus the 16 words are passed one by one.
+
+    @param x0-x15 registers, each holding one word of the blocks
+    @tparam N number of double rounds
+    ------------------------------------------------*/
+    template<unsigned N>
+    static CHACHA20_ALWAYS_INLINE void double_rounds_sve2(svuint32_t& x0, svuint32_t& x1, svuint32_t& x2, svuint32_t& x3,
+                                                          svuint32_t& x4, svuint32_t& x5, svuint32_t& x6, svuint32_t& x7,
+                                                          svuint32_t& x8, svuint32_t& x9, svuint32_t& x10, svuint32_t& x11,
+                                                          svuint32_t& x12, svuint32_t& x13, svuint32_t& x14, svuint32_t& x15) {
+        if constexpr (N > 0) {
+            // column rounds
+            quarter_round_sve2(x0, x4, x8,  x12);
+            quarter_round_sve2(x1, x5, x9,  x13);
+            quarter_round_sve2(x2, x6, x10, x14);
+            quarter_round_sve2(x3, x7, x11, x15);
+
+            // diagonal rounds
+            quarter_round_sve2(x0, x5, x10, x15);
+            quarter_round_sve2(x1, x6, x11, x12);
+            quarter_round_sve2(x2, x7, x8,  x13);
+            quarter_round_sve2(x3, x4, x9,  x14);
+
+            double_rounds_sve2<N - 1>(x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15);
+        }
+    }
+
+    /*------------------------------------------------
+    Adds the initial word back and writes word i of every
+    block with one scatter, XORed with the gathered input
+    unless XOR is false.
+
+    @param x word i of the blocks after the rounds
+    @param word word i of the initial states
+    @param offsets byte offset of every block
+    @param input blocks to be encrypted
+    @param output buffer for the result
+    @param i index of the word within a block
+    @tparam XOR false to store the keystream itself, input is then not read
+    ------------------------------------------------*/
+    template<bool XOR>
+    static CHACHA20_ALWAYS_INLINE void store_word_sve2(svuint32_t x, svuint32_t word, svuint32_t offsets,
+                                                       const std::uint8_t* input, std::uint8_t* output, size_t i) {
+        const svbool_t pg = svptrue_b32();
+        svuint32_t stream = svadd_u32_x(pg, x, word);
+        if constexpr (XOR) {
+            const svuint32_t in = svld1_gather_u32offset_u32(pg, reinterpret_cast<const std::uint32_t*>(input) + i, offsets);
+            stream = sveor_u32_x(pg, stream, in);
+        }
+        svst1_scatter_u32offset_u32(pg, reinterpret_cast<std::uint32_t*>(output) + i, offsets, stream);
+    }
+
+    /*------------------------------------------------
+    Encrypts as many consecutive blocks as an SVE vector has
+    32 bit lanes, svcntw() blocks of input. The state is sliced
+    by columns as in chacha20_blocks4(), the vector length is
+    only known at runtime, thus words are gathered from and
+    scattered to their blocks instead of being transposed.
+    SVE registers cannot be held in arrays, hence the
+    16 separate variables.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input svcntw()*64 bytes to be encrypted
+    @param output buffer of at least svcntw()*64 bytes for the result
+    @tparam ROUNDS number of double rounds to perform
+    @tparam XOR false to store the keystream itself, input is then not read
+    ------------------------------------------------*/
+    template<unsigned ROUNDS, bool XOR = true>
+    static inline void chacha20_blocks_sve2(const std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output) {
+        const svuint32_t w0 = svdup_n_u32(state[0]),   w1 = svdup_n_u32(state[1]);
+        const svuint32_t w2 = svdup_n_u32(state[2]),   w3 = svdup_n_u32(state[3]);
+        const svuint32_t w4 = svdup_n_u32(state[4]),   w5 = svdup_n_u32(state[5]);
+        const svuint32_t w6 = svdup_n_u32(state[6]),   w7 = svdup_n_u32(state[7]);
+        const svuint32_t w8 = svdup_n_u32(state[8]),   w9 = svdup_n_u32(state[9]);
+        const svuint32_t w10 = svdup_n_u32(state[10]), w11 = svdup_n_u32(state[11]);
+        // Every lane gets its own block_count
+        const svuint32_t w12 = svindex_u32(state[12], 1);
+        const svuint32_t w13 = svdup_n_u32(state[13]), w14 = svdup_n_u32(state[14]);
+        const svuint32_t w15 = svdup_n_u32(state[15]);
+
+        svuint32_t x0 = w0, x1 = w1, x2 = w2, x3 = w3, x4 = w4, x5 = w5, x6 = w6, x7 = w7;
+        svuint32_t x8 = w8, x9 = w9, x10 = w10, x11 = w11, x12 = w12, x13 = w13, x14 = w14, x15 = w15;
+
+        double_rounds_sve2<ROUNDS>(x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15);
+
+        const svuint32_t offsets = svindex_u32(0, BLOCK_SIZE);
+        store_word_sve2<XOR>(x0,  w0,  offsets, input, output, 0);
+        store_word_sve2<XOR>(x1,  w1,  offsets, input, output, 1);
+        store_word_sve2<XOR>(x2,  w2,  offsets, input, output, 2);
+        store_word_sve2<XOR>(x3,  w3,  offsets, input, output, 3);
+        store_word_sve2<XOR>(x4,  w4,  offsets, input, output, 4);
+        store_word_sve2<XOR>(x5,  w5,  offsets, input, output, 5);
+        store_word_sve2<XOR>(x6,  w6,  offsets, input, output, 6);
+        store_word_sve2<XOR>(x7,  w7,  offsets, input, output, 7);
+        store_word_sve2<XOR>(x8,  w8,  offsets, input, output, 8);
+        store_word_sve2<XOR>(x9,  w9,  offsets, input, output, 9);
+        store_word_sve2<XOR>(x10, w10, offsets, input, output, 10);
+        store_word_sve2<XOR>(x11, w11, offsets, input, output, 11);
+        store_word_sve2<XOR>(x12, w12, offsets, input, output, 12);
+        store_word_sve2<XOR>(x13, w13, offsets, input, output, 13);
+        store_word_sve2<XOR>(x14, w14, offsets, input, output, 14);
+        store_word_sve2<XOR>(x15, w15, offsets, input, output, 15);
+    }
+
+    /*------------------------------------------------
+    Encrypts as many whole blocks as the SVE2 kernel can,
+    svcntw() blocks at a time, the remainder is passed on
+    to the NEON kernel. Afterwards block_count in state
+    is advanced by the number of blocks processed.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param input message to be encrypted
+    @param output buffer for the result
+    @param blocks number of whole 64 byte blocks available in input
+    @return number of blocks processed, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t xor_blocks_sve2(std::uint32_t state[STATE_SIZE], const std::uint8_t* input, std::uint8_t* output, std::size_t blocks) {
+        const std::size_t lanes = svcntw();
+        std::size_t done = 0;
+        for(; blocks - done >= lanes; done += lanes, state[12] += static_cast<std::uint32_t>(lanes)) {
+            chacha20_blocks_sve2<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done);
+        }
+        return done + xor_blocks_neon<ROUNDS>(state, input + BLOCK_SIZE*done, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+    /*------------------------------------------------
+    Writes as many whole blocks of keystream itself as
+    the SVE2 kernel can, svcntw() blocks at a time, the
+    remainder is passed on to the NEON kernel.
+
+    @param state 16 words of the state, state[12] is block_count of the first block
+    @param output buffer for the keystream
+    @param blocks number of whole 64 byte blocks to be written
+    @return number of blocks written, the rest must be done by the caller
+    @tparam ROUNDS number of double rounds to perform
+    ------------------------------------------------*/
+    template<unsigned ROUNDS>
+    inline std::size_t keystream_blocks_sve2(std::uint32_t state[STATE_SIZE], std::uint8_t* output, std::size_t blocks) {
+        const std::size_t lanes = svcntw();
+        std::size_t done = 0;
+        for(; blocks - done >= lanes; done += lanes, state[12] += static_cast<std::uint32_t>(lanes)) {
+            chacha20_blocks_sve2<ROUNDS, false>(state, nullptr, output + BLOCK_SIZE*done);
+        }
+        return done + keystream_blocks_neon<ROUNDS>(state, output + BLOCK_SIZE*done, blocks - done);
+    }
+
+#endif /* #if defined(__ARM_FEATURE_SVE2) */
+
+} // namespace chacha20_neon
+
+#endif /* #ifndef __CHACHA20_NEON__ */
@@ -0,0 +1,304 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_AHEAD__
+#define __CHACHA20_AHEAD__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <thread>
+
+#include "chacha20.hpp"
+
+// Keystream of one stream computed ahead of its messages into a ring of
+// blocks, either by a background thread or by refill() in idle time. On the
+// critical path update() and encrypt() only XOR the message with keystream
+// that is already there. If the ring has run dry the rest of the message is
+// computed inline, so the output never depends on how far ahead the ring is.
+// One thread encrypts, the ring is filled by at most one other thread.
+template<typename Cipher = Chacha20>
+class Chacha20KeystreamAhead {
+
+    using counter_type = typename Cipher::counter_type;
+
+    static constexpr std::size_t BLOCK_SIZE = Cipher::BLOCK_SIZE;
+
+    // The producer publishes at most REFILL_BLOCKS blocks at a time, so the
+    // consumer does not wait for a long run to finish
+    static constexpr std::size_t REFILL_BLOCKS = 16;
+
+    // Computes the blocks of the ring, used by the producer only
+    Cipher producer;
+
+    // Computes messages inline once the ring has run dry, used by the consumer only
+    Cipher fallback;
+
+    // Number of blocks of the stream, the block count does not wrap around within them
+    std::uint64_t end;
+
+    // Number of blocks of the ring, a power of two
+    std::size_t blocks;
+
+    // Block b of the stream is kept in slot b & (blocks - 1).
+    // The buffer pool scrubs the ring once it is freed
+    Chacha20Buffer ring;
+
+    // Block the producer computes next unless it has to skip ahead
+    std::uint64_t next;
+
+    // Byte offset of the next message in the stream, used by the consumer only
+    std::uint64_t position;
+
+    // Number of messages computed inline at least in part
+    std::uint64_t dry;
+
+    // Blocks of the stream up to head are in the ring, unless they lie before consumed
+    alignas(64) std::atomic<std::uint64_t> head;
+
+    // Blocks of the stream before consumed are no longer needed by the consumer
+    alignas(64) std::atomic<std::uint64_t> consumed;
+
+    // The producer sleeps on wake while the ring is full
+    alignas(64) std::atomic<bool> waiting;
+    std::atomic<std::uint32_t> wake;
+    std::atomic<bool> stopping;
+    std::thread worker;
+
+    /*------------------------------------------------
+    @param done blocks no longer needed by the consumer
+    @return true if at least half of the ring is free
+            and the stream has blocks left
+    ------------------------------------------------*/
+    bool hungry(std::uint64_t done) const {
+        const std::uint64_t ready = head.load(std::memory_order_relaxed);
+        return std::max(ready, done) < end && ready <= done + blocks / 2;
+    }
+
+    /*------------------------------------------------
+    @param length number of bytes of the next message
+    @return true if the message ends before the stream does
+    ------------------------------------------------*/
+    bool fits(std::size_t length) const {
+        return length <= BLOCK_SIZE*std::min(end, std::numeric_limits<std::uint64_t>::max() / BLOCK_SIZE) - position;
+    }
+
+    /*------------------------------------------------
+    XORs the message with the keystream at position,
+    taken from the ring as long as it holds the blocks
+    and computed inline from there on.
+
+    @param input message to be encrypted
+    @param output buffer of at least length bytes for the result
+    @param length number of bytes to process
+    ------------------------------------------------*/
+    void process(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        while(length > 0) {
+            const std::uint64_t block = position / BLOCK_SIZE;
+            const std::uint64_t ready = head.load(std::memory_order_acquire);
+            if(block >= ready) {
+                fallback.encrypt_at(position, input, output, length);
+                position += length;
+                dry++;
+                return;
+            }
+
+            // Keystream up to the end of the ring or of the blocks ready, whichever comes first
+            const std::size_t slot = block & (blocks - 1);
+            const std::size_t offset = position % BLOCK_SIZE;
+            const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(
+                {length, BLOCK_SIZE*(ready - block) - offset, BLOCK_SIZE*(blocks - slot) - offset}));
+            Cipher::xor_bytes(input, ring.data() + BLOCK_SIZE*slot + offset, output, count);
+            input += count;
+            output += count;
+            length -= count;
+            position += count;
+        }
+    }
+
+    /*------------------------------------------------
+    Hands the blocks before position back to the
+    producer, waking it once half of the ring is free.
+    ------------------------------------------------*/
+    void release() {
+        const std::uint64_t done = position / BLOCK_SIZE;
+        consumed.store(done);
+        if(waiting.load() && hungry(done)) {
+            waiting.store(false);
+            wake.fetch_add(1);
+            wake.notify_one();
+        }
+    }
+
+    /*------------------------------------------------
+    Main loop of the background thread, keeps the ring
+    full until stop() is called.
+    ------------------------------------------------*/
+    void work() {
+        while(!stopping.load()) {
+            if(refill() > 0) continue;
+
+            const std::uint32_t epoch = wake.load();
+            waiting.store(true);
+            // Space freed before waiting was set has not been signalled
+            if(stopping.load() || hungry(consumed.load())) {
+                waiting.store(false);
+                continue;
+            }
+            wake.wait(epoch);
+        }
+    }
+
+public:
+    /*------------------------------------------------
+    Starts the stream and fills the ring, key, block
+    count and nonce are the same as for the Chacha
+    constructor. The background thread is started by
+    start(), otherwise call refill() when idle.
+
+    @param key 256-bit key
+    @param block_count block count of the first block
+    @param nonce nonce of the stream, must not be repeated for the same key
+    @param capacity number of blocks kept ahead, rounded up to a power of two
+    @param k kernel computing the keystream, the best one if k is not supported
+    ------------------------------------------------*/
+    Chacha20KeystreamAhead(const std::array<std::uint32_t, Cipher::KEY_WORDS>& key, counter_type block_count,
+                           const std::array<std::uint32_t, Cipher::NONCE_WORDS>& nonce, std::size_t capacity = 64,
+                           Chacha20Kernel k = Cipher::best_kernel()):
+    producer ( key, block_count, nonce), fallback ( key, block_count, nonce),
+    end ( sizeof(counter_type) == 8 ? std::numeric_limits<std::uint64_t>::max() : (std::uint64_t(1) << 32) - block_count),
+    blocks ( std::bit_ceil(std::max<std::size_t>(capacity, 1))), ring ( BLOCK_SIZE*blocks), next ( 0), position ( 0), dry ( 0),
+    head ( 0), consumed ( 0), waiting ( false), wake ( 0), stopping ( false) {
+        producer.select_kernel(k);
+        fallback.select_kernel(k);
+        refill();
+    }
+
+    Chacha20KeystreamAhead(const Chacha20KeystreamAhead&) = delete;
+    Chacha20KeystreamAhead& operator=(const Chacha20KeystreamAhead&) = delete;
+
+    /*------------------------------------------------
+    Stops the background thread.
+    ------------------------------------------------*/
+    ~Chacha20KeystreamAhead() {
+        stop();
+    }
+
+    /*------------------------------------------------
+    Starts a background thread keeping the ring full,
+    refill() must not be called while it runs.
+
+    @return false if the thread is already running
+    ------------------------------------------------*/
+    bool start() {
+        if(worker.joinable()) return false;
+        stopping.store(false);
+        worker = std::thread([this] { work(); });
+        return true;
+    }
+
+    /*------------------------------------------------
+    Stops the background thread, keystream already in
+    the ring stays there.
+    ------------------------------------------------*/
+    void stop() {
+        if(!worker.joinable()) return;
+        stopping.store(true);
+        wake.fetch_add(1);
+        wake.notify_one();
+        worker.join();
+    }
+
+    /*------------------------------------------------
+    Computes blocks into the free slots of the ring, the
+    background thread does so by itself. Blocks the
+    consumer has already passed inline are skipped.
+    Called by at most one thread at a time.
+
+    @return number of blocks computed, 0 if the ring is full
+    ------------------------------------------------*/
+    std::size_t refill() {
+        std::size_t produced = 0;
+        for(;;) {
+            const std::uint64_t done = consumed.load(std::memory_order_acquire);
+            const std::uint64_t first = std::max(head.load(std::memory_order_relaxed), done);
+            const std::uint64_t last = std::min(done + blocks, end);
+            if(first >= last) return produced;
+
+            // A contiguous run of slots, it stops at the end of the ring
+            const std::size_t slot = first & (blocks - 1);
+            const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>({last - first, blocks - slot, REFILL_BLOCKS}));
+            if(first != next) producer.seek(BLOCK_SIZE*first);
+            producer.generate(ring.data() + BLOCK_SIZE*slot, BLOCK_SIZE*count);
+            next = first + count;
+            head.store(next, std::memory_order_release);
+            produced += count;
+        }
+    }
+
+    /*------------------------------------------------
+    @return number of bytes of keystream ready for the
+            next messages
+    ------------------------------------------------*/
+    std::uint64_t available() const {
+        const std::uint64_t ready = BLOCK_SIZE*head.load(std::memory_order_acquire);
+        return ready > position ? ready - position : 0;
+    }
+
+    /*------------------------------------------------
+    @return number of messages that found the ring
+            short of keystream and were computed inline
+            at least in part, a hint to enlarge the ring
+    ------------------------------------------------*/
+    std::uint64_t misses() const {
+        return dry;
+    }
+
+    /*------------------------------------------------
+    Performs incremental encryption/decryption of length
+    bytes from input into output, the same as
+    Chacha::update(): keystream left unused in the last
+    block is kept for the next call.
+    input and output may point to the same buffer.
+
+    @param input Next piece of the message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the piece does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool update(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        if(!fits(length)) return false;
+        process(input, output, length);
+        release();
+        return true;
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of length bytes from
+    input into output, the same as Chacha::encrypt():
+    keystream left unused in the last block is discarded,
+    the next message starts at a fresh block.
+    input and output may point to the same buffer.
+
+    @param input Message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the message does not fit into the rest of the stream, nothing is processed then
+    ------------------------------------------------*/
+    bool encrypt(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        if(!fits(length)) return false;
+        process(input, output, length);
+        position = (position + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        release();
+        return true;
+    }
+};
+
+#endif /* #ifndef __CHACHA20_AHEAD__ */
@@ -0,0 +1,182 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_ALLOCATOR__
+#define __CHACHA20_ALLOCATOR__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Thread-local pool of 64 byte aligned buffers in power of two size classes.
+// Buffers are scrubbed when they are given back, so recycled memory never
+// carries plaintext or keystream of an earlier message. Every thread has its
+// own pool, thus allocation takes no lock.
+class Chacha20BufferPool {
+
+    static constexpr std::size_t ALIGNMENT = 64;
+
+    // Size classes from 64 bytes up to 1 MiB, larger buffers are not pooled
+    static constexpr std::size_t MIN_CLASS_SIZE = 64;
+    static constexpr std::size_t CLASSES = 15;
+
+    // Buffers kept per size class, the rest goes back to the system
+    static constexpr std::size_t MAX_CACHED = 16;
+
+    std::array<std::vector<void*>, CLASSES> free_lists;
+
+    // Set once the pool of the calling thread is gone, buffers freed
+    // later during thread exit go straight back to the system
+    static inline thread_local bool destroyed = false;
+
+    /*------------------------------------------------
+    @param bytes requested size
+    @return size class of the request, CLASSES if it is too large to be pooled
+    ------------------------------------------------*/
+    static std::size_t size_class(std::size_t bytes) {
+        std::size_t c = 0;
+        for(std::size_t size = MIN_CLASS_SIZE; size < bytes && c < CLASSES; size *= 2) {
+            c++;
+        }
+        return c;
+    }
+
+    /*------------------------------------------------
+    @param c size class
+    @return bytes of a buffer of class c
+    ------------------------------------------------*/
+    static std::size_t class_size(std::size_t c) {
+        return MIN_CLASS_SIZE << c;
+    }
+
+    /*------------------------------------------------
+    Sets bytes of p to 0 in a way the compiler cannot
+    optimize out although p is freed right after.
+
+    @param p buffer to be zeroed
+    @param bytes number of bytes to zero
+    ------------------------------------------------*/
+    static void scrub(void* p, std::size_t bytes) {
+        volatile std::uint8_t* q = static_cast<std::uint8_t*>(p);
+        for(std::size_t i = 0; i < bytes; i++) {
+            q[i] = 0;
+        }
+    }
+
+    /*------------------------------------------------
+    @return pool of the calling thread, created upon the first call
+    ------------------------------------------------*/
+    static Chacha20BufferPool& instance() {
+        thread_local Chacha20BufferPool pool;
+        return pool;
+    }
+
+    /*------------------------------------------------
+    Reserves the free lists upfront, so giving a buffer
+    back never allocates.
+    ------------------------------------------------*/
+    Chacha20BufferPool() {
+        for(std::vector<void*>& list : free_lists) {
+            list.reserve(MAX_CACHED);
+        }
+    }
+
+public:
+    /*------------------------------------------------
+    Frees every cached buffer once the thread exits.
+    ------------------------------------------------*/
+    ~Chacha20BufferPool() {
+        for(std::vector<void*>& list : free_lists) {
+            for(void* p : list) {
+                ::operator delete(p, std::align_val_t(ALIGNMENT));
+            }
+        }
+        destroyed = true;
+    }
+
+    Chacha20BufferPool(const Chacha20BufferPool&) = delete;
+    Chacha20BufferPool& operator=(const Chacha20BufferPool&) = delete;
+
+    /*------------------------------------------------
+    Hands out a 64 byte aligned buffer of at least bytes
+    bytes, recycled from the pool of the calling thread
+    if one of its size class is cached.
+
+    @param bytes requested size
+    @return aligned buffer, to be given back through deallocate()
+    ------------------------------------------------*/
+    static void* allocate(std::size_t bytes) {
+        const std::size_t c = size_class(bytes);
+        if(c == CLASSES) return ::operator new(bytes, std::align_val_t(ALIGNMENT));
+
+        if(!destroyed) {
+            std::vector<void*>& list = instance().free_lists[c];
+            if(!list.empty()) {
+                void* p = list.back();
+                list.pop_back();
+                return p;
+            }
+        }
+        return ::operator new(class_size(c), std::align_val_t(ALIGNMENT));
+    }
+
+    /*------------------------------------------------
+    Scrubs a buffer and caches it for the next request
+    of its size class on the calling thread. Buffers of
+    any thread may be given back.
+
+    @param p buffer returned by allocate()
+    @param bytes size passed to allocate()
+    ------------------------------------------------*/
+    static void deallocate(void* p, std::size_t bytes) noexcept {
+        if(p == nullptr) return;
+        // Only the first bytes bytes were ever handed out
+        scrub(p, bytes);
+
+        const std::size_t c = size_class(bytes);
+        if(c < CLASSES && !destroyed) {
+            std::vector<void*>& list = instance().free_lists[c];
+            if(list.size() < MAX_CACHED) {
+                list.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p, std::align_val_t(ALIGNMENT));
+    }
+};
+
+// Allocator handing out buffers of Chacha20BufferPool, for std::vector and
+// other containers. All instances are interchangeable.
+template<typename T>
+struct Chacha20AlignedAllocator {
+    using value_type = T;
+
+    Chacha20AlignedAllocator() noexcept = default;
+
+    template<typename U>
+    Chacha20AlignedAllocator(const Chacha20AlignedAllocator<U>&) noexcept {
+    }
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(Chacha20BufferPool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        Chacha20BufferPool::deallocate(p, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const Chacha20AlignedAllocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+// Byte buffer that is 64 byte aligned, pooled per thread and scrubbed when freed
+using Chacha20Buffer = std::vector<std::uint8_t, Chacha20AlignedAllocator<std::uint8_t>>;
+
+#endif /* #ifndef __CHACHA20_ALLOCATOR__ */
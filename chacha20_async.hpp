@@ -0,0 +1,374 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_ASYNC__
+#define __CHACHA20_ASYNC__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "chacha20.hpp"
+
+// Encrypts messages on dedicated worker threads, so the threads submitting
+// them (e.g. the reactor of an event loop) never run the cipher themselves.
+// Requests waiting in the queue are coalesced into a single encrypt_batch()
+// call, thus many short messages arriving together share the lanes of one
+// kernel call. Long messages are cut into chunks taken by different workers.
+// Buffers of a request must stay valid until its completion is signalled.
+template<typename Cipher = Chacha20>
+class Chacha20AsyncEngine {
+public:
+    using Job = typename Cipher::Job;
+    using Callback = std::function<void(bool)>;
+
+private:
+    using counter_type = decltype(Job::block_count);
+
+    static constexpr std::size_t BLOCK_SIZE = 64;
+
+    // Messages longer than CHUNK_SIZE bytes are cut into chunks of CHUNK_SIZE bytes
+    static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+    // A worker takes queued chunks until either limit is reached
+    static constexpr std::size_t MAX_BATCH_JOBS = 256;
+    static constexpr std::size_t MAX_BATCH_BYTES = 4 * CHUNK_SIZE;
+
+    /*------------------------------------------------
+    Counts down the chunks of one request, the callback
+    is called by the worker finishing the last chunk.
+    ------------------------------------------------*/
+    struct Completion {
+        std::atomic<std::size_t> remaining;
+        Callback done;
+
+        Completion(std::size_t chunks, Callback done): remaining ( chunks), done ( std::move(done)) {
+        }
+
+        void finish(bool ok) {
+            if(remaining.fetch_sub(1) == 1 && done) done(ok);
+        }
+    };
+
+    // Part of a request, the completion is shared by all chunks of one request
+    struct Chunk {
+        Job job;
+        std::shared_ptr<Completion> completion;
+    };
+
+    // Request of an awaiting coroutine whose chunks from next on did not fit into the queue
+    struct Parked {
+        Job job;
+        std::shared_ptr<Completion> completion;
+        std::size_t next;
+        std::size_t chunks;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<Chunk> queue;
+
+    // Moved into the queue by the workers as they free space, ahead of any new request
+    std::deque<Parked> parked;
+    std::size_t capacity;
+    Chacha20Kernel kernel;
+    std::mutex mutex;
+    std::condition_variable available;
+    std::condition_variable space;
+    bool stopping;
+
+    /*------------------------------------------------
+    Main loop of a worker thread, takes a batch of queued
+    chunks at a time until the engine is destroyed.
+    ------------------------------------------------*/
+    void work() {
+        std::vector<Chunk> batch;
+        std::vector<Job> jobs;
+        batch.reserve(MAX_BATCH_JOBS);
+        jobs.reserve(MAX_BATCH_JOBS);
+        bool more;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this] { return stopping || !queue.empty(); });
+                if(stopping && queue.empty() && parked.empty()) return;
+
+                std::size_t bytes = 0;
+                while(!queue.empty() && batch.size() < MAX_BATCH_JOBS && bytes < MAX_BATCH_BYTES) {
+                    bytes += queue.front().job.length;
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                unpark();
+                more = !queue.empty();
+            }
+            space.notify_all();
+            // The rest of the queue is left to the other workers
+            if(more) available.notify_one();
+
+            for(const Chunk& chunk : batch) {
+                jobs.push_back(chunk.job);
+            }
+            // Chunks are checked upon submission, thus every one of them fits
+            Cipher::encrypt_batch(jobs, kernel);
+            for(Chunk& chunk : batch) {
+                chunk.completion->finish(true);
+            }
+            batch.clear();
+            jobs.clear();
+        }
+    }
+
+    /*------------------------------------------------
+    @param job message to be encrypted
+    @return number of chunks job is cut into, 1 for an empty message
+    ------------------------------------------------*/
+    static std::size_t chunk_count(const Job& job) {
+        return std::max<std::size_t>(1, (job.length + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+
+    /*------------------------------------------------
+    @param job message to be encrypted
+    @param i index of the chunk, less than chunk_count(job)
+    @return chunk i of job
+    ------------------------------------------------*/
+    static Job chunk_of(const Job& job, std::size_t i) {
+        const std::size_t offset = CHUNK_SIZE * i;
+        Job chunk = job;
+        chunk.block_count = static_cast<counter_type>(job.block_count + offset / BLOCK_SIZE);
+        chunk.input = job.input + offset;
+        chunk.output = job.output + offset;
+        chunk.length = std::min(CHUNK_SIZE, job.length - std::min(offset, job.length));
+        return chunk;
+    }
+
+    /*------------------------------------------------
+    Moves chunks of parked requests into the queue while
+    it has room, oldest request first. The caller holds
+    the lock.
+    ------------------------------------------------*/
+    void unpark() {
+        while(!parked.empty() && queue.size() < capacity) {
+            Parked& front = parked.front();
+            queue.push_back({chunk_of(front.job, front.next), front.completion});
+            if(++front.next == front.chunks) parked.pop_front();
+        }
+    }
+
+    /*------------------------------------------------
+    Queues as many chunks of job as the queue has room
+    for and parks the rest for the workers to queue as
+    they free space, thus never waits. Parked requests
+    keep their order, a new one waits behind them.
+
+    @param job message to be encrypted, must fit before the block count wraps around
+    @param done callback called once all chunks are finished
+    ------------------------------------------------*/
+    void post(const Job& job, Callback done) {
+        const std::size_t chunks = chunk_count(job);
+        auto completion = std::make_shared<Completion>(chunks, std::move(done));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::size_t next = 0;
+            if(parked.empty()) {
+                for(; next < chunks && queue.size() < capacity; next++) {
+                    queue.push_back({chunk_of(job, next), completion});
+                }
+            }
+            if(next < chunks) parked.push_back({job, completion, next, chunks});
+        }
+        available.notify_one();
+    }
+
+    /*------------------------------------------------
+    @param job message to be checked
+    @return true if the keystream of job does not run past the last block
+    ------------------------------------------------*/
+    static bool fits(const Job& job) {
+        const std::uint64_t needed = (static_cast<std::uint64_t>(job.length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        return Cipher::stream_fits(job.block_count, needed);
+    }
+
+public:
+    // Coroutine interface, see encrypt_async()
+    struct Awaiter {
+        Chacha20AsyncEngine& engine;
+        Job job;
+        bool result;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        // A message that does not fit is refused without suspending, instead of
+        // resuming the coroutine from within await_suspend() on the caller's stack.
+        // Never waits for room in the queue, the awaiter may be resumed by a worker
+        // before post() returns, thus it is not touched afterwards
+        bool await_suspend(std::coroutine_handle<> handle) {
+            if(!fits(job)) {
+                result = false;
+                return false;
+            }
+            engine.post(job, [this, handle](bool ok) {
+                result = ok;
+                handle.resume();
+            });
+            return true;
+        }
+
+        bool await_resume() const noexcept {
+            return result;
+        }
+    };
+
+    /*------------------------------------------------
+    Starts the worker threads.
+
+    @param threads number of workers, 0 means one per hardware thread
+    @param capacity number of queued chunks beyond which submit() waits, messages are cut
+                    into chunks of 64 KiB
+    @param k kernel used by the workers, the portable one if k is not supported
+    ------------------------------------------------*/
+    explicit Chacha20AsyncEngine(unsigned threads = 0, std::size_t capacity = 1024, Chacha20Kernel k = Cipher::best_kernel()):
+    capacity ( std::max<std::size_t>(1, capacity)), kernel ( Cipher::kernel_supported(k) ? k : Chacha20Kernel::Scalar), stopping ( false) {
+        if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        workers.reserve(threads);
+        for(unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    Chacha20AsyncEngine(const Chacha20AsyncEngine&) = delete;
+    Chacha20AsyncEngine& operator=(const Chacha20AsyncEngine&) = delete;
+
+    /*------------------------------------------------
+    Finishes all queued requests and joins the workers.
+    ------------------------------------------------*/
+    ~Chacha20AsyncEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for(std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /*------------------------------------------------
+    @return number of worker threads
+    ------------------------------------------------*/
+    std::size_t size() const {
+        return workers.size();
+    }
+
+    /*------------------------------------------------
+    @return number of chunks waiting in the queue, never more than capacity
+    ------------------------------------------------*/
+    std::size_t queued() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    /*------------------------------------------------
+    Queues a message chunk by chunk, waiting while the
+    queue is full, so a long message never holds more
+    than capacity chunks in the queue at once.
+    done is called on a worker thread once the message
+    is finished, or right away with false if it does
+    not fit before the block count wraps around. done
+    must not wait for submit() itself, use try_submit()
+    from within a callback.
+
+    @param job message to be encrypted, input and output may be the same buffer
+    @param done callback taking true on success
+    ------------------------------------------------*/
+    void submit(const Job& job, Callback done) {
+        if(!fits(job)) {
+            if(done) done(false);
+            return;
+        }
+        const std::size_t chunks = chunk_count(job);
+        auto completion = std::make_shared<Completion>(chunks, std::move(done));
+        for(std::size_t i = 0; i < chunks; i++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                space.wait(lock, [this] { return queue.size() < capacity; });
+                queue.push_back({chunk_of(job, i), completion});
+            }
+            available.notify_one();
+        }
+    }
+
+    /*------------------------------------------------
+    Queues a message like submit() unless the queue has
+    no room for all of its chunks, so the caller never
+    blocks. Messages of more than capacity chunks only
+    go through submit().
+
+    @param job message to be encrypted, input and output may be the same buffer
+    @param done callback taking true on success
+    @return false if the queue is too full, done is then not called
+    ------------------------------------------------*/
+    bool try_submit(const Job& job, Callback done) {
+        if(!fits(job)) {
+            if(done) done(false);
+            return true;
+        }
+        const std::size_t chunks = chunk_count(job);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(chunks > capacity || queue.size() > capacity - chunks) return false;
+            auto completion = std::make_shared<Completion>(chunks, std::move(done));
+            for(std::size_t i = 0; i < chunks; i++) {
+                queue.push_back({chunk_of(job, i), completion});
+            }
+        }
+        available.notify_one();
+        return true;
+    }
+
+    /*------------------------------------------------
+    Queues a message, see submit().
+
+    @param job message to be encrypted, input and output may be the same buffer
+    @return future holding true on success
+    ------------------------------------------------*/
+    std::future<bool> encrypt_future(const Job& job) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        std::future<bool> result = promise->get_future();
+        submit(job, [promise](bool ok) { promise->set_value(ok); });
+        return result;
+    }
+
+    /*------------------------------------------------
+    Queues a message once awaited by a coroutine, like
+    submit() but without ever waiting: chunks finding
+    the queue full are parked and queued by the workers
+    as they free space, so neither a reactor nor a
+    worker awaiting again is held up. The coroutine is
+    resumed on the worker finishing the message, it
+    should move itself back to its own executor before
+    doing any more work.
+
+    @param job message to be encrypted, input and output may be the same buffer
+    @return awaitable yielding true on success
+    ------------------------------------------------*/
+    Awaiter encrypt_async(const Job& job) {
+        return Awaiter{*this, job, false};
+    }
+};
+
+#endif /* #ifndef __CHACHA20_ASYNC__ */
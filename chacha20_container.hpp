@@ -0,0 +1,506 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_CONTAINER__
+#define __CHACHA20_CONTAINER__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <span>
+
+#include "chacha20.hpp"
+#include "chacha20_poly1305.hpp"
+
+// Container format for large objects, encrypted in fixed size chunks so
+// that any range, or every chunk in parallel, is decrypted without a pass
+// over the chunks before it. All numbers are little-endian.
+//
+// Header, 32 bytes:
+//   0   8  magic "CC20CNK1"
+//   8   1  flags, bit 0 set if every chunk carries a Poly1305 tag
+//   9   3  reserved, 0
+//   12  4  chunk size, a multiple of 64 up to MAX_CHUNK_SIZE
+//   16  8  nonce, its two words as given to the writer
+//   24  8  reserved, 0
+//
+// Chunk i follows at 32 + i * (chunk size + tag size). Every chunk holds
+// chunk size bytes of ciphertext except the last one, which holds fewer,
+// possibly none, so the position of any plaintext offset follows from the
+// header alone and the plaintext length from the size of the object.
+// The 96-bit nonce of chunk i is i followed by the 64-bit nonce of the
+// object, so chunks of different objects never share a nonce, however
+// close their nonces are. Untagged, the chunks together are the ciphertext
+// of Chacha20 with the nonce of chunk 0 at block count 1, chunk i thus
+// takes its own range of block counts. Tagged, chunk i is sealed by
+// Chacha20Poly1305 with its nonce, its 16 byte tag follows its ciphertext. The
+// additional data is the header followed by 1 for the last chunk and 0
+// otherwise, so chunks can neither be reordered nor the object truncated.
+namespace chacha20_container {
+
+constexpr std::size_t HEADER_SIZE = 32;
+constexpr std::size_t TAG_SIZE = Poly1305::TAG_SIZE;
+constexpr std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+// Readers allocate one chunk, thus headers may not ask for more
+constexpr std::size_t MAX_CHUNK_SIZE = 16 << 20;
+
+constexpr std::uint8_t FLAG_TAGGED = 1;
+constexpr std::array<std::uint8_t, 8> MAGIC = {'C', 'C', '2', '0', 'C', 'N', 'K', '1'};
+
+// Untagged, the stream of one nonce ends at block 2^32 - 1
+constexpr std::uint64_t MAX_UNTAGGED_SIZE = ((std::uint64_t(1) << 32) - 1) * 64;
+
+// Tagged, the chunk index takes the first word of the nonce
+constexpr std::uint64_t MAX_CHUNKS = std::uint64_t(1) << 32;
+
+using Header = std::array<std::uint8_t, HEADER_SIZE>;
+
+// Additional data of a tagged chunk
+using ChunkAad = std::array<std::uint8_t, HEADER_SIZE + 1>;
+
+/*------------------------------------------------
+@param header header of the object
+@param last true for the last chunk
+@return additional data of a tagged chunk
+------------------------------------------------*/
+inline ChunkAad chunk_aad(const Header& header, bool last) {
+    ChunkAad aad = {};
+    std::copy(header.begin(), header.end(), aad.begin());
+    aad[HEADER_SIZE] = last ? 1 : 0;
+    return aad;
+}
+
+/*------------------------------------------------
+@param nonce nonce of the object
+@param index index of the chunk, 0 for the stream of an untagged object
+@return nonce of the chunk
+------------------------------------------------*/
+inline std::array<std::uint32_t, 3> chunk_nonce(const std::array<std::uint32_t, 2>& nonce, std::uint64_t index) {
+    return {static_cast<std::uint32_t>(index), nonce[0], nonce[1]};
+}
+
+} // namespace chacha20_container
+
+// Writes an object of the container format through sink as the plaintext
+// comes in, holding no more than one chunk. The length of the object need
+// not be known in advance, finish() ends it.
+class Chacha20ContainerWriter {
+public:
+    // Takes the next bytes of the object, returns false if they could not be written
+    using Sink = std::function<bool(const std::uint8_t* data, std::size_t length)>;
+
+private:
+    std::array<std::uint32_t, 8> key;
+    std::array<std::uint32_t, 2> nonce;
+    chacha20_container::Header header;
+    Sink sink;
+    bool tagged;
+
+    // Cipher of an untagged object, positioned at the next chunk
+    Chacha20 cipher;
+    Chacha20Poly1305 aead;
+
+    // Plaintext of the chunk being filled
+    Chacha20Buffer chunk;
+    std::size_t filled;
+    std::uint64_t index;
+    bool started;
+    bool failed;
+    bool finished;
+
+    /*------------------------------------------------
+    Encrypts the buffered chunk and hands it to the
+    sink, preceded by the header for the first chunk.
+
+    @param last true for the last chunk of the object
+    @return false if the object is too large or the sink failed
+    ------------------------------------------------*/
+    bool flush(bool last) {
+        if(tagged && index >= chacha20_container::MAX_CHUNKS) return false;
+        if(!started) {
+            if(!sink(header.data(), header.size())) return false;
+            started = true;
+        }
+
+        if(tagged) {
+            const chacha20_container::ChunkAad aad = chacha20_container::chunk_aad(header, last);
+            Chacha20Poly1305::tag_type tag;
+            aead.seal(chacha20_container::chunk_nonce(nonce, index), aad.data(), aad.size(), chunk.data(), chunk.data(), filled, tag);
+            if(!sink(chunk.data(), filled) || !sink(tag.data(), tag.size())) return false;
+        } else {
+            if(!cipher.update(chunk.data(), chunk.data(), filled)) return false;
+            if(filled > 0 && !sink(chunk.data(), filled)) return false;
+        }
+        index++;
+        filled = 0;
+        return true;
+    }
+
+public:
+    /*------------------------------------------------
+    Starts an object, nothing is written before the
+    first call to write() or finish(). Key and nonce
+    are ordered the same way as for Chacha20.
+
+    @param key 256-bit key
+    @param nonce 64-bit nonce, never to be repeated for the same key
+    @param sink receives the object
+    @param chunk_size bytes of plaintext per chunk, rounded up to a multiple of 64 up to MAX_CHUNK_SIZE
+    @param with_tags true to authenticate every chunk with Poly1305
+    ------------------------------------------------*/
+    Chacha20ContainerWriter(const std::array<std::uint32_t, 8>& key, const std::array<std::uint32_t, 2>& nonce, Sink sink,
+                            std::size_t chunk_size = chacha20_container::DEFAULT_CHUNK_SIZE, bool with_tags = true):
+    key ( key), nonce ( nonce), header ( {}), sink ( std::move(sink)), tagged ( with_tags), cipher ( key, 1, chacha20_container::chunk_nonce(nonce, 0)), aead ( key),
+    chunk ( std::clamp<std::size_t>((chunk_size + 63) / 64 * 64, 64, chacha20_container::MAX_CHUNK_SIZE)), filled ( 0), index ( 0),
+    started ( false), failed ( false), finished ( false) {
+        std::copy(chacha20_container::MAGIC.begin(), chacha20_container::MAGIC.end(), header.begin());
+        header[8] = tagged ? chacha20_container::FLAG_TAGGED : 0;
+        for(size_t i = 0; i < 4; i++) {
+            header[12 + i] = static_cast<std::uint8_t>(chunk.size() >> (8*i));
+        }
+        for(size_t w = 0; w < 2; w++) {
+            for(size_t i = 0; i < 4; i++) {
+                header[16 + 4*w + i] = static_cast<std::uint8_t>(nonce[w] >> (8*i));
+            }
+        }
+    }
+
+    Chacha20ContainerWriter(const Chacha20ContainerWriter&) = delete;
+    Chacha20ContainerWriter& operator=(const Chacha20ContainerWriter&) = delete;
+
+    /*------------------------------------------------
+    Upon destruction 0 all sensetive data
+    ------------------------------------------------*/
+    ~Chacha20ContainerWriter() {
+        volatile std::uint32_t* p = key.data();
+        for(size_t i = 0; i < key.size(); i++) {
+            p[i] = 0;
+        }
+    }
+
+    /*------------------------------------------------
+    Overrides the kernel picked by best_kernel(), the
+    output is the same regardless of the kernel.
+
+    @param k kernel to be used
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        return cipher.select_kernel(k) && aead.select_kernel(k);
+    }
+
+    /*------------------------------------------------
+    Appends length bytes of plaintext to the object,
+    every chunk filled up is encrypted and written.
+
+    @param data plaintext
+    @param length number of bytes of plaintext
+    @return false if the object grew too large, the sink failed or finish() was called,
+            the writer then fails from there on
+    ------------------------------------------------*/
+    bool write(const std::uint8_t* data, std::size_t length) {
+        // Chunks after the one sealed as the last would make the object corrupt
+        if(finished) failed = true;
+        while(!failed && length > 0) {
+            const size_t piece = std::min(chunk.size() - filled, length);
+            std::memcpy(chunk.data() + filled, data, piece);
+            filled += piece;
+            data += piece;
+            length -= piece;
+            // A full chunk is never the last one, the last one holds less than a chunk
+            if(filled == chunk.size()) failed = !flush(false);
+        }
+        return !failed;
+    }
+
+    /*------------------------------------------------
+    Appends plaintext to the object, see write().
+
+    @param data plaintext
+    @return false if the object grew too large, the sink failed or finish() was called
+    ------------------------------------------------*/
+    bool write(std::span<const std::uint8_t> data) {
+        return write(data.data(), data.size());
+    }
+
+    /*------------------------------------------------
+    Writes the last chunk, the object is complete once
+    it returns true. Later calls to write() and finish()
+    fail and write nothing.
+
+    @return false if the object is too large, the sink failed or the object was already finished
+    ------------------------------------------------*/
+    bool finish() {
+        if(finished) failed = true;
+        if(!failed) failed = !flush(true);
+        finished = true;
+        chunk.assign(chunk.size(), 0);
+        filled = 0;
+        return !failed;
+    }
+};
+
+// Decrypts ranges of an object of the container format read through
+// source, holding no more than one chunk, or all of it in parallel.
+// Tagged chunks are verified before any of their bytes are released.
+class Chacha20ContainerReader {
+public:
+    // Reads length bytes of the object at offset, returns false if they could not be read.
+    // read_all() with a pool calls it from several threads at once
+    using Source = std::function<bool(std::uint64_t offset, std::uint8_t* data, std::size_t length)>;
+
+private:
+    std::array<std::uint32_t, 8> key;
+    Chacha20Kernel kernel;
+
+    Source source;
+    chacha20_container::Header header;
+    std::array<std::uint32_t, 2> nonce;
+    bool tagged;
+    std::size_t chunk_size;
+    std::uint64_t chunks;
+    std::uint64_t length;
+
+    // Ciphertext and tag of the chunk read by read()
+    Chacha20Buffer chunk;
+
+    /*------------------------------------------------
+    @param i index of the chunk
+    @return number of bytes of plaintext of chunk i
+    ------------------------------------------------*/
+    std::size_t chunk_length(std::uint64_t i) const {
+        return i + 1 < chunks ? chunk_size : static_cast<std::size_t>(length - (chunks - 1) * chunk_size);
+    }
+
+    /*------------------------------------------------
+    @param i index of the chunk
+    @return offset of chunk i within the object
+    ------------------------------------------------*/
+    std::uint64_t chunk_offset(std::uint64_t i) const {
+        return chacha20_container::HEADER_SIZE + i * (chunk_size + (tagged ? chacha20_container::TAG_SIZE : 0));
+    }
+
+    /*------------------------------------------------
+    Reads and decrypts tagged chunk i into output.
+
+    @param aead authenticated cipher keyed with the key
+    @param i index of the chunk
+    @param output buffer of at least chunk_length(i) bytes
+    @return false if the chunk could not be read or is not authentic, output is then zeroed
+    ------------------------------------------------*/
+    bool open_chunk(const Chacha20Poly1305& aead, std::uint64_t i, std::uint8_t* output) const {
+        const std::size_t n = chunk_length(i);
+        Chacha20Poly1305::tag_type tag;
+        if(!source(chunk_offset(i), output, n) || !source(chunk_offset(i) + n, tag.data(), tag.size())) {
+            std::fill_n(output, n, 0);
+            return false;
+        }
+        const chacha20_container::ChunkAad aad = chacha20_container::chunk_aad(header, i + 1 == chunks);
+        return aead.open(chacha20_container::chunk_nonce(nonce, i), aad.data(), aad.size(), output, output, n, tag);
+    }
+
+public:
+    /*------------------------------------------------
+    Key is ordered the same way as for Chacha20.
+
+    @param key 256-bit key
+    ------------------------------------------------*/
+    explicit Chacha20ContainerReader(const std::array<std::uint32_t, 8>& key):
+    key ( key), kernel ( Chacha20::best_kernel()), header ( {}), nonce ( {}), tagged ( false), chunk_size ( 0), chunks ( 0), length ( 0) {
+    }
+
+    Chacha20ContainerReader(const Chacha20ContainerReader&) = delete;
+    Chacha20ContainerReader& operator=(const Chacha20ContainerReader&) = delete;
+
+    /*------------------------------------------------
+    Upon destruction 0 all sensetive data
+    ------------------------------------------------*/
+    ~Chacha20ContainerReader() {
+        volatile std::uint32_t* p = key.data();
+        for(size_t i = 0; i < key.size(); i++) {
+            p[i] = 0;
+        }
+    }
+
+    /*------------------------------------------------
+    Overrides the kernel picked by best_kernel(), the
+    output is the same regardless of the kernel.
+
+    @param k kernel to be used
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        if(!Chacha20::kernel_supported(k)) return false;
+        kernel = k;
+        return true;
+    }
+
+    /*------------------------------------------------
+    Reads the header of an object, the chunks are
+    located from it and from the size of the object.
+
+    @param object_source reads the object
+    @param object_size size of the object in bytes
+    @return false if the header could not be read or is not one of this format
+    ------------------------------------------------*/
+    bool open(Source object_source, std::uint64_t object_size) {
+        chunks = 0;
+        length = 0;
+        if(object_size < chacha20_container::HEADER_SIZE || !object_source(0, header.data(), header.size())) return false;
+
+        std::uint32_t size = 0;
+        for(size_t i = 0; i < 4; i++) {
+            size |= static_cast<std::uint32_t>(header[12 + i]) << (8*i);
+        }
+        const bool reserved = header[9] == 0 && header[10] == 0 && header[11] == 0
+                           && std::all_of(header.begin() + 24, header.end(), [](std::uint8_t b) { return b == 0; });
+        if(!std::equal(chacha20_container::MAGIC.begin(), chacha20_container::MAGIC.end(), header.begin())
+           || (header[8] & ~chacha20_container::FLAG_TAGGED) != 0 || !reserved
+           || size == 0 || size % 64 != 0 || size > chacha20_container::MAX_CHUNK_SIZE) {
+            return false;
+        }
+
+        // Every chunk but the last is full, the last one carries its tag even if empty
+        const std::uint64_t body = object_size - chacha20_container::HEADER_SIZE;
+        const bool with_tags = (header[8] & chacha20_container::FLAG_TAGGED) != 0;
+        std::uint64_t count, plaintext;
+        if(with_tags) {
+            const std::uint64_t record = size + chacha20_container::TAG_SIZE;
+            if(body % record < chacha20_container::TAG_SIZE) return false;
+            count = body / record + 1;
+            plaintext = body - count * chacha20_container::TAG_SIZE;
+            if(count > chacha20_container::MAX_CHUNKS) return false;
+        } else {
+            count = body / size + 1;
+            plaintext = body;
+            if(plaintext > chacha20_container::MAX_UNTAGGED_SIZE) return false;
+        }
+
+        for(size_t w = 0; w < 2; w++) {
+            nonce[w] = 0;
+            for(size_t i = 0; i < 4; i++) {
+                nonce[w] |= static_cast<std::uint32_t>(header[16 + 4*w + i]) << (8*i);
+            }
+        }
+        source = std::move(object_source);
+        tagged = with_tags;
+        chunk_size = size;
+        chunks = count;
+        length = plaintext;
+        chunk.assign(tagged ? chunk_size : 0, 0);
+        return true;
+    }
+
+    /*------------------------------------------------
+    @return number of bytes of plaintext of the object
+    ------------------------------------------------*/
+    std::uint64_t size() const {
+        return length;
+    }
+
+    /*------------------------------------------------
+    @return number of chunks of the object, the last one may be empty
+    ------------------------------------------------*/
+    std::uint64_t chunk_count() const {
+        return chunks;
+    }
+
+    /*------------------------------------------------
+    Decrypts length bytes of plaintext found at offset.
+    Tagged chunks the range touches are read and
+    verified as a whole, one at a time.
+
+    @param offset position of the range in the plaintext
+    @param output buffer of at least count bytes for the plaintext
+    @param count number of bytes to decrypt
+    @return false if the range lies past the end, or a chunk could not be read or is not authentic,
+            output is then left partly written
+    ------------------------------------------------*/
+    bool read(std::uint64_t offset, std::uint8_t* output, std::size_t count) {
+        if(offset > length || count > length - offset) return false;
+
+        if(!tagged) {
+            // Untagged chunks are contiguous, offset o of the plaintext lies at block count 1 + o / 64 of the stream
+            Chacha20 cipher(key, 1, chacha20_container::chunk_nonce(nonce, 0));
+            cipher.select_kernel(kernel);
+            return source(chacha20_container::HEADER_SIZE + offset, output, count) && cipher.encrypt_at(offset, output, output, count);
+        }
+
+        Chacha20Poly1305 aead(key);
+        aead.select_kernel(kernel);
+        for(std::uint64_t done = 0; done < count; ) {
+            const std::uint64_t i = (offset + done) / chunk_size;
+            const std::size_t start = static_cast<std::size_t>((offset + done) % chunk_size);
+            const std::size_t n = std::min<std::size_t>(chunk_length(i) - start, count - done);
+            if(!open_chunk(aead, i, chunk.data())) return false;
+            std::memcpy(output + done, chunk.data() + start, n);
+            done += n;
+        }
+        return true;
+    }
+
+    /*------------------------------------------------
+    Decrypts the whole object, chunk by chunk.
+
+    @param output buffer of at least size() bytes for the plaintext
+    @return false if a chunk could not be read or is not authentic, output is then zeroed
+    ------------------------------------------------*/
+    bool read_all(std::uint8_t* output) {
+        return read_all(output, nullptr);
+    }
+
+    /*------------------------------------------------
+    Decrypts the whole object, every chunk is a task
+    of pool, decrypted straight into its place in
+    output. Source must allow concurrent reads.
+
+    @param output buffer of at least size() bytes for the plaintext
+    @param pool threads sharing the chunks, the calling thread only if nullptr
+    @return false if a chunk could not be read or is not authentic, output is then zeroed
+    ------------------------------------------------*/
+    bool read_all(std::uint8_t* output, Chacha20ThreadPool* pool) {
+        std::atomic<bool> ok = true;
+        // One key serves every task, untagged chunks start at a whole block of the stream
+        const Chacha20::PreparedKey prepared(key, kernel);
+        auto task = [&](std::size_t i) {
+            std::uint8_t* target = output + static_cast<std::uint64_t>(i) * chunk_size;
+            const std::size_t n = chunk_length(i);
+            if(tagged) {
+                Chacha20Poly1305 aead(key);
+                aead.select_kernel(kernel);
+                if(!open_chunk(aead, i, target)) ok = false;
+            } else {
+                const std::uint64_t first_block = 1 + static_cast<std::uint64_t>(i) * (chunk_size / 64);
+                if(first_block > UINT32_MAX || !source(chunk_offset(i), target, n)
+                   || !prepared.encrypt(chacha20_container::chunk_nonce(nonce, 0), static_cast<std::uint32_t>(first_block), target, target, n)) {
+                    ok = false;
+                }
+            }
+        };
+        if(pool != nullptr) {
+            pool->parallel_for(static_cast<std::size_t>(chunks), task);
+        } else {
+            for(std::uint64_t i = 0; i < chunks; i++) {
+                task(static_cast<std::size_t>(i));
+            }
+        }
+
+        if(!ok) {
+            volatile std::uint8_t* p = output;
+            for(std::uint64_t i = 0; i < length; i++) {
+                p[i] = 0;
+            }
+        }
+        return ok;
+    }
+};
+
+#endif /* #ifndef __CHACHA20_CONTAINER__ */
@@ -0,0 +1,411 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_CUDA__
+#define __CHACHA20_CUDA__
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <span>
+#include <vector>
+
+#include "chacha20.hpp"
+
+// Device side of ChachaCuda, every thread computes and XORs one 64 byte block
+namespace chacha20_cuda {
+
+constexpr unsigned int THREADS_PER_BLOCK = 256;
+
+// Initial state of a launch, passed by value as a kernel argument
+struct State {
+    std::uint32_t words[16];
+};
+
+__device__ __forceinline__ std::uint32_t rotl(std::uint32_t x, int n) {
+    return __funnelshift_l(x, x, n);
+}
+
+__device__ __forceinline__ void quarter_round(std::uint32_t& a, std::uint32_t& b, std::uint32_t& c, std::uint32_t& d) {
+    a += b; d ^= a; d = rotl(d, 16);
+    c += d; b ^= c; b = rotl(b, 12);
+    a += b; d ^= a; d = rotl(d, 8);
+    c += d; b ^= c; b = rotl(b, 7);
+}
+
+/*------------------------------------------------
+XORs blocks blocks of data in place with the keystream
+of state, block i of data uses block count state + i.
+Buffers are padded to whole blocks, the padding is
+XORed as well and never copied back.
+
+@param state state of block 0 of data
+@param data device buffer of blocks * 64 bytes
+@param blocks number of blocks
+@tparam ROUNDS number of double rounds
+@tparam COUNTER64 block count carries into word 13
+------------------------------------------------*/
+template<unsigned ROUNDS, bool COUNTER64>
+__global__ void xor_keystream(State state, uint4* data, std::uint64_t blocks) {
+    const std::uint64_t stride = static_cast<std::uint64_t>(gridDim.x) * blockDim.x;
+    for(std::uint64_t i = static_cast<std::uint64_t>(blockIdx.x) * blockDim.x + threadIdx.x; i < blocks; i += stride) {
+        std::uint32_t x[16];
+        #pragma unroll
+        for(int j = 0; j < 16; j++) {
+            x[j] = state.words[j];
+        }
+        const std::uint64_t counter = state.words[12] + i;
+        x[12] = static_cast<std::uint32_t>(counter);
+        if(COUNTER64) x[13] = state.words[13] + static_cast<std::uint32_t>(counter >> 32);
+        const std::uint32_t counter_low = x[12];
+        const std::uint32_t counter_high = x[13];
+
+        #pragma unroll
+        for(unsigned r = 0; r < ROUNDS; r++) {
+            quarter_round(x[0], x[4], x[8], x[12]);
+            quarter_round(x[1], x[5], x[9], x[13]);
+            quarter_round(x[2], x[6], x[10], x[14]);
+            quarter_round(x[3], x[7], x[11], x[15]);
+            quarter_round(x[0], x[5], x[10], x[15]);
+            quarter_round(x[1], x[6], x[11], x[12]);
+            quarter_round(x[2], x[7], x[8], x[13]);
+            quarter_round(x[3], x[4], x[9], x[14]);
+        }
+
+        #pragma unroll
+        for(int j = 0; j < 16; j++) {
+            x[j] += j == 12 ? counter_low : j == 13 ? counter_high : state.words[j];
+        }
+
+        // Words are serialized little-endian, as is device memory
+        #pragma unroll
+        for(int j = 0; j < 4; j++) {
+            uint4 v = data[4*i + j];
+            v.x ^= x[4*j];
+            v.y ^= x[4*j + 1];
+            v.z ^= x[4*j + 2];
+            v.w ^= x[4*j + 3];
+            data[4*i + j] = v;
+        }
+    }
+}
+
+} // namespace chacha20_cuda
+
+// Allocator of page-locked host memory, which the device copies to and from
+// asynchronously. Throws std::bad_alloc if the driver refuses.
+template<typename T>
+struct Chacha20PinnedAllocator {
+    using value_type = T;
+
+    Chacha20PinnedAllocator() noexcept = default;
+
+    template<typename U>
+    Chacha20PinnedAllocator(const Chacha20PinnedAllocator<U>&) noexcept {
+    }
+
+    T* allocate(std::size_t n) {
+        void* p = nullptr;
+        if(cudaHostAlloc(&p, n * sizeof(T), cudaHostAllocPortable) != cudaSuccess) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t) noexcept {
+        cudaFreeHost(p);
+    }
+
+    template<typename U>
+    bool operator==(const Chacha20PinnedAllocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+// Byte buffer in page-locked host memory, messages in it skip the staging copy of ChachaCuda
+using Chacha20PinnedBuffer = std::vector<std::uint8_t, Chacha20PinnedAllocator<std::uint8_t>>;
+
+// Encrypts bulk data on a CUDA device with the key, nonce and block count
+// semantics of Chacha, the output is the same as that of the CPU kernels.
+// Messages are cut into chunks taken in turn by a few CUDA streams, so the
+// copy of one chunk to the device, the keystream of the next and the copy
+// back of a third overlap. Messages in pinned memory (Chacha20PinnedBuffer)
+// are copied directly, others go through pinned staging buffers.
+template<unsigned DOUBLE_ROUNDS = 10, bool COUNTER64 = false>
+class ChachaCuda {
+
+    using Cipher = Chacha<DOUBLE_ROUNDS, COUNTER64>;
+    using counter_type = typename Cipher::counter_type;
+
+    static constexpr std::size_t BLOCK_SIZE = Cipher::BLOCK_SIZE;
+
+    // Number of chunks in flight at a time
+    static constexpr std::size_t STREAMS = 3;
+
+    // A chunk of this many bytes is shared by a million threads
+    static constexpr std::size_t CHUNK_SIZE = 64 << 20;
+
+    // One chunk in flight, its staging buffer is only allocated once unpinned memory comes along
+    struct Slot {
+        cudaStream_t stream;
+        void* device;
+        std::uint8_t* staging;
+
+        // Output of the staged chunk, copied out of staging once the stream is done
+        std::uint8_t* output;
+        std::size_t length;
+
+        // Bytes of the device and staging buffers holding data of the current message, whole blocks
+        std::size_t dirty;
+    };
+
+    std::array<std::uint32_t, Cipher::KEY_WORDS> key;
+    std::array<std::uint32_t, Cipher::NONCE_WORDS> nonce;
+
+    // Block count of the next message, a message starts at a fresh block as with Chacha::encrypt()
+    std::uint64_t block_count;
+    bool exhausted;
+
+    int device;
+    std::array<Slot, STREAMS> slots;
+    bool ready;
+
+    /*------------------------------------------------
+    @param p host pointer
+    @return true if p lies in page-locked memory
+    ------------------------------------------------*/
+    static bool pinned(const void* p) {
+        cudaPointerAttributes attributes;
+        if(cudaPointerGetAttributes(&attributes, p) != cudaSuccess) {
+            cudaGetLastError();
+            return false;
+        }
+        return attributes.type == cudaMemoryTypeHost;
+    }
+
+    /*------------------------------------------------
+    Waits for the chunk in flight on slot and copies it
+    out of the staging buffer if it was staged.
+
+    @param slot slot to be drained
+    @return false on a device error
+    ------------------------------------------------*/
+    static bool drain(Slot& slot) {
+        const bool ok = cudaStreamSynchronize(slot.stream) == cudaSuccess;
+        if(ok && slot.output != nullptr) {
+            std::memcpy(slot.output, slot.staging, slot.length);
+        }
+        slot.output = nullptr;
+        return ok;
+    }
+
+    /*------------------------------------------------
+    Sets the bytes of the device and staging buffers of
+    slot used by the current message to 0, once the
+    chunk in flight is done. Plaintext and keystream
+    must not outlive the message in either buffer.
+
+    @param slot slot to be scrubbed
+    @return false on a device error
+    ------------------------------------------------*/
+    static bool scrub(Slot& slot) {
+        bool ok = true;
+        if(slot.dirty > 0) {
+            ok = cudaMemsetAsync(slot.device, 0, slot.dirty, slot.stream) == cudaSuccess;
+            ok = cudaStreamSynchronize(slot.stream) == cudaSuccess && ok;
+            if(slot.staging != nullptr) std::fill_n(static_cast<volatile std::uint8_t*>(slot.staging), slot.dirty, 0);
+        }
+        slot.dirty = 0;
+        return ok;
+    }
+
+    /*------------------------------------------------
+    Releases the streams and buffers of all slots,
+    scrubbing them first.
+    ------------------------------------------------*/
+    void release() {
+        for(Slot& slot : slots) {
+            if(slot.stream != nullptr) cudaStreamSynchronize(slot.stream);
+            if(slot.staging != nullptr) {
+                std::fill_n(static_cast<volatile std::uint8_t*>(slot.staging), CHUNK_SIZE, 0);
+                cudaFreeHost(slot.staging);
+            }
+            if(slot.device != nullptr) {
+                cudaMemset(slot.device, 0, CHUNK_SIZE);
+                cudaFree(slot.device);
+            }
+            if(slot.stream != nullptr) cudaStreamDestroy(slot.stream);
+            slot = Slot{nullptr, nullptr, nullptr, nullptr, 0, 0};
+        }
+    }
+
+public:
+    /*------------------------------------------------
+    Allocates the device buffers and streams, key, block
+    count and nonce are the same as for the Chacha
+    constructor. Check ready() before use.
+
+    @param key 256-bit key
+    @param block_count block count of the first block
+    @param nonce 96-bit nonce, 64-bit in COUNTER64 mode
+    @param device CUDA device to run on
+    ------------------------------------------------*/
+    explicit ChachaCuda(const std::array<std::uint32_t, Cipher::KEY_WORDS>& key, counter_type block_count,
+                        const std::array<std::uint32_t, Cipher::NONCE_WORDS>& nonce, int device = 0):
+    key ( key), nonce ( nonce), block_count ( block_count), exhausted ( false), device ( device), ready ( false) {
+        slots.fill(Slot{nullptr, nullptr, nullptr, nullptr, 0, 0});
+        if(cudaSetDevice(device) != cudaSuccess) return;
+        for(Slot& slot : slots) {
+            if(cudaStreamCreateWithFlags(&slot.stream, cudaStreamNonBlocking) != cudaSuccess
+               || cudaMalloc(&slot.device, CHUNK_SIZE) != cudaSuccess) {
+                release();
+                return;
+            }
+        }
+        ready = true;
+    }
+
+    ChachaCuda(const ChachaCuda&) = delete;
+    ChachaCuda& operator=(const ChachaCuda&) = delete;
+
+    ~ChachaCuda() {
+        release();
+        Cipher::secure_zero(key);
+    }
+
+    /*------------------------------------------------
+    @return true if a CUDA device is present
+    ------------------------------------------------*/
+    static bool available() {
+        int count = 0;
+        if(cudaGetDeviceCount(&count) != cudaSuccess) {
+            cudaGetLastError();
+            return false;
+        }
+        return count > 0;
+    }
+
+    /*------------------------------------------------
+    @return false if the device buffers could not be
+            allocated, encrypt() then always fails
+    ------------------------------------------------*/
+    bool is_ready() const {
+        return ready;
+    }
+
+    /*------------------------------------------------
+    Starts a new message with the same key, the same as
+    Chacha::reset().
+
+    @param new_nonce nonce of the new message, must not be repeated for the same key
+    @param new_block_count block count the new message starts at
+    ------------------------------------------------*/
+    void reset(const std::array<std::uint32_t, Cipher::NONCE_WORDS>& new_nonce, counter_type new_block_count) {
+        nonce = new_nonce;
+        block_count = new_block_count;
+        exhausted = false;
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of length bytes from
+    input into output on the device, the same as
+    Chacha::encrypt(): the message starts at a fresh
+    block and the block count is advanced past it.
+    input and output may point to the same buffer.
+    Returns once the output is complete.
+
+    @param input Message for encryption or decryption
+    @param output Buffer of at least length bytes for the result
+    @param length Number of bytes to process
+    @return false if the message does not fit into the rest of the stream, nothing is processed then,
+            or on a device error, the output is then incomplete and the block count left unchanged
+    ------------------------------------------------*/
+    bool encrypt(const std::uint8_t* input, std::uint8_t* output, std::size_t length) {
+        const std::uint64_t blocks = (static_cast<std::uint64_t>(length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if(exhausted ? blocks > 0 : !Cipher::stream_fits(static_cast<counter_type>(block_count), blocks)) return false;
+        if(!ready) return false;
+        if(cudaSetDevice(device) != cudaSuccess) return false;
+
+        const bool direct = pinned(input) && pinned(output);
+        std::array<std::uint32_t, Cipher::STATE_SIZE> words = {};
+        Cipher::init_state(words, key, static_cast<counter_type>(block_count), nonce);
+
+        bool ok = true;
+        for(std::size_t pos = 0, i = 0; ok && pos < length; pos += CHUNK_SIZE, i++) {
+            Slot& slot = slots[i % STREAMS];
+            const std::size_t piece = std::min(CHUNK_SIZE, length - pos);
+            ok = drain(slot);
+            if(!ok) break;
+
+            const std::uint8_t* source = input + pos;
+            std::uint8_t* target = output + pos;
+            if(!direct) {
+                if(slot.staging == nullptr && cudaHostAlloc(reinterpret_cast<void**>(&slot.staging), CHUNK_SIZE, cudaHostAllocDefault) != cudaSuccess) {
+                    slot.staging = nullptr;
+                    ok = false;
+                    break;
+                }
+                std::memcpy(slot.staging, source, piece);
+                source = slot.staging;
+                target = slot.staging;
+                slot.output = output + pos;
+                slot.length = piece;
+            }
+
+            // Block count of the chunk, carried into word 13 in COUNTER64 mode
+            chacha20_cuda::State state;
+            std::copy(words.begin(), words.end(), state.words);
+            const std::uint64_t first = Cipher::get_counter(words.data()) + pos / BLOCK_SIZE;
+            state.words[12] = static_cast<std::uint32_t>(first);
+            if(COUNTER64) state.words[13] = static_cast<std::uint32_t>(first >> 32);
+
+            const std::uint64_t chunk_blocks = (piece + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            // The kernel writes whole blocks, the padding of a partial last block holds keystream too
+            slot.dirty = std::max<std::size_t>(slot.dirty, chunk_blocks * BLOCK_SIZE);
+            const unsigned int grid = static_cast<unsigned int>((chunk_blocks + chacha20_cuda::THREADS_PER_BLOCK - 1) / chacha20_cuda::THREADS_PER_BLOCK);
+            ok = cudaMemcpyAsync(slot.device, source, piece, cudaMemcpyHostToDevice, slot.stream) == cudaSuccess;
+            chacha20_cuda::xor_keystream<DOUBLE_ROUNDS, COUNTER64><<<grid, chacha20_cuda::THREADS_PER_BLOCK, 0, slot.stream>>>(
+                state, static_cast<uint4*>(slot.device), chunk_blocks);
+            // The launch took its own copy of the state
+            std::fill_n(static_cast<volatile std::uint32_t*>(state.words), Cipher::STATE_SIZE, 0);
+            ok = ok && cudaGetLastError() == cudaSuccess
+                    && cudaMemcpyAsync(target, slot.device, piece, cudaMemcpyDeviceToHost, slot.stream) == cudaSuccess;
+        }
+        Cipher::secure_zero(words);
+        for(Slot& slot : slots) {
+            ok = drain(slot) && ok;
+            ok = scrub(slot) && ok;
+        }
+        if(!ok) return false;
+
+        // The 64-bit block count wraps around to 0 at the end of the stream
+        block_count += blocks;
+        exhausted = COUNTER64 ? blocks > 0 && block_count == 0 : block_count == (std::uint64_t(1) << 32);
+        return true;
+    }
+
+    /*------------------------------------------------
+    Performs encryption/decryption of input into output,
+    see encrypt(input, output, length). Only the first
+    input.size() bytes of output are written, if output
+    is shorter only output.size() bytes are processed.
+
+    @param input Message for encryption or decryption
+    @param output Buffer for the result
+    @return see encrypt(input, output, length)
+    ------------------------------------------------*/
+    bool encrypt(std::span<const std::uint8_t> input, std::span<std::uint8_t> output) {
+        return encrypt(input.data(), output.data(), std::min(input.size(), output.size()));
+    }
+};
+
+// ChaCha20 as specified in RFC 8439 on a CUDA device
+using Chacha20Cuda = ChachaCuda<10>;
+
+#endif /* #ifndef __CHACHA20_CUDA__ */
@@ -0,0 +1,179 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+// chacha20-file: encrypts or decrypts files of any size with ChaCha20
+//
+//   chacha20-file [-c block_count] <key> <nonce> <input> [output]
+//
+// key is 64 and nonce 24 hex digits. Without output the input is
+// overwritten in place, otherwise output is created or truncated.
+// Input and output are memory-mapped one window at a time, thus
+// memory use is constant and no byte is copied before encryption.
+
+#include "chacha20.hpp"  // Including ChaCha20 header
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Bytes mapped at a time, a multiple of both the page size and the block size
+constexpr std::size_t WINDOW_SIZE = 64 << 20;
+
+// Prints usage and returns the exit code for invalid arguments
+int usage(const char* program) {
+    std::fprintf(stderr, "usage: %s [-c block_count] <key: 64 hex digits> <nonce: 24 hex digits> <input> [output]\n", program);
+    return 2;
+}
+
+// Prints what failed along with errno and returns the exit code for failures
+int fail(const char* what, const char* path) {
+    std::fprintf(stderr, "%s %s: %s\n", what, path, std::strerror(errno));
+    return 1;
+}
+
+// Parses exactly N words of 8 hex digits each, ordered the way the Chacha20 constructor expects
+template<std::size_t N>
+bool parse_words(const char* hex, std::array<std::uint32_t, N>& words) {
+    if (std::strlen(hex) != 8 * N) return false;
+    for (std::size_t i = 0; i < N; ++i) {
+        char digits[9] = {};
+        std::memcpy(digits, hex + 8 * i, 8);
+        char* end;
+        words[i] = static_cast<std::uint32_t>(std::strtoul(digits, &end, 16));
+        if (*end != '\0') return false;
+    }
+    return true;
+}
+
+// Closes a file descriptor when leaving scope, on errors too
+struct Descriptor {
+    int fd;
+
+    explicit Descriptor(int fd): fd ( fd) {
+    }
+
+    Descriptor(const Descriptor&) = delete;
+    Descriptor& operator=(const Descriptor&) = delete;
+
+    ~Descriptor() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+// Unmaps a window when leaving scope, on errors too
+struct Mapping {
+    void* data;
+    std::size_t length;
+
+    Mapping(): data ( MAP_FAILED), length ( 0) {
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    // Maps size bytes of fd at offset, data is MAP_FAILED if that fails
+    bool map(int fd, std::size_t offset, std::size_t size, int protection) {
+        length = size;
+        data = mmap(nullptr, length, protection, MAP_SHARED, fd, static_cast<off_t>(offset));
+        if (data == MAP_FAILED) return false;
+        madvise(data, length, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    ~Mapping() {
+        if (data != MAP_FAILED) munmap(data, length);
+    }
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::uint32_t block_count = 0;
+    int arg = 1;
+    if (arg + 1 < argc && std::strcmp(argv[arg], "-c") == 0) {
+        // strtoull accepts a sign and saturates, thus both are ruled out before narrowing
+        const char* digits = argv[arg + 1];
+        char* end;
+        errno = 0;
+        const unsigned long long value = std::strtoull(digits, &end, 10);
+        if (*digits < '0' || *digits > '9' || *end != '\0' || errno == ERANGE || value > 0xffffffffULL) return usage(argv[0]);
+        block_count = static_cast<std::uint32_t>(value);
+        arg += 2;
+    }
+    if (argc - arg != 3 && argc - arg != 4) return usage(argv[0]);
+
+    std::array<std::uint32_t, 8> key;
+    std::array<std::uint32_t, 3> nonce;
+    if (!parse_words(argv[arg], key) || !parse_words(argv[arg + 1], nonce)) return usage(argv[0]);
+    const char* input_path = argv[arg + 2];
+    const char* output_path = (argc - arg == 4) ? argv[arg + 3] : nullptr;
+
+    // In place the input is mapped writable and serves as the output
+    const Descriptor input_file(open(input_path, output_path ? O_RDONLY : O_RDWR));
+    if (input_file.fd < 0) return fail("cannot open", input_path);
+    struct stat input_stat;
+    if (fstat(input_file.fd, &input_stat) != 0) return fail("cannot stat", input_path);
+    const std::size_t size = static_cast<std::size_t>(input_stat.st_size);
+
+    // The whole file has to fit before the 32bit block count wraps around, checked before
+    // any byte is encrypted as in place a refused window leaves the file half encrypted
+    if ((static_cast<std::uint64_t>(size) + 63) / 64 > (std::uint64_t(1) << 32) - block_count) {
+        std::fprintf(stderr, "%s: too long for the block count, at most 256 GiB past block_count fit\n", input_path);
+        return 1;
+    }
+
+    // Truncated only once it is known not to be the input, which would be lost otherwise
+    const Descriptor output_file(output_path ? open(output_path, O_RDWR | O_CREAT, input_stat.st_mode & 0777) : -1);
+    const int output_fd = output_path ? output_file.fd : input_file.fd;
+    if (output_path) {
+        if (output_fd < 0) return fail("cannot open", output_path);
+        struct stat output_stat;
+        if (fstat(output_fd, &output_stat) != 0) return fail("cannot stat", output_path);
+        if (output_stat.st_dev == input_stat.st_dev && output_stat.st_ino == input_stat.st_ino) {
+            std::fprintf(stderr, "%s: output is the input, omit output to encrypt in place\n", output_path);
+            return 1;
+        }
+        if (ftruncate(output_fd, 0) != 0) return fail("cannot truncate", output_path);
+        // Allocating the whole output upfront fails early when the disk is full
+        if (size > 0 && (errno = posix_fallocate(output_fd, 0, static_cast<off_t>(size))) != 0) {
+            return fail("cannot allocate", output_path);
+        }
+    }
+
+    Chacha20 cipher(key, block_count, nonce);
+    cipher.enable_parallel();
+    // Output goes to the file and is not read again by this process
+    cipher.enable_streaming();
+
+    for (std::size_t offset = 0; offset < size; offset += WINDOW_SIZE) {
+        const std::size_t length = std::min(WINDOW_SIZE, size - offset);
+
+        // Dropping the window at the end of the iteration keeps memory use constant,
+        // dirty pages are written back by the kernel
+        Mapping output;
+        if (!output.map(output_fd, offset, length, PROT_READ | PROT_WRITE)) return fail("cannot map", output_path ? output_path : input_path);
+        Mapping input;
+        if (output_path && !input.map(input_file.fd, offset, length, PROT_READ)) return fail("cannot map", input_path);
+
+        // Fits as the length was checked upfront
+        cipher.update(static_cast<const std::uint8_t*>(output_path ? input.data : output.data), static_cast<std::uint8_t*>(output.data), length);
+    }
+
+    if (fsync(output_fd) != 0) return fail("cannot sync", output_path ? output_path : input_path);
+    return 0;
+}
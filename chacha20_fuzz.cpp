@@ -0,0 +1,275 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+// Differential fuzz target: every kernel the cpu supports, and every way of
+// feeding a message (whole, chunked update(), encrypt_at(), generate(),
+// encrypt_batch(), streaming, session tables, 64-bit block counts) must give
+// the same bytes as a block-by-block reference built on the scalar block
+// function. A mismatch aborts, so the fuzzer keeps the input.
+//
+//   clang++ -std=c++20 -O2 -g -fsanitize=fuzzer,address,undefined chacha20_fuzz.cpp -o chacha20-fuzz -pthread
+//   ./chacha20-fuzz -max_len=8192
+//
+// Without libFuzzer, defining CHACHA20_FUZZ_STANDALONE gives a main that runs
+// the files given as arguments, or that many random inputs if the argument is a number:
+//
+//   g++ -std=c++20 -O2 -DCHACHA20_FUZZ_STANDALONE chacha20_fuzz.cpp -o chacha20-fuzz -pthread
+//   ./chacha20-fuzz 100000
+
+#include "chacha20.hpp"  // Including ChaCha20 header
+#include "chacha20_session.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <vector>
+
+namespace {
+
+// Input layout: key, nonce, block count, flags, chunk sizes, then the message
+constexpr std::size_t KEY_BYTES = 32;
+constexpr std::size_t NONCE_BYTES = 12;
+constexpr std::size_t COUNTER_BYTES = 4;
+constexpr std::size_t CHUNK_BYTES = 8;
+constexpr std::size_t HEADER_SIZE = KEY_BYTES + NONCE_BYTES + COUNTER_BYTES + 1 + CHUNK_BYTES;
+
+constexpr Chacha20Kernel KERNELS[] = {Chacha20Kernel::Scalar, Chacha20Kernel::SSE2, Chacha20Kernel::AVX2,
+                                      Chacha20Kernel::AVX512, Chacha20Kernel::NEON, Chacha20Kernel::SVE2};
+
+// Reads consumed bytes of the input one after another
+class Reader {
+
+    const std::uint8_t* data;
+    std::size_t size;
+
+public:
+    Reader(const std::uint8_t* data, std::size_t size): data ( data), size ( size) {
+    }
+
+    std::uint32_t word() {
+        std::uint32_t result = 0;
+        for (int i = 0; i < 4; ++i) {
+            result = (result << 8) | byte();
+        }
+        return result;
+    }
+
+    std::uint8_t byte() {
+        if (size == 0) return 0;
+        size--;
+        return *data++;
+    }
+
+    std::span<const std::uint8_t> rest() const {
+        return {data, size};
+    }
+};
+
+// Stops the run on the first divergence, the fuzzer reports the input
+void check(bool condition, const char* what, Chacha20Kernel kernel) {
+    if (condition) return;
+    std::fprintf(stderr, "mismatch: %s on kernel %s\n", what, Chacha20::kernel_name(kernel));
+    std::abort();
+}
+
+// Keystream xor message from one constant_keystream() call per block, independent of the kernels
+// and of the stream bookkeeping. Returns false if the block count runs out in RFC 8439 mode
+template<typename Cipher, typename Counter, std::size_t NONCE_WORDS>
+bool reference(const std::array<std::uint32_t, 8>& key, Counter counter, const std::array<std::uint32_t, NONCE_WORDS>& nonce,
+               std::span<const std::uint8_t> message, std::vector<std::uint8_t>& output) {
+    const std::uint64_t blocks = (message.size() + 63) / 64;
+    if (sizeof(Counter) == 4 && blocks > (std::uint64_t(1) << 32) - counter) return false;
+
+    output.resize(message.size());
+    for (std::size_t pos = 0; pos < message.size(); pos += 64, ++counter) {
+        const std::array<std::uint8_t, 64> block = Cipher::template constant_keystream<64>(key, counter, nonce);
+        for (std::size_t i = 0; i < 64 && pos + i < message.size(); ++i) {
+            output[pos + i] = message[pos + i] ^ block[i];
+        }
+    }
+    return true;
+}
+
+// Cross-checks every front end of Chacha20 on one kernel against the reference
+void check_kernel(Chacha20Kernel kernel, const std::array<std::uint32_t, 8>& key, std::uint32_t counter,
+                  const std::array<std::uint32_t, 3>& nonce, std::uint8_t flags, const std::array<std::uint8_t, CHUNK_BYTES>& chunks,
+                  std::span<const std::uint8_t> message, const std::vector<std::uint8_t>& expected, bool fits) {
+    const std::size_t length = message.size();
+
+    // Whole message, caller buffer
+    Chacha20 whole(key, counter, nonce);
+    whole.select_kernel(kernel);
+    std::vector<std::uint8_t> output(length, 0xee);
+    const bool whole_ok = whole.encrypt(message.data(), output.data(), length);
+    check(whole_ok == fits, "encrypt() overflow", kernel);
+    if (!fits) {
+        check(std::all_of(output.begin(), output.end(), [](std::uint8_t b) { return b == 0xee; }), "refused output untouched", kernel);
+        return;
+    }
+    check(output == expected, "encrypt()", kernel);
+
+    // Chunked update() with chunk sizes taken from the input, 0 to 255 bytes cycling
+    Chacha20 chunked(key, counter, nonce);
+    chunked.select_kernel(kernel);
+    std::vector<std::uint8_t> streamed(message.begin(), message.end());
+    for (std::size_t pos = 0, i = 0; pos < length; ++i) {
+        const std::size_t piece = std::min<std::size_t>(length - pos, chunks[i % CHUNK_BYTES] + (flags & 1));
+        check(chunked.update(streamed.data() + pos, streamed.data() + pos, piece), "update() refused", kernel);
+        pos += piece;
+    }
+    check(streamed == expected, "update() in chunks", kernel);
+
+    // Any sub range through encrypt_at()
+    const std::size_t offset = length == 0 ? 0 : (chunks[0] * 257u + chunks[1]) % length;
+    std::vector<std::uint8_t> part(length - offset);
+    check(whole.encrypt_at(offset, message.data() + offset, part.data(), part.size()), "encrypt_at() refused", kernel);
+    check(std::equal(part.begin(), part.end(), expected.begin() + offset), "encrypt_at()", kernel);
+
+    // Keystream itself
+    Chacha20 generator(key, counter, nonce);
+    generator.select_kernel(kernel);
+    std::vector<std::uint8_t> stream(length);
+    check(generator.generate(stream.data(), length), "generate() refused", kernel);
+    for (std::size_t i = 0; i < length; ++i) {
+        check(static_cast<std::uint8_t>(stream[i] ^ message[i]) == expected[i], "generate()", kernel);
+    }
+
+    // Batch of the whole message and its two halves at their own block counts
+    const std::size_t half = (length / 2) / 64 * 64;
+    std::vector<std::uint8_t> batched(length);
+    std::vector<Chacha20::Job> jobs = {
+        {key, counter, nonce, message.data(), batched.data(), half},
+        {key, static_cast<std::uint32_t>(counter + half / 64), nonce, message.data() + half, batched.data() + half, length - half},
+    };
+    check(Chacha20::encrypt_batch(jobs, kernel), "encrypt_batch() refused", kernel);
+    check(batched == expected, "encrypt_batch()", kernel);
+
+    // Streaming stores into an aligned buffer at an offset from the flags
+    Chacha20 streaming(key, counter, nonce);
+    streaming.select_kernel(kernel);
+    streaming.enable_streaming(0);
+    const std::size_t shift = (flags >> 1) & 63;
+    Chacha20Buffer aligned(length + 64);
+    check(streaming.encrypt(message.data(), aligned.data() + shift, length), "streaming refused", kernel);
+    check(std::equal(expected.begin(), expected.end(), aligned.begin() + shift), "streaming encrypt()", kernel);
+
+    // Session table, the session sits at a lane given by the flags among idle ones
+    const std::size_t lane = (flags >> 2) % 19;
+    Chacha20SessionTable table(lane + 1);
+    table.select_kernel(kernel);
+    table.open(lane, key, counter, nonce);
+    std::vector<std::uint8_t> session_output(length);
+    std::vector<Chacha20SessionTable::Message> messages(lane + 1, {nullptr, nullptr, 0});
+    messages[lane] = {message.data(), session_output.data(), length};
+    check(table.encrypt(messages), "session table refused", kernel);
+    check(session_output == expected, "session table", kernel);
+}
+
+// Runs one 64-bit block count across 2^32 on every kernel, the reference carries into word 13
+void check_counter64(std::span<const std::uint8_t> message, const std::array<std::uint32_t, 8>& key, std::uint32_t low,
+                     const std::array<std::uint32_t, 3>& nonce) {
+    const std::uint64_t counter = (std::uint64_t(nonce[0]) << 32) | low;
+    const std::array<std::uint32_t, 2> djb_nonce = {nonce[1], nonce[2]};
+    std::vector<std::uint8_t> expected;
+    reference<Chacha20Djb>(key, counter, djb_nonce, message, expected);
+
+    for (Chacha20Kernel kernel : KERNELS) {
+        if (!Chacha20Djb::kernel_supported(kernel)) continue;
+        Chacha20Djb cipher(key, counter, djb_nonce);
+        cipher.select_kernel(kernel);
+        std::vector<std::uint8_t> output(message.size());
+        check(cipher.encrypt(message.data(), output.data(), message.size()), "64-bit count refused", kernel);
+        check(output == expected, "64-bit block count", kernel);
+    }
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size) {
+    if (size < HEADER_SIZE) return 0;
+    Reader reader(data, size);
+
+    std::array<std::uint32_t, 8> key;
+    for (std::uint32_t& word : key) {
+        word = reader.word();
+    }
+    std::array<std::uint32_t, 3> nonce;
+    for (std::uint32_t& word : nonce) {
+        word = reader.word();
+    }
+    std::uint32_t counter = reader.word();
+    const std::uint8_t flags = reader.byte();
+    std::array<std::uint8_t, CHUNK_BYTES> chunks;
+    for (std::uint8_t& chunk : chunks) {
+        chunk = reader.byte();
+    }
+
+    // Block counts close to the end of the stream are the interesting ones
+    if (flags & 0x80) counter = 0xffffffff - (counter & 0x3f);
+
+    // Short inputs are stretched so the bulk kernels are reached as well
+    std::vector<std::uint8_t> message(reader.rest().begin(), reader.rest().end());
+    if (flags & 0x40) {
+        const std::size_t stretched = message.size() * (1 + chunks[7] % 16);
+        for (std::size_t i = message.size(); i < stretched; ++i) {
+            message.push_back(static_cast<std::uint8_t>(message[i % (message.size())] + i));
+        }
+    }
+
+    std::vector<std::uint8_t> expected;
+    const bool fits = reference<Chacha20>(key, counter, nonce, message, expected);
+
+    for (Chacha20Kernel kernel : KERNELS) {
+        if (!Chacha20::kernel_supported(kernel)) continue;
+        check_kernel(kernel, key, counter, nonce, flags, chunks, message, expected, fits);
+    }
+    check_counter64(message, key, counter, nonce);
+    return 0;
+}
+
+#if defined(CHACHA20_FUZZ_STANDALONE)
+int main(int argc, char** argv) {
+    for (int arg = 1; arg < argc; ++arg) {
+        char* end;
+        const unsigned long runs = std::strtoul(argv[arg], &end, 10);
+        if (*end == '\0') {
+            // Random inputs of up to 4 KiB from a fixed seed, so runs are reproducible
+            std::uint64_t seed = 0x9e3779b97f4a7c15ULL;
+            std::vector<std::uint8_t> input;
+            for (unsigned long run = 0; run < runs; ++run) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                input.resize(HEADER_SIZE + (seed >> 33) % 4096);
+                for (std::uint8_t& byte : input) {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    byte = static_cast<std::uint8_t>(seed >> 56);
+                }
+                LLVMFuzzerTestOneInput(input.data(), input.size());
+            }
+            std::printf("%lu random inputs passed\n", runs);
+            continue;
+        }
+
+        std::FILE* file = std::fopen(argv[arg], "rb");
+        if (file == nullptr) {
+            std::perror(argv[arg]);
+            return 1;
+        }
+        std::vector<std::uint8_t> input;
+        for (int c; (c = std::fgetc(file)) != EOF; ) {
+            input.push_back(static_cast<std::uint8_t>(c));
+        }
+        std::fclose(file);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        std::printf("%s passed\n", argv[arg]);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,216 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+// chacha20-perf-gate: fails when a kernel got slower than its stored baseline
+//
+//   chacha20-perf-gate [-t threshold] [-u] <baseline>
+//
+// Measures the throughput in GB/s of every kernel the cpu supports on a few
+// message sizes and compares them against baseline, a file of
+// "<name> <GB/s>" lines. The exit code is 1 if any
+// measurement is more than threshold (a fraction, 0.1 by default) below its
+// baseline, such measurements are taken again before they count. -u writes
+// the measurements to baseline instead. Measurements missing from the
+// baseline, e.g. of kernels the cpu it was taken on lacked, are reported but
+// never fail. Baselines only compare runs on the same machine, thus none is
+// shipped: the machine running the gate writes its own with -u first.
+
+#include "chacha20.hpp"  // Including ChaCha20 header
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+const std::array<std::uint32_t, 8> KEY = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                          0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+const std::array<std::uint32_t, 3> NONCE = {0x00000000, 0x0000004a, 0x00000000};
+
+constexpr Chacha20Kernel KERNELS[] = {Chacha20Kernel::Scalar, Chacha20Kernel::SSE2, Chacha20Kernel::AVX2,
+                                      Chacha20Kernel::AVX512, Chacha20Kernel::NEON, Chacha20Kernel::SVE2};
+
+// Message sizes of encrypt(), from one call per packet to bulk data
+constexpr std::size_t SIZES[] = {1 << 10, 64 << 10, 1 << 20};
+
+// Packets of encrypt_batch(), as many short messages of different keys
+constexpr std::size_t BATCH_PACKETS = 256;
+constexpr std::size_t PACKET_SIZE = 64;
+
+// Each measurement takes the best of REPEATS runs of at least MIN_RUN_TIME,
+// the best run is the one least disturbed by the rest of the system
+constexpr int REPEATS = 7;
+constexpr std::chrono::milliseconds MIN_RUN_TIME(20);
+
+constexpr double DEFAULT_THRESHOLD = 0.1;
+
+// A measurement below the threshold is taken again up to CONFIRMATIONS times and
+// only fails if every one of them is, so a single stall of the machine does not
+constexpr int CONFIRMATIONS = 3;
+
+// Prints usage and returns the exit code for invalid arguments
+int usage(const char* program) {
+    std::fprintf(stderr, "usage: %s [-t threshold] [-u] <baseline>\n", program);
+    return 2;
+}
+
+// Runs operation, which processes bytes bytes per call, and returns the best throughput in GB/s
+template<typename Operation>
+double measure(std::size_t bytes, Operation operation) {
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+    for (int repeat = 0; repeat < REPEATS; ++repeat) {
+        std::size_t calls = 0;
+        const clock::time_point start = clock::now();
+        clock::duration elapsed;
+        do {
+            operation();
+            calls++;
+            elapsed = clock::now() - start;
+        } while (elapsed < MIN_RUN_TIME);
+        const double seconds = std::chrono::duration<double>(elapsed).count();
+        best = std::max(best, static_cast<double>(bytes) * static_cast<double>(calls) / seconds / 1e9);
+    }
+    return best;
+}
+
+// One measurement, run() again yields a fresh value of the same quantity
+struct Benchmark {
+    std::string name;
+    std::function<double()> run;
+};
+
+// Benchmarks of every supported kernel, names are "<kernel>/<operation>/<bytes>"
+std::vector<Benchmark> benchmarks() {
+    std::vector<Benchmark> result;
+    for (Chacha20Kernel kernel : KERNELS) {
+        if (!Chacha20::kernel_supported(kernel)) continue;
+        const std::string name = Chacha20::kernel_name(kernel);
+
+        for (std::size_t size : SIZES) {
+            result.push_back({name + "/encrypt/" + std::to_string(size), [kernel, size] {
+                std::vector<std::uint8_t> message(size, 0x5a);
+                Chacha20 cipher(KEY, 1, NONCE);
+                cipher.select_kernel(kernel);
+                // The block count runs out after 256 GiB, far beyond any run
+                return measure(size, [&] { cipher.encrypt(message.data(), message.data(), size); });
+            }});
+        }
+
+        result.push_back({name + "/batch/" + std::to_string(PACKET_SIZE), [kernel] {
+            std::vector<std::uint8_t> packets(BATCH_PACKETS * PACKET_SIZE, 0x5a);
+            std::vector<Chacha20::Job> jobs;
+            for (std::size_t i = 0; i < BATCH_PACKETS; ++i) {
+                std::array<std::uint32_t, 8> key = KEY;
+                key[0] = static_cast<std::uint32_t>(i);
+                jobs.push_back({key, 1, NONCE, packets.data() + PACKET_SIZE * i, packets.data() + PACKET_SIZE * i, PACKET_SIZE});
+            }
+            return measure(packets.size(), [&] { Chacha20::encrypt_batch(jobs, kernel); });
+        }});
+    }
+    return result;
+}
+
+// Reads "<name> <GB/s>" lines, returns false if the file cannot be opened
+bool read_baseline(const char* path, std::map<std::string, double>& baseline) {
+    std::FILE* file = std::fopen(path, "r");
+    if (file == nullptr) return false;
+    char name[128];
+    double gbps;
+    while (std::fscanf(file, "%127s %lf", name, &gbps) == 2) {
+        baseline[name] = gbps;
+    }
+    std::fclose(file);
+    return true;
+}
+
+// Writes the measurements in the format read by read_baseline()
+bool write_baseline(const char* path, const std::map<std::string, double>& results) {
+    std::FILE* file = std::fopen(path, "w");
+    if (file == nullptr) return false;
+    for (const auto& [name, gbps] : results) {
+        std::fprintf(file, "%s %.3f\n", name.c_str(), gbps);
+    }
+    return std::fclose(file) == 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    double threshold = DEFAULT_THRESHOLD;
+    bool update = false;
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+        if (std::strcmp(argv[arg], "-u") == 0) {
+            update = true;
+        } else if (std::strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            char* end;
+            threshold = std::strtod(argv[++arg], &end);
+            if (*end != '\0' || threshold < 0 || threshold >= 1) return usage(argv[0]);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (arg + 1 != argc) return usage(argv[0]);
+    const char* path = argv[arg];
+
+    const std::vector<Benchmark> all = benchmarks();
+
+    if (update) {
+        std::map<std::string, double> results;
+        for (const Benchmark& benchmark : all) {
+            results[benchmark.name] = benchmark.run();
+            std::printf("%-24s %8.3f GB/s\n", benchmark.name.c_str(), results[benchmark.name]);
+        }
+        if (!write_baseline(path, results)) {
+            std::perror(path);
+            return 1;
+        }
+        std::printf("baseline written to %s\n", path);
+        return 0;
+    }
+
+    std::map<std::string, double> baseline;
+    if (!read_baseline(path, baseline)) {
+        std::perror(path);
+        std::fprintf(stderr, "write a baseline on this machine first with %s -u %s\n", argv[0], path);
+        return 1;
+    }
+
+    int regressions = 0;
+    for (const Benchmark& benchmark : all) {
+        double gbps = benchmark.run();
+        const auto found = baseline.find(benchmark.name);
+        if (found == baseline.end()) {
+            std::printf("%-24s %8.3f GB/s   no baseline\n", benchmark.name.c_str(), gbps);
+            continue;
+        }
+        const double floor = found->second * (1 - threshold);
+        for (int i = 0; i < CONFIRMATIONS && gbps < floor; ++i) {
+            gbps = std::max(gbps, benchmark.run());
+        }
+        const bool regressed = gbps < floor;
+        regressions += regressed;
+        std::printf("%-24s %8.3f GB/s   baseline %8.3f   %+6.1f%%%s\n", benchmark.name.c_str(), gbps, found->second,
+                    100 * (gbps / found->second - 1), regressed ? "   REGRESSION" : "");
+    }
+
+    if (regressions > 0) {
+        std::printf("%d measurement(s) more than %.0f%% below baseline\n", regressions, 100 * threshold);
+        return 1;
+    }
+    std::printf("no measurement more than %.0f%% below baseline\n", 100 * threshold);
+    return 0;
+}
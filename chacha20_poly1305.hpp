@@ -0,0 +1,534 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_POLY1305__
+#define __CHACHA20_POLY1305__
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "chacha20.hpp"
+
+// Poly1305 one-time authenticator, designed accordingly to: https://datatracker.ietf.org/doc/html/rfc8439
+// Numbers modulo 2^130-5 are held as 5 limbs of 26 bits, long messages
+// are absorbed 4 blocks at a time by the AVX2 kernel where available
+class Poly1305 {
+
+    static constexpr unsigned int LIMBS = 5;
+    static constexpr unsigned int BLOCK_SIZE = 16;
+
+    // Messages of at least AVX2_MIN_BLOCKS blocks go through the AVX2 kernel
+    static constexpr std::size_t AVX2_MIN_BLOCKS = 8;
+
+public:
+    static constexpr unsigned int KEY_SIZE = 32;
+    static constexpr unsigned int TAG_SIZE = 16;
+
+    using tag_type = std::array<std::uint8_t, TAG_SIZE>;
+
+private:
+    // Clamped first half of the key, r^2, r^3 and r^4 follow for the AVX2 kernel
+    std::array<std::uint32_t, 4*LIMBS> powers;
+    // Second half of the key, added to the accumulator at the end
+    std::array<std::uint32_t, 4> pad;
+    // Accumulator
+    std::array<std::uint32_t, LIMBS> h;
+
+    // Bytes of an incomplete block left by update()
+    std::array<std::uint8_t, BLOCK_SIZE> buffer;
+    std::size_t buffer_len;
+
+    bool use_avx2;
+
+    /*------------------------------------------------
+    @param p 4 bytes ordered by little-endian
+    @return word made of the bytes
+    ------------------------------------------------*/
+    static inline std::uint32_t load32(const std::uint8_t* p) {
+        return static_cast<std::uint32_t>(p[0])       | (static_cast<std::uint32_t>(p[1]) << 8) |
+               (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+    }
+
+    /*------------------------------------------------
+    @param p buffer to hold 4 bytes ordered by little-endian
+    @param x word to be stored
+    ------------------------------------------------*/
+    static inline void store32(std::uint8_t* p, std::uint32_t x) {
+        p[0] = static_cast<std::uint8_t>(x);
+        p[1] = static_cast<std::uint8_t>(x >> 8);
+        p[2] = static_cast<std::uint8_t>(x >> 16);
+        p[3] = static_cast<std::uint8_t>(x >> 24);
+    }
+
+    /*------------------------------------------------
+    Multiplies a by r modulo 2^130-5. The result is
+    partially reduced, every limb fits in 26 bits
+    except for a small carry left in limb 1.
+
+    @param a number to be multiplied, overwritten with the result
+    @param r multiplier, limbs of at most 26 bits
+    ------------------------------------------------*/
+    static inline void multiply(std::uint32_t a[LIMBS], const std::uint32_t r[LIMBS]) {
+        // Limbs wrapping past 2^130 are multiplied by 5
+        const std::uint32_t s1 = r[1]*5, s2 = r[2]*5, s3 = r[3]*5, s4 = r[4]*5;
+
+        std::uint64_t d0 = static_cast<std::uint64_t>(a[0])*r[0] + static_cast<std::uint64_t>(a[1])*s4 +
+                           static_cast<std::uint64_t>(a[2])*s3   + static_cast<std::uint64_t>(a[3])*s2 +
+                           static_cast<std::uint64_t>(a[4])*s1;
+        std::uint64_t d1 = static_cast<std::uint64_t>(a[0])*r[1] + static_cast<std::uint64_t>(a[1])*r[0] +
+                           static_cast<std::uint64_t>(a[2])*s4   + static_cast<std::uint64_t>(a[3])*s3 +
+                           static_cast<std::uint64_t>(a[4])*s2;
+        std::uint64_t d2 = static_cast<std::uint64_t>(a[0])*r[2] + static_cast<std::uint64_t>(a[1])*r[1] +
+                           static_cast<std::uint64_t>(a[2])*r[0] + static_cast<std::uint64_t>(a[3])*s4 +
+                           static_cast<std::uint64_t>(a[4])*s3;
+        std::uint64_t d3 = static_cast<std::uint64_t>(a[0])*r[3] + static_cast<std::uint64_t>(a[1])*r[2] +
+                           static_cast<std::uint64_t>(a[2])*r[1] + static_cast<std::uint64_t>(a[3])*r[0] +
+                           static_cast<std::uint64_t>(a[4])*s4;
+        std::uint64_t d4 = static_cast<std::uint64_t>(a[0])*r[4] + static_cast<std::uint64_t>(a[1])*r[3] +
+                           static_cast<std::uint64_t>(a[2])*r[2] + static_cast<std::uint64_t>(a[3])*r[1] +
+                           static_cast<std::uint64_t>(a[4])*r[0];
+
+        std::uint32_t c;
+        c = static_cast<std::uint32_t>(d0 >> 26); a[0] = static_cast<std::uint32_t>(d0) & 0x3ffffff;
+        d1 += c; c = static_cast<std::uint32_t>(d1 >> 26); a[1] = static_cast<std::uint32_t>(d1) & 0x3ffffff;
+        d2 += c; c = static_cast<std::uint32_t>(d2 >> 26); a[2] = static_cast<std::uint32_t>(d2) & 0x3ffffff;
+        d3 += c; c = static_cast<std::uint32_t>(d3 >> 26); a[3] = static_cast<std::uint32_t>(d3) & 0x3ffffff;
+        d4 += c; c = static_cast<std::uint32_t>(d4 >> 26); a[4] = static_cast<std::uint32_t>(d4) & 0x3ffffff;
+        a[0] += c*5; c = a[0] >> 26; a[0] &= 0x3ffffff;
+        a[1] += c;
+    }
+
+    /*------------------------------------------------
+    Absorbs whole blocks one at a time, the accumulator
+    is added the block and multiplied by r.
+
+    @param m message
+    @param blocks number of whole 16 byte blocks in m
+    @param hibit 1<<24 to set the 2^128 bit of every block, 0 for a padded final block
+    ------------------------------------------------*/
+    void blocks_scalar(const std::uint8_t* m, std::size_t blocks, std::uint32_t hibit) {
+        for(size_t i = 0; i < blocks; i++, m += BLOCK_SIZE) {
+            h[0] += (load32(m + 0)     ) & 0x3ffffff;
+            h[1] += (load32(m + 3) >> 2) & 0x3ffffff;
+            h[2] += (load32(m + 6) >> 4) & 0x3ffffff;
+            h[3] += (load32(m + 9) >> 6) & 0x3ffffff;
+            h[4] += (load32(m + 12) >> 8) | hibit;
+            multiply(h.data(), powers.data());
+        }
+    }
+
+    /*------------------------------------------------
+    Absorbs whole blocks, long runs go through the AVX2
+    kernel and whatever it leaves is done one at a time.
+
+    @param m message
+    @param blocks number of whole 16 byte blocks in m
+    ------------------------------------------------*/
+    void blocks(const std::uint8_t* m, std::size_t blocks) {
+        size_t done = 0;
+#if defined(CHACHA20_X86)
+        if(use_avx2 && blocks >= AVX2_MIN_BLOCKS) {
+            done = chacha20_avx::poly1305_blocks_avx2(h.data(), powers.data(), m, blocks);
+        }
+#endif
+        blocks_scalar(m + BLOCK_SIZE*done, blocks - done, 1 << 24);
+    }
+
+    /*------------------------------------------------
+    Sets all bits of arr to 0 in a cryptographically safe way.
+
+    @param arr Array to be zeroed
+    ------------------------------------------------*/
+    template<typename T, size_t N>
+    static void secure_zero(std::array<T, N>& arr) {
+        volatile T* p = reinterpret_cast<volatile T*>(arr.data());
+        for (size_t i = 0; i < N; ++i) {
+            p[i] = 0;
+        }
+    }
+
+public:
+    /*------------------------------------------------
+    Sets up the authenticator with a one-time key,
+    a key must never be used for more than one message.
+    The first 16 bytes of the key are clamped into r,
+    the last 16 bytes are the pad s.
+
+    @param key 32 byte one-time key
+    @param kernel AVX2 and AVX512 use the AVX2 kernel when the cpu supports it
+    ------------------------------------------------*/
+    explicit Poly1305(const std::array<std::uint8_t, KEY_SIZE>& key, Chacha20Kernel kernel = Chacha20::best_kernel()):
+    h ( {}), buffer ( {}), buffer_len ( 0),
+    use_avx2 ( (kernel == Chacha20Kernel::AVX2 || kernel == Chacha20Kernel::AVX512) && Chacha20::kernel_supported(Chacha20Kernel::AVX2)) {
+        powers[0] = (load32(key.data() + 0)     ) & 0x3ffffff;
+        powers[1] = (load32(key.data() + 3) >> 2) & 0x3ffff03;
+        powers[2] = (load32(key.data() + 6) >> 4) & 0x3ffc0ff;
+        powers[3] = (load32(key.data() + 9) >> 6) & 0x3f03fff;
+        powers[4] = (load32(key.data() + 12) >> 8) & 0x00fffff;
+
+        // r^2, r^3, r^4 reduced to 26 bit limbs, so that the AVX2 kernel can multiply them
+        for(size_t k = 1; k < 4; k++) {
+            std::copy_n(powers.begin() + LIMBS*(k - 1), LIMBS, powers.begin() + LIMBS*k);
+            multiply(powers.data() + LIMBS*k, powers.data());
+            std::uint32_t* p = powers.data() + LIMBS*k;
+            p[2] += p[1] >> 26; p[1] &= 0x3ffffff;
+        }
+
+        for(size_t i = 0; i < 4; i++) {
+            pad[i] = load32(key.data() + 16 + 4*i);
+        }
+    }
+
+    /*------------------------------------------------
+    Upon destruction 0 all sensetive data
+    ------------------------------------------------*/
+    ~Poly1305() {
+        secure_zero(powers);
+        secure_zero(pad);
+        secure_zero(h);
+        secure_zero(buffer);
+    }
+
+    /*------------------------------------------------
+    Absorbs the next length bytes of the message,
+    the message may be fed in pieces of any size.
+
+    @param data next piece of the message
+    @param length number of bytes in data
+    ------------------------------------------------*/
+    void update(const std::uint8_t* data, std::size_t length) {
+        // Completing the buffered block first
+        if(buffer_len > 0) {
+            const size_t take = std::min<size_t>(BLOCK_SIZE - buffer_len, length);
+            std::memcpy(buffer.data() + buffer_len, data, take);
+            buffer_len += take;
+            data += take;
+            length -= take;
+            if(buffer_len < BLOCK_SIZE) return;
+            blocks(buffer.data(), 1);
+            buffer_len = 0;
+        }
+
+        const size_t whole = length / BLOCK_SIZE;
+        blocks(data, whole);
+
+        buffer_len = length - BLOCK_SIZE*whole;
+        std::copy_n(data + BLOCK_SIZE*whole, buffer_len, buffer.data());
+    }
+
+    /*------------------------------------------------
+    Absorbs the next piece of the message, see update().
+
+    @param data next piece of the message
+    ------------------------------------------------*/
+    void update(std::span<const std::uint8_t> data) {
+        update(data.data(), data.size());
+    }
+
+    /*------------------------------------------------
+    Absorbs zeros up to the next multiple of 16 bytes,
+    as the AEAD construction pads its inputs.
+    ------------------------------------------------*/
+    void pad16() {
+        if(buffer_len == 0) return;
+        std::fill(buffer.begin() + buffer_len, buffer.end(), 0);
+        blocks(buffer.data(), 1);
+        buffer_len = 0;
+    }
+
+    /*------------------------------------------------
+    Computes the tag of the message absorbed so far.
+    The authenticator must not be used afterwards.
+
+    @return 16 byte tag
+    ------------------------------------------------*/
+    tag_type finish() {
+        // Final partial block is padded with a single 1 followed by zeros
+        if(buffer_len > 0) {
+            buffer[buffer_len] = 1;
+            std::fill(buffer.begin() + buffer_len + 1, buffer.end(), 0);
+            blocks_scalar(buffer.data(), 1, 0);
+            buffer_len = 0;
+        }
+
+        // Fully carrying h
+        std::uint32_t c;
+        c = h[1] >> 26; h[1] &= 0x3ffffff;
+        h[2] += c; c = h[2] >> 26; h[2] &= 0x3ffffff;
+        h[3] += c; c = h[3] >> 26; h[3] &= 0x3ffffff;
+        h[4] += c; c = h[4] >> 26; h[4] &= 0x3ffffff;
+        h[0] += c*5; c = h[0] >> 26; h[0] &= 0x3ffffff;
+        h[1] += c;
+
+        // g = h + -p, taken instead of h when h >= p, selection is constant time
+        std::array<std::uint32_t, LIMBS> g;
+        g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= 0x3ffffff;
+        g[1] = h[1] + c; c = g[1] >> 26; g[1] &= 0x3ffffff;
+        g[2] = h[2] + c; c = g[2] >> 26; g[2] &= 0x3ffffff;
+        g[3] = h[3] + c; c = g[3] >> 26; g[3] &= 0x3ffffff;
+        g[4] = h[4] + c - (1 << 26);
+
+        const std::uint32_t mask = (g[4] >> 31) - 1;
+        for(size_t i = 0; i < LIMBS; i++) {
+            h[i] = (h[i] & ~mask) | (g[i] & mask);
+        }
+        secure_zero(g);
+
+        // h modulo 2^128 plus the pad
+        const std::uint32_t words[4] = {
+            h[0] | (h[1] << 26),
+            (h[1] >> 6) | (h[2] << 20),
+            (h[2] >> 12) | (h[3] << 14),
+            (h[3] >> 18) | (h[4] << 8)
+        };
+        tag_type tag;
+        std::uint64_t f = 0;
+        for(size_t i = 0; i < 4; i++) {
+            f = static_cast<std::uint64_t>(words[i]) + pad[i] + (f >> 32);
+            store32(tag.data() + 4*i, static_cast<std::uint32_t>(f));
+        }
+        return tag;
+    }
+
+    /*------------------------------------------------
+    Compares two tags in constant time.
+
+    @param a first tag
+    @param b second tag
+    @return true if the tags are equal
+    ------------------------------------------------*/
+    static bool verify(const tag_type& a, const tag_type& b) {
+        std::uint8_t diff = 0;
+        for(size_t i = 0; i < TAG_SIZE; i++) {
+            diff |= a[i] ^ b[i];
+        }
+        return diff == 0;
+    }
+};
+
+// ChaCha20-Poly1305 AEAD, designed accordingly to: https://datatracker.ietf.org/doc/html/rfc8439#section-2.8
+// The message is encrypted and authenticated CHUNK_SIZE bytes at a time,
+// so every chunk is authenticated while it is still in the L1 cache
+class Chacha20Poly1305 {
+
+    static constexpr unsigned int KEY_WORDS = 8;
+    static constexpr unsigned int NONCE_WORDS = 3;
+    static constexpr std::size_t CHUNK_SIZE = 4096;
+
+    // Block 0 keys the authenticator, the message has the remaining blocks of the 32bit block count
+    static constexpr std::uint64_t MAX_MESSAGE_SIZE = ((std::uint64_t(1) << 32) - 1) * 64;
+
+    std::array<std::uint32_t, KEY_WORDS> key;
+
+    // Kernel used by both the cipher and the authenticator
+    Chacha20Kernel kernel;
+
+    /*------------------------------------------------
+    Sets all bits of arr to 0 in a cryptographically safe way.
+
+    @param arr Array to be zeroed
+    ------------------------------------------------*/
+    template<typename T, size_t N>
+    static void secure_zero(std::array<T, N>& arr) {
+        volatile T* p = reinterpret_cast<volatile T*>(arr.data());
+        for (size_t i = 0; i < N; ++i) {
+            p[i] = 0;
+        }
+    }
+
+    /*------------------------------------------------
+    Derives the Poly1305 one-time key from the first 32
+    bytes of keystream block 0 and absorbs the padded
+    additional data. Afterwards cipher is positioned
+    at block 1, where the message starts.
+
+    @param cipher cipher keyed with key and the message nonce at block 0
+    @param aad additional data
+    @param aad_len number of bytes in aad
+    @return authenticator ready for the ciphertext
+    ------------------------------------------------*/
+    Poly1305 start(Chacha20& cipher, const std::uint8_t* aad, std::size_t aad_len) const {
+        std::array<std::uint8_t, Poly1305::KEY_SIZE> one_time_key = {};
+        cipher.encrypt(one_time_key.data(), one_time_key.data(), one_time_key.size());
+
+        Poly1305 mac(one_time_key, kernel);
+        secure_zero(one_time_key);
+
+        mac.update(aad, aad_len);
+        mac.pad16();
+        return mac;
+    }
+
+    /*------------------------------------------------
+    Pads the ciphertext, absorbs the lengths of the
+    additional data and of the ciphertext as 64-bit
+    little-endian numbers and computes the tag.
+
+    @param mac authenticator that absorbed the ciphertext
+    @param aad_len number of bytes of additional data
+    @param length number of bytes of ciphertext
+    @return 16 byte tag
+    ------------------------------------------------*/
+    static Poly1305::tag_type finish(Poly1305& mac, std::size_t aad_len, std::size_t length) {
+        mac.pad16();
+
+        std::array<std::uint8_t, 16> lengths;
+        for(size_t i = 0; i < 8; i++) {
+            lengths[i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(aad_len) >> (8*i));
+            lengths[8 + i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(length) >> (8*i));
+        }
+        mac.update(lengths.data(), lengths.size());
+        return mac.finish();
+    }
+
+public:
+    using tag_type = Poly1305::tag_type;
+
+    /*------------------------------------------------
+    Words within key are ordered the same way as for
+    Chacha20. A nonce is passed with every message and
+    must never be repeated for the same key.
+
+    key consists of 256bits (8*32)
+    ------------------------------------------------*/
+    explicit Chacha20Poly1305(const std::array<std::uint32_t, KEY_WORDS>& key):
+    key ( key), kernel ( Chacha20::best_kernel()) {
+    }
+
+    /*------------------------------------------------
+    Upon destruction 0 all sensetive data
+    ------------------------------------------------*/
+    ~Chacha20Poly1305() {
+        secure_zero(key);
+    }
+
+    /*------------------------------------------------
+    Overrides the kernel picked by best_kernel(), the
+    output is the same regardless of the kernel.
+
+    @param k kernel to be used by seal() and open()
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        if(!Chacha20::kernel_supported(k)) return false;
+        kernel = k;
+        return true;
+    }
+
+    /*------------------------------------------------
+    Encrypts length bytes of plaintext into ciphertext and
+    computes the tag over the additional data and the
+    ciphertext. plaintext and ciphertext may point to the
+    same buffer.
+
+    @param nonce 96-bit nonce, never to be repeated for the same key
+    @param aad additional data, authenticated but not encrypted
+    @param aad_len number of bytes in aad
+    @param plaintext message to be encrypted
+    @param ciphertext buffer of at least length bytes for the result
+    @param length number of bytes to process
+    @param tag receives the 16 byte tag
+    @return false if the message is longer than the block count allows, nothing is written then
+    ------------------------------------------------*/
+    bool seal(const std::array<std::uint32_t, NONCE_WORDS>& nonce, const std::uint8_t* aad, std::size_t aad_len,
+              const std::uint8_t* plaintext, std::uint8_t* ciphertext, std::size_t length, tag_type& tag) const {
+        if(static_cast<std::uint64_t>(length) > MAX_MESSAGE_SIZE) return false;
+
+        Chacha20 cipher(key, 0, nonce);
+        cipher.select_kernel(kernel);
+        Poly1305 mac = start(cipher, aad, aad_len);
+
+        for(size_t i = 0; i < length; i += CHUNK_SIZE) {
+            const size_t chunk = std::min(CHUNK_SIZE, length - i);
+            cipher.update(plaintext + i, ciphertext + i, chunk);
+            mac.update(ciphertext + i, chunk);
+        }
+        tag = finish(mac, aad_len, length);
+        return true;
+    }
+
+    /*------------------------------------------------
+    Encrypts plaintext into a caller provided buffer, see
+    seal(). Only the first plaintext.size() bytes of
+    ciphertext are written, if ciphertext is shorter
+    only ciphertext.size() bytes are processed.
+
+    @param nonce 96-bit nonce, never to be repeated for the same key
+    @param aad additional data, authenticated but not encrypted
+    @param plaintext message to be encrypted
+    @param ciphertext buffer for the result
+    @param tag receives the 16 byte tag
+    @return false if the message is longer than the block count allows, nothing is written then
+    ------------------------------------------------*/
+    bool seal(const std::array<std::uint32_t, NONCE_WORDS>& nonce, std::span<const std::uint8_t> aad,
+              std::span<const std::uint8_t> plaintext, std::span<std::uint8_t> ciphertext, tag_type& tag) const {
+        return seal(nonce, aad.data(), aad.size(), plaintext.data(), ciphertext.data(), std::min(plaintext.size(), ciphertext.size()), tag);
+    }
+
+    /*------------------------------------------------
+    Verifies the tag and decrypts length bytes of ciphertext
+    into plaintext. Each chunk is authenticated right before
+    it is decrypted. If the tag does not match, plaintext is
+    zeroed so that no unauthenticated data is released.
+    ciphertext and plaintext may point to the same buffer.
+
+    @param nonce 96-bit nonce the message was sealed with
+    @param aad additional data
+    @param aad_len number of bytes in aad
+    @param ciphertext message to be decrypted
+    @param plaintext buffer of at least length bytes for the result
+    @param length number of bytes to process
+    @param tag tag computed by seal()
+    @return true if the message is authentic, false as well if it is longer than seal() accepts
+    ------------------------------------------------*/
+    bool open(const std::array<std::uint32_t, NONCE_WORDS>& nonce, const std::uint8_t* aad, std::size_t aad_len,
+              const std::uint8_t* ciphertext, std::uint8_t* plaintext, std::size_t length, const tag_type& tag) const {
+        if(static_cast<std::uint64_t>(length) > MAX_MESSAGE_SIZE) return false;
+
+        Chacha20 cipher(key, 0, nonce);
+        cipher.select_kernel(kernel);
+        Poly1305 mac = start(cipher, aad, aad_len);
+
+        for(size_t i = 0; i < length; i += CHUNK_SIZE) {
+            const size_t chunk = std::min(CHUNK_SIZE, length - i);
+            mac.update(ciphertext + i, chunk);
+            cipher.update(ciphertext + i, plaintext + i, chunk);
+        }
+
+        if(!Poly1305::verify(finish(mac, aad_len, length), tag)) {
+            volatile std::uint8_t* p = plaintext;
+            for(size_t i = 0; i < length; i++) {
+                p[i] = 0;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    /*------------------------------------------------
+    Verifies and decrypts ciphertext into a caller provided
+    buffer, see open(). Only the first ciphertext.size()
+    bytes of plaintext are written, if plaintext is shorter
+    only plaintext.size() bytes are processed.
+
+    @param nonce 96-bit nonce the message was sealed with
+    @param aad additional data
+    @param ciphertext message to be decrypted
+    @param plaintext buffer for the result
+    @param tag tag computed by seal()
+    @return true if the message is authentic
+    ------------------------------------------------*/
+    bool open(const std::array<std::uint32_t, NONCE_WORDS>& nonce, std::span<const std::uint8_t> aad,
+              std::span<const std::uint8_t> ciphertext, std::span<std::uint8_t> plaintext, const tag_type& tag) const {
+        return open(nonce, aad.data(), aad.size(), ciphertext.data(), plaintext.data(), std::min(ciphertext.size(), plaintext.size()), tag);
+    }
+};
+
+#endif /* #ifndef __CHACHA20_POLY1305__ */
@@ -0,0 +1,177 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_RNG__
+#define __CHACHA20_RNG__
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <span>
+
+#include "chacha20.hpp"
+
+// Cryptographically secure pseudo random number generator, the output is the
+// keystream of ChaCha20 with a 64-bit block count under the seed as key and
+// the stream number as nonce.
+// Models UniformRandomBitGenerator, thus it works with <random> distributions
+class ChaChaRng {
+
+    static constexpr unsigned int KEY_WORDS = 8;
+
+    // Keystream buffered for operator(), several outputs of the widest kernel
+    static constexpr std::size_t BUFFER_SIZE = 4096;
+
+    // 64-bit block count, the keystream of a stream never runs out
+    Chacha20Djb cipher;
+
+    std::array<std::uint8_t, BUFFER_SIZE> buffer;
+    std::size_t buffer_pos;
+
+    /*------------------------------------------------
+    @param stream_id stream number
+    @return nonce of the stream
+    ------------------------------------------------*/
+    static std::array<std::uint32_t, 2> nonce(std::uint64_t stream_id) {
+        return {static_cast<std::uint32_t>(stream_id >> 32), static_cast<std::uint32_t>(stream_id)};
+    }
+
+    /*------------------------------------------------
+    Takes the next length bytes of keystream from the cipher.
+
+    @param output buffer of at least length bytes
+    @param length number of bytes to write
+    ------------------------------------------------*/
+    void generate(std::uint8_t* output, std::size_t length) {
+        cipher.generate(output, length);
+    }
+
+    /*------------------------------------------------
+    Refills the buffer with the next BUFFER_SIZE bytes.
+    ------------------------------------------------*/
+    void refill() {
+        generate(buffer.data(), buffer.size());
+        buffer_pos = 0;
+    }
+
+public:
+    using result_type = std::uint64_t;
+
+    /*------------------------------------------------
+    Seeds the generator with a 256-bit key, words are
+    ordered the same way as for Chacha20. Generators with
+    the same seed and stream produce the same output,
+    different streams of one seed are independent.
+
+    @param seed 256-bit key
+    @param stream_id number of the stream
+    ------------------------------------------------*/
+    explicit ChaChaRng(const std::array<std::uint32_t, KEY_WORDS>& seed, std::uint64_t stream_id = 0):
+    cipher ( seed, 0, nonce(stream_id)), buffer ( {}), buffer_pos ( BUFFER_SIZE) {
+    }
+
+    /*------------------------------------------------
+    Seeds the generator with a 64-bit number, for
+    reproducible runs rather than secrecy.
+
+    @param seed seed taken as the first two key words, the rest is 0
+    @param stream_id number of the stream
+    ------------------------------------------------*/
+    explicit ChaChaRng(std::uint64_t seed, std::uint64_t stream_id = 0):
+    ChaChaRng(std::array<std::uint32_t, KEY_WORDS>{static_cast<std::uint32_t>(seed >> 32), static_cast<std::uint32_t>(seed)}, stream_id) {
+    }
+
+    /*------------------------------------------------
+    Upon destruction 0 all sensetive data
+    ------------------------------------------------*/
+    ~ChaChaRng() {
+        volatile std::uint8_t* p = buffer.data();
+        for(std::size_t i = 0; i < BUFFER_SIZE; i++) {
+            p[i] = 0;
+        }
+    }
+
+    /*------------------------------------------------
+    Generator of the calling thread, seeded once from
+    std::random_device upon the first call on every thread.
+    Its output is neither reproducible nor shared between threads.
+
+    @return generator of the calling thread
+    ------------------------------------------------*/
+    static ChaChaRng& thread_local_instance() {
+        thread_local ChaChaRng rng = [] {
+            std::random_device device;
+            std::array<std::uint32_t, KEY_WORDS> seed;
+            for(std::uint32_t& word : seed) {
+                word = device();
+            }
+            return ChaChaRng(seed);
+        }();
+        return rng;
+    }
+
+    /*------------------------------------------------
+    Selects the kernel computing keystream, the output
+    is the same regardless of the kernel.
+
+    @param k kernel to be used
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        return cipher.select_kernel(k);
+    }
+
+    static constexpr result_type min() {
+        return std::numeric_limits<result_type>::min();
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    /*------------------------------------------------
+    @return next 8 bytes of keystream as a number in native byte order
+    ------------------------------------------------*/
+    result_type operator()() {
+        // A tail shorter than 8 bytes, left by fill(), is skipped
+        if(BUFFER_SIZE - buffer_pos < sizeof(result_type)) refill();
+        result_type result;
+        std::memcpy(&result, buffer.data() + buffer_pos, sizeof(result_type));
+        buffer_pos += sizeof(result_type);
+        return result;
+    }
+
+    /*------------------------------------------------
+    Fills output with the next bytes of keystream.
+    Buffered keystream is used first, the rest is written
+    straight into output without going through the buffer.
+
+    @param output buffer to be filled with random bytes
+    ------------------------------------------------*/
+    void fill(std::span<std::uint8_t> output) {
+        // An empty span may have no data to copy to
+        if(output.empty()) return;
+        const std::size_t buffered = std::min(BUFFER_SIZE - buffer_pos, output.size());
+        std::memcpy(output.data(), buffer.data() + buffer_pos, buffered);
+        buffer_pos += buffered;
+        generate(output.data() + buffered, output.size() - buffered);
+    }
+
+    /*------------------------------------------------
+    Fills output with the next bytes of keystream, see fill().
+
+    @param output buffer to be filled with random bytes
+    ------------------------------------------------*/
+    void fill(std::span<std::byte> output) {
+        fill(std::span<std::uint8_t>(reinterpret_cast<std::uint8_t*>(output.data()), output.size()));
+    }
+};
+
+#endif /* #ifndef __CHACHA20_RNG__ */
@@ -0,0 +1,247 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_SESSION__
+#define __CHACHA20_SESSION__
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "chacha20.hpp"
+
+// Keys, nonces and block counts of many sessions, each with its own key, kept
+// by word rather than by session: word r of every session lies in one row of
+// contiguous memory. A session takes 48 bytes instead of a whole Chacha object,
+// and the kernels load a word of 16 sessions with a single load, so one kernel
+// pass computes a block for every session of a group at full vector width.
+// Sessions are numbered 0 to capacity() - 1 by the caller, e.g. by connection slot.
+template<unsigned DOUBLE_ROUNDS>
+class ChachaSessionTable {
+
+    using Cipher = Chacha<DOUBLE_ROUNDS>;
+
+    static constexpr unsigned int KEY_WORDS = 8;
+    static constexpr unsigned int NONCE_WORDS = 3;
+    static constexpr unsigned int BLOCK_SIZE = 64;
+
+    // Words 4-15 of the state are stored, words 0-3 are the constants
+    static constexpr unsigned int ROWS = 12;
+    static constexpr unsigned int KEY_ROW = 0;
+    static constexpr unsigned int COUNTER_ROW = 8;
+    static constexpr unsigned int NONCE_ROW = 9;
+
+    // Sessions are processed in groups as wide as the widest kernel
+    static constexpr std::size_t GROUP_SIZE = 16;
+
+    std::size_t sessions;
+
+    // Distance between rows in words, sessions rounded up to a whole group
+    std::size_t stride;
+
+    // Word 4+r of the state of session s is rows[stride*r + s], kept in state (little-endian) notation.
+    // The buffer pool scrubs the rows once they are freed
+    std::vector<std::uint32_t, Chacha20AlignedAllocator<std::uint32_t>> rows;
+
+    // Set for a session whose block count wrapped around past block 2^32 - 1, as Chacha::exhausted.
+    // Such a session refuses every message until reset() or open()
+    std::vector<std::uint8_t> exhausted;
+
+    // Kernel used by encrypt(), best_kernel() unless selected otherwise
+    Chacha20Kernel kernel;
+
+    /*------------------------------------------------
+    @param row word of the state minus 4
+    @param session number of the session
+    @return word row of the session
+    ------------------------------------------------*/
+    std::uint32_t& word(std::size_t row, std::size_t session) {
+        return rows[stride*row + session];
+    }
+
+public:
+    // Message of one session for encrypt(), input and output may be the same buffer
+    struct Message {
+        const std::uint8_t* input;
+        std::uint8_t* output;
+        std::size_t length;
+    };
+
+    /*------------------------------------------------
+    Creates a table of capacity sessions, all of them
+    start with a zero key, nonce and block count.
+
+    @param capacity number of sessions
+    ------------------------------------------------*/
+    explicit ChachaSessionTable(std::size_t capacity):
+    sessions ( capacity), stride ( (capacity + GROUP_SIZE - 1) / GROUP_SIZE * GROUP_SIZE), rows ( ROWS*stride, 0), exhausted ( capacity, 0),
+    kernel ( Cipher::best_kernel()) {
+    }
+
+    /*------------------------------------------------
+    @return number of sessions
+    ------------------------------------------------*/
+    std::size_t capacity() const {
+        return sessions;
+    }
+
+    /*------------------------------------------------
+    Starts a session with a new key. Key and nonce are
+    ordered the same way as for the Chacha constructor.
+
+    @param session number of the session, less than capacity()
+    @param key 256-bit key
+    @param block_count block count of the first block
+    @param nonce 96-bit nonce
+    ------------------------------------------------*/
+    void open(std::size_t session, const std::array<std::uint32_t, KEY_WORDS>& key, std::uint32_t block_count,
+              const std::array<std::uint32_t, NONCE_WORDS>& nonce) {
+        for(size_t i = 0; i < KEY_WORDS; i++) {
+            word(KEY_ROW + i, session) = Cipher::little_endian(key[i]);
+        }
+        reset(session, nonce, block_count);
+    }
+
+    /*------------------------------------------------
+    Starts a new message of a session with the same key,
+    as Chacha::reset() does, only 4 words are written.
+
+    @param session number of the session, less than capacity()
+    @param nonce nonce of the new message, must not be repeated for the same key
+    @param block_count block count the new message starts at
+    ------------------------------------------------*/
+    void reset(std::size_t session, const std::array<std::uint32_t, NONCE_WORDS>& nonce, std::uint32_t block_count) {
+        word(COUNTER_ROW, session) = block_count;
+        exhausted[session] = 0;
+        for(size_t i = 0; i < NONCE_WORDS; i++) {
+            word(NONCE_ROW + i, session) = Cipher::little_endian(nonce[i]);
+        }
+    }
+
+    /*------------------------------------------------
+    Ends a session, its key, nonce and block count are
+    set to 0.
+
+    @param session number of the session, less than capacity()
+    ------------------------------------------------*/
+    void close(std::size_t session) {
+        for(size_t r = 0; r < ROWS; r++) {
+            volatile std::uint32_t* p = &word(r, session);
+            *p = 0;
+        }
+        exhausted[session] = 0;
+    }
+
+    /*------------------------------------------------
+    @param session number of the session, less than capacity()
+    @return block count the next message of the session starts at
+    ------------------------------------------------*/
+    std::uint32_t block_count(std::size_t session) const {
+        return rows[stride*COUNTER_ROW + session];
+    }
+
+    /*------------------------------------------------
+    Selects the kernel used by encrypt(), the output is
+    the same regardless of the kernel.
+
+    @param k kernel to be used
+    @return false if k is not supported, the kernel is then left unchanged
+    ------------------------------------------------*/
+    bool select_kernel(Chacha20Kernel k) {
+        if(!Cipher::kernel_supported(k)) return false;
+        kernel = k;
+        return true;
+    }
+
+    /*------------------------------------------------
+    Encrypts/decrypts one message for each of the sessions
+    first to first + messages.size() - 1, messages[j]
+    belongs to session first + j. Every message starts on
+    a fresh block like Chacha::encrypt(), afterwards the
+    block count of its session is advanced past it.
+    Sessions are taken a group of 16 at a time, every
+    kernel pass computes one block for each session of the
+    group, as many passes as the longest message of the
+    group needs. Groups without a message cost nothing,
+    thus idle sessions may be passed with length 0.
+    Messages of similar length make the best use of it.
+
+    @param first number of the session of messages[0]
+    @param messages one message per session, length 0 for none
+    @return false if the sessions lie past capacity(), nothing is processed then,
+            or if any message does not fit before the block count of its session wraps around
+            or the session already ran up to block 2^32 - 1 and the message is not empty,
+            it is then left untouched together with its block count
+    ------------------------------------------------*/
+    bool encrypt(std::size_t first, std::span<const Message> messages) {
+        if(first > sessions || messages.size() > sessions - first) return false;
+
+        const typename Cipher::columns_function columns_fn = Cipher::get_columns_function(kernel);
+        std::array<std::uint8_t, BLOCK_SIZE*GROUP_SIZE> stream;
+        std::array<std::uint32_t, GROUP_SIZE> blocks;
+        std::array<std::uint32_t, GROUP_SIZE> counters;
+
+        bool all = true;
+        for(size_t group = 0; group < messages.size(); group += GROUP_SIZE) {
+            const size_t count = std::min(GROUP_SIZE, messages.size() - group);
+            std::uint32_t* counter_row = &word(COUNTER_ROW, first + group);
+
+            std::uint32_t passes = 0;
+            for(size_t j = 0; j < count; j++) {
+                const std::uint64_t needed = (static_cast<std::uint64_t>(messages[group + j].length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                // An exhausted session still takes empty messages, as Chacha::encrypt() does
+                const bool fits = exhausted[first + group + j] ? needed == 0 : needed <= (std::uint64_t(1) << 32) - counter_row[j];
+                all = all && fits;
+                blocks[j] = fits ? static_cast<std::uint32_t>(needed) : 0;
+                counters[j] = counter_row[j];
+                passes = std::max(passes, blocks[j]);
+            }
+
+            // Pass p computes block p of every message, the block counts are advanced in place
+            for(std::uint32_t p = 0; p < passes; p++) {
+                const size_t done = columns_fn(&word(0, first + group), stride, stream.data(), count);
+                Cipher::keystream_columns_scalar(&word(0, first + group + done), stride, stream.data() + BLOCK_SIZE*done, count - done);
+                for(size_t j = 0; j < count; j++) {
+                    if(blocks[j] > p) {
+                        const Message& message = messages[group + j];
+                        const size_t pos = BLOCK_SIZE*p;
+                        Cipher::xor_bytes(message.input + pos, stream.data() + BLOCK_SIZE*j, message.output + pos,
+                                          std::min<size_t>(BLOCK_SIZE, message.length - pos));
+                    }
+                    counter_row[j]++;
+                }
+            }
+
+            // A message ending at block 2^32 - 1 leaves the block count at 0, which must not be used again
+            for(size_t j = 0; j < count; j++) {
+                counter_row[j] = counters[j] + blocks[j];
+                if(blocks[j] > 0 && counter_row[j] == 0) exhausted[first + group + j] = 1;
+            }
+        }
+
+        Cipher::secure_zero(stream);
+        return all;
+    }
+
+    /*------------------------------------------------
+    Encrypts/decrypts one message for each of the sessions
+    0 to messages.size() - 1, see encrypt(first, messages).
+
+    @param messages one message per session, length 0 for none
+    @return false if any message is left untouched
+    ------------------------------------------------*/
+    bool encrypt(std::span<const Message> messages) {
+        return encrypt(0, messages);
+    }
+};
+
+// Session table of ChaCha20 as specified in RFC 8439
+using Chacha20SessionTable = ChachaSessionTable<10>;
+
+#endif /* #ifndef __CHACHA20_SESSION__ */
@@ -0,0 +1,154 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_THREAD_POOL__
+#define __CHACHA20_THREAD_POOL__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads used for parallel encryption
+class Chacha20ThreadPool {
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping;
+
+    /*------------------------------------------------
+    Main loop of a worker thread, runs queued tasks
+    until the pool is destroyed.
+    ------------------------------------------------*/
+    void work() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this] { return stopping || !queue.empty(); });
+                if(stopping && queue.empty()) return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    /*------------------------------------------------
+    Starts the worker threads.
+
+    @param threads number of workers, 0 means one per hardware thread
+    ------------------------------------------------*/
+    explicit Chacha20ThreadPool(unsigned threads = 0): stopping ( false) {
+        if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        workers.reserve(threads);
+        for(unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    Chacha20ThreadPool(const Chacha20ThreadPool&) = delete;
+    Chacha20ThreadPool& operator=(const Chacha20ThreadPool&) = delete;
+
+    /*------------------------------------------------
+    Finishes all queued tasks and joins the workers.
+    ------------------------------------------------*/
+    ~Chacha20ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for(std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /*------------------------------------------------
+    Pool shared by the whole process, one worker per
+    hardware thread. Created upon the first call.
+
+    @return shared pool
+    ------------------------------------------------*/
+    static Chacha20ThreadPool& shared() {
+        static Chacha20ThreadPool pool;
+        return pool;
+    }
+
+    /*------------------------------------------------
+    @return number of worker threads
+    ------------------------------------------------*/
+    std::size_t size() const {
+        return workers.size();
+    }
+
+    /*------------------------------------------------
+    Queues a task to be run by one of the workers.
+
+    @param task function to be run
+    ------------------------------------------------*/
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(task));
+        }
+        available.notify_one();
+    }
+
+    /*------------------------------------------------
+    Calls task(i) for every i in [0, tasks) and returns once
+    all calls are finished. Workers and the calling thread
+    take the next index from a shared counter, so fast
+    threads take over the work of slow ones. Since the
+    caller takes part as well, it is safe to call from
+    within a worker of the same pool.
+
+    @param tasks number of tasks
+    @param task function to be called with the index of every task
+    ------------------------------------------------*/
+    template<typename F>
+    void parallel_for(std::size_t tasks, F&& task) {
+        // Shared between the caller and helpers that may start after the caller returned
+        struct Progress {
+            std::atomic<std::size_t> next{0};
+            std::atomic<std::size_t> finished{0};
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+        auto progress = std::make_shared<Progress>();
+
+        // task is only called while the caller still waits, thus referencing it is safe
+        auto drain = [progress, tasks, &task] {
+            for(std::size_t i; (i = progress->next.fetch_add(1)) < tasks; ) {
+                task(i);
+                if(progress->finished.fetch_add(1) + 1 == tasks) {
+                    std::lock_guard<std::mutex> lock(progress->mutex);
+                    progress->done.notify_all();
+                }
+            }
+        };
+
+        const std::size_t helpers = std::min(workers.size(), tasks > 0 ? tasks - 1 : 0);
+        for(std::size_t i = 0; i < helpers; i++) {
+            submit(drain);
+        }
+        drain();
+
+        std::unique_lock<std::mutex> lock(progress->mutex);
+        progress->done.wait(lock, [&] { return progress->finished.load() == tasks; });
+    }
+};
+
+#endif /* #ifndef __CHACHA20_THREAD_POOL__ */
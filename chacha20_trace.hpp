@@ -0,0 +1,103 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef __CHACHA20_TRACE__
+#define __CHACHA20_TRACE__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Optional instrumentation of the Chacha20 front end in chacha20.hpp.
+// Nothing is compiled into Chacha unless CHACHA20_TRACE is defined before
+// chacha20.hpp is included. With CHACHA20_USDT defined as well and
+// <sys/sdt.h> available, every encrypt(), update() and generate() call is
+// surrounded by the USDT probes chacha20:process_start and chacha20:process_done,
+// which perf, bpftrace and SystemTap attach to without rebuilding.
+#if defined(CHACHA20_TRACE) && defined(CHACHA20_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHACHA20_PROBES
+#endif
+#endif
+
+enum class Chacha20Kernel;
+
+// Counters of a single Chacha object, every call that processes data is counted once
+struct Chacha20Stats {
+
+    // Calls are bucketed by length: <64, <256, <1Ki, <4Ki, <16Ki, <64Ki, <1Mi and larger
+    static constexpr std::size_t SIZE_BUCKETS = 8;
+    static constexpr std::size_t KERNELS = 6;
+
+    std::uint64_t bytes = 0;
+    std::uint64_t blocks = 0;
+    std::array<std::uint64_t, SIZE_BUCKETS> calls_by_size = {};
+    std::array<std::uint64_t, KERNELS> calls_by_kernel = {};
+
+    /*------------------------------------------------
+    @param length number of bytes passed to a call
+    @return index into calls_by_size
+    ------------------------------------------------*/
+    static std::size_t size_bucket(std::size_t length) {
+        std::size_t bucket = 0;
+        for(std::size_t limit = 64; bucket < SIZE_BUCKETS - 1 && length >= limit; bucket++) {
+            limit *= (bucket < 5) ? 4 : 16;
+        }
+        return bucket;
+    }
+};
+
+// Callbacks around every encrypt(), update() and generate() call. ctx is passed
+// through unchanged, thus one set of functions can attribute calls to tenants
+struct Chacha20TraceHooks {
+    void (*begin)(void* ctx, std::size_t length, Chacha20Kernel kernel) = nullptr;
+    void (*end)(void* ctx, std::size_t length, Chacha20Kernel kernel) = nullptr;
+    void* ctx = nullptr;
+};
+
+// Counts a call and brackets it with the hooks and probes for as long as it lives
+class Chacha20TraceScope {
+
+    const Chacha20TraceHooks& hooks;
+    std::size_t length;
+    Chacha20Kernel kernel;
+
+public:
+    /*------------------------------------------------
+    @param hooks callbacks of the object, begin is called right away
+    @param stats counters of the object
+    @param length number of bytes of the call
+    @param blocks number of keystream blocks the call generates
+    @param kernel kernel selected for the call
+    ------------------------------------------------*/
+    Chacha20TraceScope(const Chacha20TraceHooks& hooks, Chacha20Stats& stats, std::size_t length, std::uint64_t blocks, Chacha20Kernel kernel):
+    hooks ( hooks), length ( length), kernel ( kernel) {
+        stats.bytes += length;
+        stats.blocks += blocks;
+        stats.calls_by_size[Chacha20Stats::size_bucket(length)]++;
+        stats.calls_by_kernel[static_cast<std::size_t>(kernel)]++;
+#if defined(CHACHA20_PROBES)
+        DTRACE_PROBE3(chacha20, process_start, hooks.ctx, length, static_cast<int>(kernel));
+#endif
+        if(hooks.begin) hooks.begin(hooks.ctx, length, kernel);
+    }
+
+    /*------------------------------------------------
+    Calls the end hook once the call has finished.
+    ------------------------------------------------*/
+    ~Chacha20TraceScope() {
+        if(hooks.end) hooks.end(hooks.ctx, length, kernel);
+#if defined(CHACHA20_PROBES)
+        DTRACE_PROBE2(chacha20, process_done, hooks.ctx, length);
+#endif
+    }
+
+    Chacha20TraceScope(const Chacha20TraceScope&) = delete;
+    Chacha20TraceScope& operator=(const Chacha20TraceScope&) = delete;
+};
+
+#endif /* #ifndef __CHACHA20_TRACE__ */
@@ -1,15 +1,31 @@
-//#include "chacha20_AVX.hpp"
 #include "chacha20.hpp"  // Including ChaCha20 header
+#include "chacha20_ahead.hpp"
+#include "chacha20_async.hpp"
+#include "chacha20_container.hpp"
+#if defined(__CUDACC__)
+#include "chacha20_cuda.cuh"
+#endif
+#include "chacha20_poly1305.hpp"
+#include "chacha20_rng.hpp"
+#include "chacha20_session.hpp"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <initializer_list>
 #include <iomanip>
 #include <iostream>
+#include <random>
+#include <span>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace util {
@@ -54,28 +70,9 @@ std::vector<std::uint8_t> str_to_vec(const std::string& str) {
 
 } // namespace util
 
-// Benchmark the encryption process
-void benchmark_encryption(Chacha20& cipher, const std::vector<std::uint8_t>& msg_vec, int iterations) {
-    auto start = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < iterations; ++i) {
-        // Perform encryption but avoid unused variable warning
-        std::vector<std::uint8_t> encrypted_msg = cipher.encrypt(msg_vec);
-        (void)encrypted_msg;
-    }
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
-
-    double total_ms = elapsed.count() * 1000.0;
-    double per_run_ms = total_ms / iterations;
-
-    std::cout << "Benchmark (" << iterations << " runs): "
-              << total_ms << " ms total, "
-              << per_run_ms << " ms per run\n";
-}
-
 // Runs a single test case
-bool run_test_case(const std::string& key, const std::string& block_count, const std::string& nonce,
-                   const std::string& message, const std::string& expected_result, int iterations) {
+bool run_test_case(Chacha20Kernel kernel, const std::string& key, const std::string& block_count, const std::string& nonce,
+                   const std::string& message, const std::string& expected_result) {
     std::array<std::uint32_t, 8> key_arr;
     std::copy_n(util::hex_str_to_vec(key).begin(), 8, key_arr.begin());
 
@@ -87,11 +84,23 @@ bool run_test_case(const std::string& key, const std::string& block_count, const
     std::vector<std::uint8_t> msg_vec = util::str_to_vec(msg);
 
     Chacha20 cipher(key_arr, block_v, nonce_arr);
+    cipher.select_kernel(kernel);
 
     std::vector<std::uint8_t> encrypted = cipher.encrypt(msg_vec);
     std::string result_hex = util::vec_to_hex(encrypted);
 
-    bool passed = (result_hex == expected_result);
+    // Caller-buffer and in-place overloads must match the vector overload
+    Chacha20 buffer_cipher(key_arr, block_v, nonce_arr);
+    buffer_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> buffer_out(msg_vec.size());
+    buffer_cipher.encrypt(std::span<const std::uint8_t>(msg_vec), std::span<std::uint8_t>(buffer_out));
+
+    Chacha20 in_place_cipher(key_arr, block_v, nonce_arr);
+    in_place_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> in_place = msg_vec;
+    in_place_cipher.encrypt(std::span<std::uint8_t>(in_place));
+
+    bool passed = (result_hex == expected_result) && (buffer_out == encrypted) && (in_place == encrypted);
 
     std::cout << "Test " << (passed ? "PASSED" : "FAILED") << "\n";
     if (!passed) {
@@ -99,16 +108,1151 @@ bool run_test_case(const std::string& key, const std::string& block_count, const
         std::cout << "Got     : " << result_hex << "\n";
     }
 
-    // Only benchmark if the test passed
-    if (passed) {
-        benchmark_encryption(cipher, msg_vec, iterations);
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Encrypting a long message at once must match encrypting it in 128 byte chunks,
+// this exercises the multi-block kernels against the short message path
+bool run_chunk_test(Chacha20Kernel kernel, std::size_t length) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    std::vector<std::uint8_t> msg_vec(length);
+    for (std::size_t i = 0; i < length; ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 31 + 7);
+    }
+
+    Chacha20 whole_cipher(key_arr, 1, nonce_arr);
+    whole_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> whole = whole_cipher.encrypt(msg_vec);
+
+    Chacha20 chunk_cipher(key_arr, 1, nonce_arr);
+    chunk_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> chunked(length);
+    for (std::size_t i = 0; i < length; i += 128) {
+        std::size_t chunk = std::min<std::size_t>(128, length - i);
+        chunk_cipher.encrypt(msg_vec.data() + i, chunked.data() + i, chunk);
+    }
+
+    bool passed = (whole == chunked);
+    std::cout << "Chunk test (" << length << " bytes) " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Every kernel must produce the same output as the scalar one for any length
+bool run_kernel_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x1c9240a5, 0xeb55d38a, 0xf3338886, 0x04f6b5f0,
+                                            0x473917c1, 0x402b8009, 0x9dca5cbc, 0x207075c0};
+    std::array<std::uint32_t, 3> nonce_arr = {0x01020304, 0x05060708, 0x090a0b0c};
+
+    bool passed = true;
+    for (std::size_t length = 0; length < 2200 && passed; length += 13) {
+        std::vector<std::uint8_t> msg_vec(length);
+        for (std::size_t i = 0; i < length; ++i) {
+            msg_vec[i] = static_cast<std::uint8_t>(i * 7 + length);
+        }
+
+        Chacha20 scalar_cipher(key_arr, static_cast<std::uint32_t>(length), nonce_arr);
+        scalar_cipher.select_kernel(Chacha20Kernel::Scalar);
+        Chacha20 kernel_cipher(key_arr, static_cast<std::uint32_t>(length), nonce_arr);
+        kernel_cipher.select_kernel(kernel);
+
+        // Two calls in a row also check that block_count is advanced consistently
+        for (int call = 0; call < 2; ++call) {
+            passed = passed && (scalar_cipher.encrypt(msg_vec) == kernel_cipher.encrypt(msg_vec));
+        }
+    }
+
+    std::cout << "Kernel test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Decrypting any range of a message with encrypt_at must match the same range of the whole message
+bool run_seek_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    std::vector<std::uint8_t> msg_vec(3000);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 13 + 5);
+    }
+
+    Chacha20 whole_cipher(key_arr, 7, nonce_arr);
+    whole_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> whole = whole_cipher.encrypt(msg_vec);
+
+    Chacha20 seek_cipher(key_arr, 7, nonce_arr);
+    seek_cipher.select_kernel(kernel);
+
+    bool passed = true;
+    for (std::size_t offset : {2047, 0, 1, 63, 64, 65, 1000, 2999}) {
+        for (std::size_t length : {1, 50, 64, 129, 1024}) {
+            length = std::min(length, msg_vec.size() - offset);
+            std::vector<std::uint8_t> part(length);
+            seek_cipher.encrypt_at(offset, std::span<const std::uint8_t>(msg_vec.data() + offset, length), std::span<std::uint8_t>(part));
+            passed = passed && std::equal(part.begin(), part.end(), whole.begin() + offset);
+        }
+    }
+
+    std::cout << "Seek test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Splitting a message among threads must not change the output
+bool run_parallel_test(Chacha20Kernel kernel, Chacha20ThreadPool& pool) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    // Several chunks of 64KiB and a partial block
+    std::vector<std::uint8_t> msg_vec(5 * 65536 + 100);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 17 + 3);
+    }
+
+    Chacha20 serial_cipher(key_arr, 1, nonce_arr);
+    serial_cipher.select_kernel(kernel);
+    Chacha20 parallel_cipher(key_arr, 1, nonce_arr);
+    parallel_cipher.select_kernel(kernel);
+    parallel_cipher.enable_parallel(pool, 4096);
+
+    bool passed = (serial_cipher.encrypt(msg_vec) == parallel_cipher.encrypt(msg_vec));
+
+    // Starting in the middle of a block, then a second message right after
+    serial_cipher.seek(1000);
+    parallel_cipher.seek(1000);
+    for (int call = 0; call < 2; ++call) {
+        passed = passed && (serial_cipher.encrypt(msg_vec) == parallel_cipher.encrypt(msg_vec));
+    }
+
+    std::cout << "Parallel test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Feeding a message to update() in pieces of any size must match encrypting it at once
+bool run_stream_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    std::vector<std::uint8_t> msg_vec(5000);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 11 + 1);
+    }
+
+    Chacha20 whole_cipher(key_arr, 1, nonce_arr);
+    whole_cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> whole = whole_cipher.encrypt(msg_vec);
+
+    bool passed = true;
+    for (std::size_t step : {1, 7, 63, 64, 65, 200, 1500}) {
+        Chacha20 stream_cipher(key_arr, 1, nonce_arr);
+        stream_cipher.select_kernel(kernel);
+
+        // Pieces grow and shrink so that they end at every offset within a block
+        std::vector<std::uint8_t> streamed(msg_vec.size());
+        for (std::size_t i = 0, piece = step; i < msg_vec.size(); i += piece, piece = piece % 97 + step) {
+            piece = std::min(piece, msg_vec.size() - i);
+            stream_cipher.update(msg_vec.data() + i, streamed.data() + i, piece);
+        }
+        passed = passed && (streamed == whole);
+    }
+
+    std::cout << "Stream test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Reduced round variants, the first block of keystream for the all zero key and nonce
+// must match the reference test vectors and every kernel must match the scalar one
+template<typename Cipher>
+bool run_reduced_round_test(Chacha20Kernel kernel, const std::string& name, const std::string& expected_block) {
+    std::array<std::uint32_t, 8> key_arr = {};
+    std::array<std::uint32_t, 3> nonce_arr = {};
+    std::vector<std::uint8_t> msg_vec(4096 + 33);
+
+    Cipher cipher(key_arr, 0, nonce_arr);
+    cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> encrypted = cipher.encrypt(msg_vec);
+
+    Cipher scalar_cipher(key_arr, 0, nonce_arr);
+    scalar_cipher.select_kernel(Chacha20Kernel::Scalar);
+
+    std::string first_block = util::vec_to_hex(std::vector<std::uint8_t>(encrypted.begin(), encrypted.begin() + 64));
+    bool passed = (first_block == expected_block) && (encrypted == scalar_cipher.encrypt(msg_vec));
+
+    std::cout << name << " test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Every message of a batch must match encrypting it on its own, whatever the mix of lengths
+bool run_batch_test(Chacha20Kernel kernel) {
+    std::vector<std::vector<std::uint8_t>> messages, outputs, expected;
+    std::vector<Chacha20::Job> jobs;
+    for (std::uint32_t i = 0; i < 70; ++i) {
+        // Mostly short packets, a few long messages and empty ones
+        std::size_t length = (i * 37) % 300 + (i % 11 == 0 ? 2000 : 0) - (i % 13 == 0 ? (i * 37) % 300 : 0);
+        std::vector<std::uint8_t> msg_vec(length);
+        for (std::size_t j = 0; j < length; ++j) {
+            msg_vec[j] = static_cast<std::uint8_t>(j * 7 + i);
+        }
+        messages.push_back(msg_vec);
+        outputs.push_back(std::vector<std::uint8_t>(length));
+
+        Chacha20::Job job = {{0x00010203 * i, 0x04050607, 0x08090a0b, 0x0c0d0e0f, 0x10111213, 0x14151617, 0x18191a1b, i},
+                             i * 3, {i, 0x0000004a, 0x00000000}, nullptr, nullptr, length};
+        Chacha20 cipher(job.key, job.block_count, job.nonce);
+        expected.push_back(cipher.encrypt(msg_vec));
+        jobs.push_back(job);
+    }
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].input = messages[i].data();
+        // Every third job is encrypted in place
+        jobs[i].output = (i % 3 == 0) ? messages[i].data() : outputs[i].data();
+    }
+
+    Chacha20::encrypt_batch(jobs, kernel);
+
+    bool passed = true;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        passed = passed && (((i % 3 == 0) ? messages[i] : outputs[i]) == expected[i]);
+    }
+
+    std::cout << "Batch test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Coroutine that starts right away and is never awaited itself, enough to drive encrypt_async()
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask encrypt_coroutine(Chacha20AsyncEngine<>& engine, Chacha20::Job job, std::promise<bool>& result) {
+    result.set_value(co_await engine.encrypt_async(job));
+}
+
+// Awaits jobs one after another, every await after the first happens on the worker that resumed it
+DetachedTask encrypt_sequence(Chacha20AsyncEngine<>& engine, std::vector<Chacha20::Job> jobs, std::promise<bool>& result) {
+    bool ok = true;
+    for (const Chacha20::Job& job : jobs) {
+        ok = co_await engine.encrypt_async(job) && ok;
+    }
+    result.set_value(ok);
+}
+
+// Messages passed through Chacha20AsyncEngine by callback, future or coroutine must match
+// encrypt_batch(), long messages spread over several workers included, even with a queue
+// much shorter than the number of messages
+bool run_async_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+
+    std::vector<std::size_t> lengths;
+    for (std::size_t i = 0; i < 200; ++i) {
+        lengths.push_back(i * 37 % 700);
+    }
+    lengths.push_back(300 * 1024 + 13);
+    lengths.push_back(5000);
+
+    std::vector<std::vector<std::uint8_t>> messages, expected, results;
+    std::vector<Chacha20::Job> jobs;
+    for (std::size_t i = 0; i < lengths.size(); ++i) {
+        messages.emplace_back(lengths[i]);
+        for (std::size_t j = 0; j < lengths[i]; ++j) {
+            messages[i][j] = static_cast<std::uint8_t>(i * 7 + j * 3);
+        }
+        expected.emplace_back(lengths[i]);
+        results.emplace_back(lengths[i]);
+        const std::uint32_t id = static_cast<std::uint32_t>(i);
+        jobs.push_back({key_arr, id, {id, 0x4a, 0}, messages[i].data(), expected[i].data(), lengths[i]});
+    }
+    bool passed = Chacha20::encrypt_batch(jobs, Chacha20Kernel::Scalar);
+
+    std::atomic<std::size_t> callbacks{0};
+    std::vector<std::future<bool>> futures;
+    std::promise<bool> coroutine_result;
+    std::promise<bool> overflow_result;
+    {
+        Chacha20AsyncEngine<> engine(3, 8, kernel);
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            Chacha20::Job job = jobs[i];
+            job.output = results[i].data();
+            if (i + 1 == jobs.size()) {
+                encrypt_coroutine(engine, job, coroutine_result);
+            } else if (i % 2) {
+                futures.push_back(engine.encrypt_future(job));
+            } else {
+                engine.submit(job, [&callbacks](bool ok) { callbacks += ok; });
+            }
+        }
+
+        std::vector<std::uint8_t> buffer(65, 0x11);
+        engine.submit({key_arr, 0xffffffff, {0, 0x4a, 0}, buffer.data(), buffer.data(), buffer.size()},
+                      [&](bool ok) { overflow_result.set_value(!ok && buffer[0] == 0x11); });
+
+        // Refused right away, the coroutine is not suspended
+        std::promise<bool> refused_coroutine;
+        encrypt_coroutine(engine, {key_arr, 0xffffffff, {0, 0x4a, 0}, buffer.data(), buffer.data(), buffer.size()}, refused_coroutine);
+        std::future<bool> refused = refused_coroutine.get_future();
+        passed = passed && (refused.wait_for(std::chrono::seconds(0)) == std::future_status::ready) && !refused.get() && (buffer[0] == 0x11);
+
+        // 9 chunks never fit a queue of 8
+        std::vector<std::uint8_t> large(9 * 65536);
+        bool called = false;
+        passed = passed && !engine.try_submit({key_arr, 0, {0, 0x4a, 0}, large.data(), large.data(), large.size()},
+                                              [&called](bool) { called = true; }) && !called;
+    }
+
+    // Awaiting with the queue full never waits, neither on the calling thread nor on the only worker
+    // resuming the coroutine, which would otherwise be left waiting for itself to free the queue
+    {
+        std::vector<std::vector<std::uint8_t>> inputs, outputs;
+        std::vector<Chacha20::Job> sequence;
+        for (std::uint32_t i = 0; i < 6; ++i) {
+            inputs.emplace_back(3 * 65536 + i * 100, static_cast<std::uint8_t>(i));
+            outputs.emplace_back(inputs.back().size());
+        }
+        for (std::uint32_t i = 0; i < inputs.size(); ++i) {
+            sequence.push_back({key_arr, 1, {i, 0x4a, 0}, inputs[i].data(), outputs[i].data(), inputs[i].size()});
+        }
+        std::promise<bool> sequence_result;
+        std::future<bool> sequence_done = sequence_result.get_future();
+        {
+            Chacha20AsyncEngine<> engine(1, 1, kernel);
+            encrypt_sequence(engine, sequence, sequence_result);
+            passed = passed && sequence_done.get();
+        }
+        for (std::uint32_t i = 0; i < inputs.size(); ++i) {
+            Chacha20 cipher(key_arr, 1, {i, 0x4a, 0});
+            passed = passed && (cipher.encrypt(inputs[i]) == outputs[i]);
+        }
+    }
+
+    // A message of many chunks is queued chunk by chunk, the queue never holds more than its capacity
+    {
+        std::vector<std::uint8_t> large(40 * 65536, 0x11);
+        Chacha20AsyncEngine<> engine(1, 2, kernel);
+        std::atomic<bool> finished{false};
+        std::thread submitter([&] {
+            engine.submit({key_arr, 0, {0, 0x4a, 0}, large.data(), large.data(), large.size()}, [](bool) {});
+            finished = true;
+        });
+        while (!finished) {
+            passed = passed && (engine.queued() <= 2);
+        }
+        submitter.join();
+    }
+
+    for (std::future<bool>& future : futures) {
+        passed = passed && future.get();
+    }
+    passed = passed && (callbacks + futures.size() + 1 == jobs.size()) && coroutine_result.get_future().get()
+                    && overflow_result.get_future().get() && (results == expected);
+
+    std::cout << "Async test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+static_assert(std::uniform_random_bit_generator<ChaChaRng>);
+
+// Keystream computed during compilation must match the RFC 8439 block function test
+// vector (section 2.3.2) and, across a block boundary, the zero key vectors (A.1)
+template<std::size_t N>
+constexpr bool starts_with(const std::array<std::uint8_t, N>& stream, std::size_t pos, std::initializer_list<std::uint8_t> expected) {
+    for(std::uint8_t byte : expected) {
+        if(stream[pos++] != byte) return false;
+    }
+    return true;
+}
+
+static_assert(starts_with(Chacha20::constant_keystream<64>({0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f, 0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f},
+                                                           1, {0x00000009, 0x0000004a, 0x00000000}), 0,
+                          {0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4}));
+static_assert(starts_with(Chacha20Djb::constant_keystream<80>({}, 0, {}), 0, {0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90}) &&
+              starts_with(Chacha20Djb::constant_keystream<80>({}, 0, {}), 64, {0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a}));
+
+// generate() must write the keystream that update() XORs into a message, and ChaChaRng
+// must hand out the keystream of its seed and stream in order through fill() and operator()
+bool run_rng_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::vector<std::uint8_t> zeros(20000);
+    Chacha20 reference(key_arr, 0, {0x00000000, 0x00000000, 0x00000005});
+    std::vector<std::uint8_t> expected = reference.encrypt(zeros);
+
+    Chacha20 generator(key_arr, 0, {0x00000000, 0x00000000, 0x00000005});
+    generator.select_kernel(kernel);
+    std::vector<std::uint8_t> generated(zeros.size());
+    for (std::size_t i = 0, piece = 1; i < generated.size(); i += piece, piece = piece * 5 % 2003) {
+        piece = std::min(piece, generated.size() - i);
+        generator.generate(std::span<std::uint8_t>(generated.data() + i, piece));
+    }
+    bool passed = (generated == expected);
+
+    ChaChaRng rng(key_arr, 5);
+    rng.select_kernel(kernel);
+    std::vector<std::uint8_t> filled(10001);
+    rng.fill(std::span<std::uint8_t>(filled.data(), 3));
+    rng.fill(std::span<std::uint8_t>());
+    rng.fill(std::span<std::uint8_t>(filled.data() + 3, filled.size() - 3));
+    passed = passed && std::equal(filled.begin(), filled.end(), expected.begin());
+
+    // operator() continues right after the bytes written by fill()
+    for (std::size_t offset = filled.size(); offset < filled.size() + 8 * 600; offset += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, expected.data() + offset, 8);
+        passed = passed && (rng() == word);
+    }
+
+    // Same seed and stream reproduce the output, another stream differs
+    ChaChaRng same(0x0123456789abcdef, 1), other(0x0123456789abcdef, 2);
+    ChaChaRng again(0x0123456789abcdef, 1);
+    std::uniform_int_distribution<int> dice(1, 6);
+    int differ = 0;
+    for (int i = 0; i < 100; ++i) {
+        const std::uint64_t value = same();
+        passed = passed && (value == again());
+        differ += (value != other());
+    }
+    passed = passed && (differ > 90) && (dice(ChaChaRng::thread_local_instance()) >= 1);
+
+    std::cout << "RNG test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Reusing an object through reset() must match a new object with the new nonce and block count
+bool run_reset_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+
+    std::vector<std::uint8_t> msg_vec(700);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 19 + 2);
+    }
+
+    Chacha20 reused_cipher(key_arr, 1, {0x00000000, 0x0000004a, 0x00000000});
+    reused_cipher.select_kernel(kernel);
+
+    bool passed = true;
+    for (std::uint32_t message = 0; message < 5; ++message) {
+        std::array<std::uint32_t, 3> nonce_arr = {message, 0x01020304 * message, 0xdeadbeef};
+
+        // Part of a stream is left over on purpose, it must not leak into the next message
+        std::vector<std::uint8_t> scratch(33);
+        reused_cipher.update(msg_vec.data(), scratch.data(), scratch.size());
+        reused_cipher.reset(nonce_arr, message * 7);
+
+        Chacha20 fresh_cipher(key_arr, message * 7, nonce_arr);
+        fresh_cipher.select_kernel(kernel);
+        passed = passed && (reused_cipher.encrypt(msg_vec) == fresh_cipher.encrypt(msg_vec));
+
+        // seek() is relative to the block count given to reset()
+        std::vector<std::uint8_t> part(100), expected(100);
+        reused_cipher.encrypt_at(300, std::span<const std::uint8_t>(msg_vec.data() + 300, 100), std::span<std::uint8_t>(part));
+        fresh_cipher.encrypt_at(300, std::span<const std::uint8_t>(msg_vec.data() + 300, 100), std::span<std::uint8_t>(expected));
+        passed = passed && (part == expected);
+    }
+
+    std::cout << "Reset test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// In RFC 8439 mode a message running past block 2^32 - 1 must be refused without touching
+// the output. Chacha20Djb must carry the block count into word 13, which makes block c
+// the same as block (c mod 2^32) of Chacha20 with c >> 32 as first nonce word. Nonce
+// words are given in big-endian notation, see run_test_case()
+bool run_counter_test(Chacha20Kernel kernel, Chacha20ThreadPool& pool) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    Chacha20 cipher(key_arr, 0xfffffffe, nonce_arr);
+    cipher.select_kernel(kernel);
+    std::vector<std::uint8_t> buffer(129, 0x11);
+    bool passed = !cipher.encrypt(buffer.data(), buffer.data(), buffer.size())
+                  && std::all_of(buffer.begin(), buffer.end(), [](std::uint8_t b) { return b == 0x11; })
+                  && cipher.encrypt(std::vector<std::uint8_t>(129)).empty();
+    passed = passed && cipher.update(buffer.data(), buffer.data(), 128) && !cipher.update(buffer.data() + 128, buffer.data() + 128, 1)
+                    && (buffer[128] == 0x11) && !cipher.generate(buffer.data(), 1);
+    passed = passed && cipher.seek(128) && !cipher.seek(129) && !cipher.encrypt_at(64, buffer.data(), buffer.data(), 65);
+
+    std::fill(buffer.begin(), buffer.end(), 0x11);
+    std::vector<Chacha20::Job> jobs = {{key_arr, 0xffffffff, nonce_arr, buffer.data(), buffer.data(), 65}};
+    passed = passed && !Chacha20::encrypt_batch(jobs, kernel) && (buffer[0] == 0x11);
+
+    // With a 64bit block count the stream ends at block 2^64 - 1, seeks past it must not wrap around
+    Chacha20Djb last_cipher(key_arr, 0xfffffffffffffffeULL, {0x01234567, 0x89abcdef});
+    last_cipher.select_kernel(kernel);
+    passed = passed && last_cipher.seek(64) && last_cipher.update(buffer.data(), buffer.data(), 64)
+                    && last_cipher.seek(128) && !last_cipher.update(buffer.data(), buffer.data(), 1)
+                    && !last_cipher.seek(129) && !last_cipher.seek(0xffffffffffffffc0ULL) && !last_cipher.encrypt_at(1 << 20, buffer.data(), buffer.data(), 1);
+
+    // Messages of 129 bytes from block 2^64 - 2 would wrap around, every front end refuses them
+    const std::array<std::uint32_t, 2> last_nonce = {0x01234567, 0x89abcdef};
+    const Chacha20Djb::PreparedKey last_prepared(key_arr, kernel);
+    std::fill(buffer.begin(), buffer.end(), 0x11);
+    passed = passed && !last_prepared.encrypt(last_nonce, 0xfffffffffffffffeULL, buffer.data(), buffer.data(), 129) && (buffer[0] == 0x11);
+    std::vector<Chacha20Djb::Job> last_jobs = {{key_arr, 0xfffffffffffffffeULL, last_nonce, buffer.data(), buffer.data(), 129}};
+    passed = passed && !Chacha20Djb::encrypt_batch(last_jobs, kernel) && (buffer[0] == 0x11);
+    {
+        Chacha20AsyncEngine<Chacha20Djb> engine(1, 4, kernel);
+        passed = passed && !engine.encrypt_future(last_jobs[0]).get() && (buffer[0] == 0x11);
+    }
+
+    // 128 bytes end exactly at the last block and are the same for all of them
+    std::vector<std::uint8_t> last_expected(128, 0x11), last_output(128, 0x11);
+    Chacha20Djb last_reference(key_arr, 0xfffffffffffffffeULL, last_nonce);
+    passed = passed && last_reference.update(last_expected.data(), last_expected.data(), 128)
+                    && last_prepared.encrypt(last_nonce, 0xfffffffffffffffeULL, last_output.data(), last_output.data(), 128) && (last_output == last_expected);
+    last_jobs[0].length = 128;
+    std::fill(buffer.begin(), buffer.end(), 0x11);
+    passed = passed && Chacha20Djb::encrypt_batch(last_jobs, kernel) && std::equal(last_expected.begin(), last_expected.end(), buffer.begin());
+
+    // Zero key, nonce and counter give the same first block as RFC 8439
+    Chacha20Djb zero_cipher(std::array<std::uint32_t, 8>{}, 0, {0, 0});
+    zero_cipher.select_kernel(kernel);
+    passed = passed && (util::vec_to_hex(zero_cipher.encrypt(std::vector<std::uint8_t>(64))) ==
+        "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586");
+
+    // Crossing 2^32 with bulk kernels, pieces, seek and the thread pool
+    const std::uint64_t start = 0xffffffffULL - 1500;
+    std::vector<std::uint8_t> msg_vec(5 * 65536 + 100);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 13 + 7);
+    }
+    std::vector<std::uint8_t> expected(msg_vec.size());
+    for (std::size_t pos = 0; pos < msg_vec.size(); pos += 64) {
+        const std::uint64_t block = start + pos / 64;
+        const std::uint32_t high = static_cast<std::uint32_t>(block >> 32);
+        const std::uint32_t high_word = (high >> 24) | ((high >> 8) & 0xff00) | ((high << 8) & 0xff0000) | (high << 24);
+        Chacha20 reference(key_arr, static_cast<std::uint32_t>(block), {high_word, 0x01234567, 0x89abcdef});
+        reference.select_kernel(Chacha20Kernel::Scalar);
+        reference.encrypt(msg_vec.data() + pos, expected.data() + pos, std::min<std::size_t>(64, msg_vec.size() - pos));
+    }
+
+    Chacha20Djb djb(key_arr, start, {0x01234567, 0x89abcdef});
+    djb.select_kernel(kernel);
+    passed = passed && (djb.encrypt(msg_vec) == expected);
+
+    djb.seek(0);
+    std::vector<std::uint8_t> pieces(msg_vec.size());
+    for (std::size_t i = 0, piece = 1; i < msg_vec.size(); i += piece, piece = piece * 7 % 4099) {
+        piece = std::min(piece, msg_vec.size() - i);
+        passed = passed && djb.update(msg_vec.data() + i, pieces.data() + i, piece);
     }
+    passed = passed && (pieces == expected);
+
+    passed = passed && djb.encrypt_at(95000, msg_vec.data() + 95000, pieces.data(), 3000)
+                    && std::equal(pieces.begin(), pieces.begin() + 3000, expected.begin() + 95000);
+
+    djb.enable_parallel(pool, 4096);
+    passed = passed && djb.encrypt_at(0, msg_vec.data(), pieces.data(), msg_vec.size()) && (pieces == expected);
+
+    std::cout << "Counter test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+#if defined(__CUDACC__)
+// Built as CUDA (nvcc -x cu), the device must produce the output of the CPU kernel for
+// messages spanning several chunks, from pinned and pageable memory and across 2^32 in COUNTER64 mode
+bool run_cuda_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    if (!Chacha20Cuda::available()) {
+        std::cout << "CUDA test skipped, no device\n";
+        std::cout << "---------------------------------------------\n";
+        return true;
+    }
+
+    bool passed = true;
+    Chacha20Cuda device(key_arr, 1, nonce_arr);
+    Chacha20 cipher(key_arr, 1, nonce_arr);
+    cipher.select_kernel(kernel);
+    passed = passed && device.is_ready();
+    for (std::size_t length : {std::size_t(0), std::size_t(1), std::size_t(1000), std::size_t(200 << 20) + 77}) {
+        Chacha20PinnedBuffer pinned(length);
+        std::vector<std::uint8_t> msg_vec(length), output(length), expected(length);
+        for (std::size_t i = 0; i < length; ++i) {
+            msg_vec[i] = static_cast<std::uint8_t>(i * 13 + 5);
+            pinned[i] = msg_vec[i];
+        }
+        cipher.encrypt(msg_vec.data(), expected.data(), length);
+        passed = passed && device.encrypt(msg_vec.data(), output.data(), length) && (output == expected);
+        cipher.encrypt(msg_vec.data(), expected.data(), length);
+        passed = passed && device.encrypt(pinned.data(), pinned.data(), length) && std::equal(pinned.begin(), pinned.end(), expected.begin());
+    }
+
+    // The stream ends at block 2^32 - 1 as it does for Chacha20
+    device.reset(nonce_arr, 0xffffffff);
+    std::vector<std::uint8_t> refused(65, 0x11);
+    passed = passed && !device.encrypt(refused.data(), refused.data(), 65) && (refused[0] == 0x11)
+                    && device.encrypt(refused.data(), refused.data(), 64) && !device.encrypt(refused.data(), refused.data(), 1);
+
+    std::array<std::uint32_t, 2> djb_nonce = {0x00000000, 0x0000004a};
+    ChachaCuda<10, true> device64(key_arr, 0xfffffff0, djb_nonce);
+    Chacha20Djb cipher64(key_arr, 0xfffffff0, djb_nonce);
+    cipher64.select_kernel(kernel);
+    std::vector<std::uint8_t> output(4096), expected(4096), msg_vec(4096, 0x5a);
+    cipher64.encrypt(msg_vec.data(), expected.data(), msg_vec.size());
+    passed = passed && device64.encrypt(msg_vec.data(), output.data(), msg_vec.size()) && (output == expected);
 
+    std::cout << "CUDA test " << (passed ? "PASSED" : "FAILED") << "\n";
     std::cout << "---------------------------------------------\n";
     return passed;
 }
+#endif
+
+#if defined(CHACHA20_TRACE)
+// Built with -DCHACHA20_TRACE, every call must be counted once by length and kernel
+// and be bracketed by the hooks with the caller's context
+bool run_trace_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    Chacha20 cipher(key_arr, 1, {0x00000000, 0x0000004a, 0x00000000});
+    cipher.select_kernel(kernel);
+
+    std::array<int, 2> scopes = {0, 0};
+    Chacha20TraceHooks hooks;
+    hooks.begin = [](void* ctx, std::size_t, Chacha20Kernel) { static_cast<int*>(ctx)[0]++; };
+    hooks.end = [](void* ctx, std::size_t, Chacha20Kernel) { static_cast<int*>(ctx)[1]++; };
+    hooks.ctx = scopes.data();
+    cipher.set_trace_hooks(hooks);
+
+    std::vector<std::uint8_t> msg_vec(5000);
+    cipher.encrypt(msg_vec);
+    cipher.update(std::span<std::uint8_t>(msg_vec.data(), 10));
+    cipher.generate(std::span<std::uint8_t>(msg_vec.data(), 100));
+
+    const Chacha20Stats& stats = cipher.stats();
+    bool passed = (stats.bytes == 5110) && (stats.blocks == 79 + 1 + 1)
+                  && (stats.calls_by_size[0] == 1) && (stats.calls_by_size[1] == 1) && (stats.calls_by_size[4] == 1)
+                  && (stats.calls_by_kernel[static_cast<std::size_t>(kernel)] == 3) && (scopes[0] == 3) && (scopes[1] == 3);
+    passed = passed && (Chacha20Stats::size_bucket(63) == 0) && (Chacha20Stats::size_bucket(65535) == 5)
+                    && (Chacha20Stats::size_bucket(65536) == 6) && (Chacha20Stats::size_bucket(1 << 20) == 7);
+
+    cipher.reset_stats();
+    passed = passed && (cipher.stats().bytes == 0);
+
+    std::cout << "Trace test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+#endif
+
+// Chacha20Buffer must be 64 byte aligned, the aligned kernel paths must match the
+// unaligned ones, and recycled buffers must come back scrubbed
+bool run_allocator_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    Chacha20Buffer aligned_msg(5000);
+    std::vector<std::uint8_t> msg_vec(aligned_msg.size() + 1);
+    for (std::size_t i = 0; i < aligned_msg.size(); ++i) {
+        aligned_msg[i] = msg_vec[i + 1] = static_cast<std::uint8_t>(i * 11 + 5);
+    }
+
+    Chacha20 aligned_cipher(key_arr, 1, nonce_arr);
+    aligned_cipher.select_kernel(kernel);
+    Chacha20Buffer aligned_out = aligned_cipher.encrypt(aligned_msg);
+
+    Chacha20 unaligned_cipher(key_arr, 1, nonce_arr);
+    unaligned_cipher.select_kernel(kernel);
+    unaligned_cipher.encrypt(msg_vec.data() + 1, msg_vec.data() + 1, aligned_msg.size());
+
+    bool passed = (reinterpret_cast<std::uintptr_t>(aligned_msg.data()) % 64 == 0)
+                  && (reinterpret_cast<std::uintptr_t>(aligned_out.data()) % 64 == 0)
+                  && std::equal(aligned_out.begin(), aligned_out.end(), msg_vec.begin() + 1);
+
+    Chacha20Buffer aligned_stream(aligned_msg.size());
+    aligned_cipher.seek(0);
+    aligned_cipher.generate(std::span<std::uint8_t>(aligned_stream.data(), aligned_stream.size()));
+    for (std::size_t i = 0; i < aligned_msg.size(); ++i) {
+        passed = passed && (static_cast<std::uint8_t>(aligned_stream[i] ^ aligned_msg[i]) == aligned_out[i]);
+    }
+
+    std::uint8_t* recycled = static_cast<std::uint8_t*>(Chacha20BufferPool::allocate(3000));
+    std::fill_n(recycled, 3000, 0xab);
+    Chacha20BufferPool::deallocate(recycled, 3000);
+    std::uint8_t* again = static_cast<std::uint8_t*>(Chacha20BufferPool::allocate(3000));
+    passed = passed && (again == recycled) && std::all_of(again, again + 3000, [](std::uint8_t b) { return b == 0; });
+    Chacha20BufferPool::deallocate(again, 3000);
+
+    std::cout << "Allocator test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Keystream taken from the ring of Chacha20KeystreamAhead must match Chacha20 whether the ring
+// is refilled in idle time, by its background thread or has run dry, and up to the end of the stream
+bool run_keystream_ahead_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    std::vector<std::uint8_t> msg_vec(1500);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 13 + 5);
+    }
+
+    bool passed = true;
+    for (bool threaded : {false, true}) {
+        Chacha20KeystreamAhead<> ahead(key_arr, 1, nonce_arr, 8, kernel);
+        Chacha20 cipher(key_arr, 1, nonce_arr);
+        cipher.select_kernel(Chacha20Kernel::Scalar);
+        if (threaded) passed = passed && ahead.start() && !ahead.start();
+        passed = passed && (threaded || ahead.available() == 8 * 64);
+
+        std::mt19937 rng(7);
+        for (int i = 0; i < 2000; ++i) {
+            const std::size_t length = rng() % (i % 50 == 0 ? msg_vec.size() : 100);
+            std::vector<std::uint8_t> output(length), expected(length);
+            if (rng() % 2 == 0) {
+                passed = passed && ahead.encrypt(msg_vec.data(), output.data(), length);
+                cipher.encrypt(msg_vec.data(), expected.data(), length);
+            } else {
+                passed = passed && ahead.update(msg_vec.data(), output.data(), length);
+                cipher.update(msg_vec.data(), expected.data(), length);
+            }
+            passed = passed && (output == expected);
+            if (!threaded && rng() % 4 == 0) ahead.refill();
+        }
+        passed = passed && (ahead.misses() > 0);
+        ahead.stop();
+    }
+
+    // The stream ends at block 2^32 - 1 as it does for Chacha20
+    Chacha20KeystreamAhead<> last(key_arr, 0xfffffffe, nonce_arr, 4, kernel);
+    std::vector<std::uint8_t> output(129, 0x11), expected(100);
+    Chacha20 cipher(key_arr, 0xfffffffe, nonce_arr);
+    cipher.update(msg_vec.data(), expected.data(), 100);
+    passed = passed && !last.update(msg_vec.data(), output.data(), 129) && (output[0] == 0x11)
+                    && last.update(msg_vec.data(), output.data(), 100) && std::equal(expected.begin(), expected.end(), output.begin())
+                    && last.update(msg_vec.data(), output.data(), 28) && !last.update(msg_vec.data(), output.data(), 1)
+                    && (last.available() == 0);
+
+    std::cout << "Keystream ahead test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Every session of a Chacha20SessionTable must produce the same output as its own Chacha20
+// object over several rounds of messages, whatever range of sessions a call covers
+bool run_session_test(Chacha20Kernel kernel) {
+    const std::size_t sessions = 53;
+    Chacha20SessionTable table(sessions);
+    table.select_kernel(kernel);
+
+    std::vector<Chacha20> ciphers;
+    for (std::size_t s = 0; s < sessions; ++s) {
+        const std::uint32_t id = static_cast<std::uint32_t>(s);
+        std::array<std::uint32_t, 8> key_arr = {id, 0x04050607, 0x08090a0b, id * 77, 0x10111213, 0x14151617, 0x18191a1b, ~id};
+        std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, id};
+        table.open(s, key_arr, id * 3, nonce_arr);
+        ciphers.emplace_back(key_arr, id * 3, nonce_arr);
+        ciphers.back().select_kernel(Chacha20Kernel::Scalar);
+    }
+
+    bool passed = true;
+    for (std::size_t round = 0; round < 3; ++round) {
+        const std::size_t first = round == 1 ? 5 : 0;
+        std::vector<std::vector<std::uint8_t>> buffers;
+        std::vector<Chacha20SessionTable::Message> messages;
+        for (std::size_t s = first; s < sessions; ++s) {
+            buffers.emplace_back((s * 37 + round * 101) % 300);
+            for (std::size_t i = 0; i < buffers.back().size(); ++i) {
+                buffers.back()[i] = static_cast<std::uint8_t>(i + s);
+            }
+        }
+        for (std::vector<std::uint8_t>& buffer : buffers) {
+            messages.push_back({buffer.data(), buffer.data(), buffer.size()});
+        }
+        passed = passed && table.encrypt(first, messages);
+
+        for (std::size_t s = first; s < sessions; ++s) {
+            std::vector<std::uint8_t> expected(buffers[s - first].size());
+            for (std::size_t i = 0; i < expected.size(); ++i) {
+                expected[i] = static_cast<std::uint8_t>(i + s);
+            }
+            passed = passed && (ciphers[s].encrypt(expected) == buffers[s - first]);
+        }
+    }
+
+    // A message running past block 2^32 - 1 is refused, the other sessions go ahead
+    table.reset(1, {0, 0x4a, 1}, 0xffffffff);
+    std::vector<std::uint8_t> refused(65, 0x11), accepted(65, 0x11);
+    std::vector<Chacha20SessionTable::Message> messages = {{accepted.data(), accepted.data(), 65}, {refused.data(), refused.data(), 65}};
+    passed = passed && !table.encrypt(messages) && (refused[0] == 0x11) && (accepted[0] != 0x11)
+                    && (table.block_count(1) == 0xffffffff) && !table.encrypt(sessions, messages);
+
+    // A message ending at block 2^32 - 1 exhausts its session, the next one is refused until reset()
+    std::vector<std::uint8_t> last(64, 0x11), after(1, 0x11);
+    std::vector<Chacha20SessionTable::Message> ending = {{accepted.data(), accepted.data(), 0}, {last.data(), last.data(), 64}};
+    std::vector<Chacha20SessionTable::Message> next = {{accepted.data(), accepted.data(), 0}, {after.data(), after.data(), 1}};
+    passed = passed && table.encrypt(ending) && (last[0] != 0x11) && (table.block_count(1) == 0)
+                    && !table.encrypt(next) && (after[0] == 0x11) && !table.encrypt(next) && (after[0] == 0x11);
+    std::vector<Chacha20SessionTable::Message> empty = {{accepted.data(), accepted.data(), 0}, {after.data(), after.data(), 0}};
+    passed = passed && table.encrypt(empty) && (table.block_count(1) == 0) && !table.encrypt(next);
+    table.reset(1, {0, 0x4a, 2}, 0);
+    passed = passed && table.encrypt(next) && (after[0] != 0x11);
+
+    std::cout << "Session test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Objects of the container format must decrypt to their plaintext as a whole, in parallel and by
+// any range, the untagged format is the plain Chacha20 stream, tampering and truncation are detected
+bool run_container_test(Chacha20Kernel kernel, Chacha20ThreadPool& pool) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 2> nonce_arr = {0x0000004a, 0x00000000};
+
+    bool passed = true;
+    std::mt19937 rng(11);
+    for (bool tagged : {false, true}) {
+        for (std::size_t length : {std::size_t(0), std::size_t(100), std::size_t(256), std::size_t(3 * 256 + 17)}) {
+            std::vector<std::uint8_t> msg_vec(length);
+            for (std::size_t i = 0; i < length; ++i) {
+                msg_vec[i] = static_cast<std::uint8_t>(i * 7 + 1);
+            }
+
+            // Written in pieces of random size, the chunk size is rounded up to 256
+            std::vector<std::uint8_t> object;
+            Chacha20ContainerWriter writer(key_arr, nonce_arr, [&](const std::uint8_t* data, std::size_t n) {
+                object.insert(object.end(), data, data + n);
+                return true;
+            }, 200, tagged);
+            writer.select_kernel(kernel);
+            for (std::size_t pos = 0; pos < length; ) {
+                const std::size_t piece = std::min<std::size_t>(rng() % 300, length - pos);
+                passed = writer.write(msg_vec.data() + pos, piece) && passed;
+                pos += piece;
+            }
+            passed = writer.finish() && passed;
+            passed = passed && (object.size() == chacha20_container::HEADER_SIZE + length + (tagged ? (length / 256 + 1) * 16 : 0));
+
+            if (!tagged) {
+                Chacha20 cipher(key_arr, 1, {0, nonce_arr[0], nonce_arr[1]});
+                std::vector<std::uint8_t> expected(length);
+                cipher.encrypt(msg_vec.data(), expected.data(), length);
+                passed = passed && std::equal(expected.begin(), expected.end(), object.begin() + chacha20_container::HEADER_SIZE);
+            }
+
+            std::vector<std::uint8_t> stored = object;
+            auto source = [&stored](std::uint64_t offset, std::uint8_t* data, std::size_t n) {
+                if (offset > stored.size() || n > stored.size() - offset) return false;
+                std::copy_n(stored.data() + offset, n, data);
+                return true;
+            };
+            Chacha20ContainerReader reader(key_arr);
+            reader.select_kernel(kernel);
+            passed = passed && reader.open(source, stored.size()) && (reader.size() == length) && (reader.chunk_count() == length / 256 + 1);
+
+            std::vector<std::uint8_t> output(length);
+            passed = passed && reader.read_all(output.data(), &pool) && (output == msg_vec);
+            for (int i = 0; i < 20; ++i) {
+                const std::size_t offset = length == 0 ? 0 : rng() % length;
+                const std::size_t n = rng() % (length - offset + 1);
+                std::vector<std::uint8_t> part(n);
+                passed = passed && reader.read(offset, part.data(), n) && std::equal(part.begin(), part.end(), msg_vec.begin() + offset);
+            }
+            passed = passed && !reader.read(length, output.data(), 1);
+
+            if (tagged && length > 0) {
+                // A flipped bit fails its chunk, read_all() then releases nothing
+                const std::size_t flipped = length / 2;
+                stored[chacha20_container::HEADER_SIZE + flipped / 256 * (256 + 16) + flipped % 256] ^= 1;
+                std::uint8_t byte;
+                passed = passed && reader.open(source, stored.size()) && !reader.read(flipped, &byte, 1)
+                                && (length <= 256 || reader.read(flipped < 256 ? 256 : 0, &byte, 1))
+                                && !reader.read_all(output.data(), &pool) && std::all_of(output.begin(), output.end(), [](std::uint8_t b) { return b == 0; });
+
+                // Cut after a whole chunk the object lacks its last tag, cut 16 bytes later the
+                // chunk now last was not sealed as the last one
+                stored = object;
+                stored.resize(chacha20_container::HEADER_SIZE + 256 + 16);
+                passed = passed && !reader.open(source, stored.size());
+                if (length > 256) {
+                    stored.resize(chacha20_container::HEADER_SIZE + 256 + 16 + 16);
+                    passed = passed && reader.open(source, stored.size()) && (reader.size() == 256) && !reader.read_all(output.data());
+                }
+            }
+        }
+    }
 
-#define ITERATIONS 100000
+    // Neither a foreign header nor an object too short for its last tag is opened
+    std::vector<std::uint8_t> stored;
+    Chacha20ContainerWriter writer(key_arr, nonce_arr, [&](const std::uint8_t* data, std::size_t n) {
+        stored.insert(stored.end(), data, data + n);
+        return true;
+    });
+    passed = writer.finish() && passed && (stored.size() == chacha20_container::HEADER_SIZE + 16);
+
+    // A finished object takes nothing more, it stays as it was sealed
+    const std::uint8_t extra = 1;
+    passed = passed && !writer.write(&extra, 1) && !writer.finish() && (stored.size() == chacha20_container::HEADER_SIZE + 16);
+
+    // Like every number of the header the nonce words are little-endian
+    passed = passed && std::equal(stored.begin() + 16, stored.begin() + 24, std::array<std::uint8_t, 8>{0x4a, 0, 0, 0, 0, 0, 0, 0}.begin());
+    auto source = [&stored](std::uint64_t offset, std::uint8_t* data, std::size_t n) {
+        std::copy_n(stored.data() + offset, n, data);
+        return true;
+    };
+    Chacha20ContainerReader reader(key_arr);
+    passed = passed && reader.open(source, stored.size()) && !reader.open(source, stored.size() - 1);
+    stored[0] ^= 1;
+    passed = passed && !reader.open(source, stored.size());
+
+    // Tagged objects with adjacent nonces must not share the keystream of any chunk, zeros encrypt to the keystream
+    std::vector<std::vector<std::uint8_t>> chunks;
+    for (std::uint32_t low = 0x10; low < 0x18; ++low) {
+        std::vector<std::uint8_t> object;
+        Chacha20ContainerWriter zero_writer(key_arr, {0x0000004a, low}, [&](const std::uint8_t* data, std::size_t n) {
+            object.insert(object.end(), data, data + n);
+            return true;
+        }, 256);
+        zero_writer.select_kernel(kernel);
+        passed = zero_writer.write(std::vector<std::uint8_t>(4 * 256, 0)) && zero_writer.finish() && passed;
+        for (std::size_t i = 0; i < 4 && object.size() >= chacha20_container::HEADER_SIZE + (i + 1) * (256 + 16); ++i) {
+            const auto begin = object.begin() + chacha20_container::HEADER_SIZE + i * (256 + 16);
+            chunks.emplace_back(begin, begin + 256);
+        }
+    }
+    std::sort(chunks.begin(), chunks.end());
+    passed = passed && (chunks.size() == 8 * 4) && (std::adjacent_find(chunks.begin(), chunks.end()) == chunks.end());
+
+    std::cout << "Container test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Output written with non-temporal stores must match output written through the caches,
+// for any alignment of input and output and when split among the threads of a pool
+bool run_streaming_test(Chacha20Kernel kernel, Chacha20ThreadPool& pool) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x00000000, 0x0000004a, 0x00000000};
+
+    const std::size_t length = 100000 + 37;
+    Chacha20Buffer msg_vec(length + 64);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 17 + 3);
+    }
+
+    bool passed = true;
+    for (std::size_t input_offset : {0, 1, 32}) {
+        for (std::size_t output_offset : {0, 5, 32}) {
+            Chacha20 cached_cipher(key_arr, 1, nonce_arr);
+            cached_cipher.select_kernel(kernel);
+            std::vector<std::uint8_t> expected(length);
+            cached_cipher.encrypt(msg_vec.data() + input_offset, expected.data(), length);
+
+            Chacha20 stream_cipher(key_arr, 1, nonce_arr);
+            stream_cipher.select_kernel(kernel);
+            stream_cipher.enable_streaming(0);
+            Chacha20Buffer streamed(length + 64);
+            stream_cipher.encrypt(msg_vec.data() + input_offset, streamed.data() + output_offset, length);
+            passed = passed && std::equal(expected.begin(), expected.end(), streamed.begin() + output_offset);
+
+            stream_cipher.enable_parallel(pool, 4096);
+            stream_cipher.encrypt_at(0, msg_vec.data() + input_offset, streamed.data() + output_offset, length);
+            passed = passed && std::equal(expected.begin(), expected.end(), streamed.begin() + output_offset);
+        }
+    }
+
+    std::cout << "Streaming test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// HChaCha20 must derive the reference subkey and XChaCha20 must match ChaCha20 keyed
+// with that subkey and the last 64 bits of the extended nonce
+// A PreparedKey must produce the same output as Chacha20 for any nonce and block count,
+// refuse messages running past the end of the stream, and be usable from several threads at once
+bool run_prepared_key_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::vector<std::uint8_t> msg_vec(5000);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 7 + 3);
+    }
+
+    const Chacha20::PreparedKey prepared(key_arr, kernel);
+    bool passed = true;
+    for (std::size_t length : {0, 1, 63, 64, 65, 511, 512, 4096 + 77}) {
+        for (std::uint32_t block_count : {0u, 1u, 0xfffffff0u}) {
+            const std::array<std::uint32_t, 3> nonce_arr = {0x00000009, block_count, static_cast<std::uint32_t>(length)};
+            Chacha20 cipher(key_arr, block_count, nonce_arr);
+            cipher.select_kernel(Chacha20Kernel::Scalar);
+            std::vector<std::uint8_t> input(msg_vec.begin(), msg_vec.begin() + length);
+            std::vector<std::uint8_t> expected(length, 0);
+            const bool fits = cipher.update(input.data(), expected.data(), length);
+
+            std::vector<std::uint8_t> output(length, 0);
+            passed = passed && (prepared.encrypt(nonce_arr, block_count, input, output) == fits);
+            passed = passed && (!fits || output == expected);
+            passed = passed && (fits || std::all_of(output.begin(), output.end(), [](std::uint8_t b) { return b == 0; }));
+
+            // In place
+            passed = passed && (!fits || (prepared.encrypt(nonce_arr, block_count, input.data(), input.data(), length) && input == expected));
+        }
+    }
+
+    // Every thread encrypts its own messages under the one key
+    std::vector<std::vector<std::uint8_t>> outputs(4, std::vector<std::uint8_t>(msg_vec.size()));
+    std::vector<std::thread> threads;
+    for (std::uint32_t t = 0; t < outputs.size(); t++) {
+        threads.emplace_back([&, t] {
+            for (int round = 0; round < 50; round++) {
+                prepared.encrypt({t, 0, 0}, 1, msg_vec.data(), outputs[t].data(), msg_vec.size());
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (std::uint32_t t = 0; t < outputs.size(); t++) {
+        Chacha20 cipher(key_arr, 1, {t, 0, 0});
+        passed = passed && (cipher.encrypt(msg_vec) == outputs[t]);
+    }
+
+    // The 64-bit block count carries into word 13
+    const Chacha20Djb::PreparedKey djb_prepared(key_arr, kernel);
+    Chacha20Djb djb(key_arr, 0xfffffffe, {0x01234567, 0x89abcdef});
+    std::vector<std::uint8_t> djb_output(msg_vec.size());
+    passed = passed && djb_prepared.encrypt({0x01234567, 0x89abcdef}, 0xfffffffe, msg_vec, djb_output)
+                    && (djb.encrypt(msg_vec) == djb_output);
+
+    std::cout << "Prepared key test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+bool run_xchacha_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x00010203, 0x04050607, 0x08090a0b, 0x0c0d0e0f,
+                                            0x10111213, 0x14151617, 0x18191a1b, 0x1c1d1e1f};
+    std::array<std::uint32_t, 8> expected_subkey = {0x82413b42, 0x27b27bfe, 0xd30e4250, 0x8a877d73,
+                                                    0xa0f9e4d5, 0x8a74a853, 0xc12ec413, 0x26d3ecdc};
+    bool passed = (Chacha20::hchacha(key_arr, {0x00000009, 0x0000004a, 0x00000000, 0x31415927}) == expected_subkey);
+
+    std::array<std::uint32_t, 6> nonce_arr = {0x40414243, 0x44454647, 0x48494a4b, 0x4c4d4e4f, 0x50515253, 0x54555657};
+    std::vector<std::uint8_t> msg_vec(1000);
+    for (std::size_t i = 0; i < msg_vec.size(); ++i) {
+        msg_vec[i] = static_cast<std::uint8_t>(i * 3 + 9);
+    }
+
+    XChacha20 xcipher(key_arr, 1, nonce_arr);
+    xcipher.select_kernel(kernel);
+    Chacha20 cipher(Chacha20::hchacha(key_arr, {nonce_arr[0], nonce_arr[1], nonce_arr[2], nonce_arr[3]}), 1, {0, nonce_arr[4], nonce_arr[5]});
+    cipher.select_kernel(kernel);
+    passed = passed && (xcipher.encrypt(msg_vec) == cipher.encrypt(msg_vec));
+
+    std::cout << "XChaCha20 test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// Poly1305 must match the RFC 8439 test vector, and the vectorized kernel must match
+// the portable one for any length fed in any pieces
+bool run_poly1305_test(Chacha20Kernel kernel) {
+    std::vector<std::uint8_t> key_vec = util::str_to_vec(util::hex_str_to_str("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b"));
+    std::array<std::uint8_t, Poly1305::KEY_SIZE> key;
+    std::copy_n(key_vec.begin(), key.size(), key.begin());
+
+    Poly1305 mac(key, kernel);
+    mac.update(util::str_to_vec("Cryptographic Forum Research Group"));
+    Poly1305::tag_type tag = mac.finish();
+    bool passed = (util::vec_to_hex(std::vector<std::uint8_t>(tag.begin(), tag.end())) == "a8061dc1305136c6c22b8baf0c0127a9");
+
+    for (std::size_t length = 0; length < 1500 && passed; length += 37) {
+        std::vector<std::uint8_t> msg_vec(length);
+        for (std::size_t i = 0; i < length; ++i) {
+            msg_vec[i] = static_cast<std::uint8_t>(0xff - i * 5);
+        }
+
+        Poly1305 scalar_mac(key, Chacha20Kernel::Scalar);
+        scalar_mac.update(msg_vec);
+
+        Poly1305 kernel_mac(key, kernel);
+        for (std::size_t i = 0, piece = 1; i < length; i += piece, piece = piece * 3 % 301) {
+            piece = std::min(piece, length - i);
+            kernel_mac.update(msg_vec.data() + i, piece);
+        }
+        passed = (scalar_mac.finish() == kernel_mac.finish());
+    }
+
+    std::cout << "Poly1305 test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
+
+// ChaCha20-Poly1305 must match the RFC 8439 AEAD test vector, open() must restore the
+// plaintext of long messages and reject a modified ciphertext, aad or tag
+bool run_aead_test(Chacha20Kernel kernel) {
+    std::array<std::uint32_t, 8> key_arr = {0x80818283, 0x84858687, 0x88898a8b, 0x8c8d8e8f,
+                                            0x90919293, 0x94959697, 0x98999a9b, 0x9c9d9e9f};
+    std::array<std::uint32_t, 3> nonce_arr = {0x07000000, 0x40414243, 0x44454647};
+    std::vector<std::uint8_t> aad = util::str_to_vec(util::hex_str_to_str("50515253c0c1c2c3c4c5c6c7"));
+    std::vector<std::uint8_t> msg_vec = util::str_to_vec(
+        "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.");
+
+    Chacha20Poly1305 aead(key_arr);
+    aead.select_kernel(kernel);
+
+    std::vector<std::uint8_t> sealed(msg_vec.size());
+    Chacha20Poly1305::tag_type tag;
+    bool passed = aead.seal(nonce_arr, aad, msg_vec, sealed, tag) && (util::vec_to_hex(sealed) ==
+        "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b3692ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116")
+        && (util::vec_to_hex(std::vector<std::uint8_t>(tag.begin(), tag.end())) == "1ae10b594f09e26a7e902ecbd0600691");
+
+    // Several chunks and a partial block
+    std::vector<std::uint8_t> long_msg(3 * 4096 + 1000);
+    for (std::size_t i = 0; i < long_msg.size(); ++i) {
+        long_msg[i] = static_cast<std::uint8_t>(i * 29 + 11);
+    }
+    std::vector<std::uint8_t> ciphertext(long_msg.size()), opened(long_msg.size());
+    passed = passed && aead.seal(nonce_arr, aad, long_msg, ciphertext, tag) && aead.open(nonce_arr, aad, ciphertext, opened, tag) && (opened == long_msg);
+
+    // Ciphertext must equal the plain stream cipher starting at block 1
+    Chacha20 cipher(key_arr, 1, nonce_arr);
+    passed = passed && (cipher.encrypt(long_msg) == ciphertext);
+
+    ciphertext[5000] ^= 1;
+    passed = passed && !aead.open(nonce_arr, aad, ciphertext, opened, tag)
+                    && std::all_of(opened.begin(), opened.end(), [](std::uint8_t b) { return b == 0; });
+    ciphertext[5000] ^= 1;
+    aad[0] ^= 1;
+    passed = passed && !aead.open(nonce_arr, aad, ciphertext, opened, tag);
+    aad[0] ^= 1;
+    tag[15] ^= 1;
+    passed = passed && !aead.open(nonce_arr, aad, ciphertext, opened, tag);
+
+    std::cout << "AEAD test " << (passed ? "PASSED" : "FAILED") << "\n";
+    std::cout << "---------------------------------------------\n";
+    return passed;
+}
 
 // Testcases are from https://datatracker.ietf.org/doc/html/rfc8439
 int main() {
@@ -117,29 +1261,71 @@ int main() {
     int passed = 0;
     int total = 0;
 
-    total++; passed += run_test_case(
-        "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "1", "000000000000004a00000000",
-        "4c616469657320616e642047656e746c656d656e206f662074686520636c617373206f66202739393a204966204920636f756c64206f6666657220796f75206f6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73637265656e20776f756c642062652069742e",
-        "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d807ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d",
-        ITERATIONS);
-
-    total++; passed += run_test_case(
-        "0000000000000000000000000000000000000000000000000000000000000000", "0", "000000000000000000000000",
-        "00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
-        "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586",
-        ITERATIONS);
-
-    total++; passed += run_test_case(
-        "0000000000000000000000000000000000000000000000000000000000000001", "1", "000000000000000000000002",
-        "416e79207375626d697373696f6e20746f20746865204945544620696e74656e6465642062792074686520436f6e7472696275746f7220666f72207075626c69636174696f6e20617320616c6c206f722070617274206f6620616e204945544620496e7465726e65742d4472616674206f722052464320616e6420616e792073746174656d656e74206d6164652077697468696e2074686520636f6e74657874206f6620616e204945544620616374697669747920697320636f6e7369646572656420616e20224945544620436f6e747269627574696f6e222e20537563682073746174656d656e747320696e636c756465206f72616c2073746174656d656e747320696e20494554462073657373696f6e732c2061732077656c6c206173207772697474656e20616e6420656c656374726f6e696320636f6d6d756e69636174696f6e73206d61646520617420616e792074696d65206f7220706c6163652c207768696368206172652061646472657373656420746f",
-        "a3fbf07df3fa2fde4f376ca23e82737041605d9f4f4f57bd8cff2c1d4b7955ec2a97948bd3722915c8f3d337f7d370050e9e96d647b7c39f56e031ca5eb6250d4042e02785ececfa4b4bb5e8ead0440e20b6e8db09d881a7c6132f420e52795042bdfa7773d8a9051447b3291ce1411c680465552aa6c405b7764d5e87bea85ad00f8449ed8f72d0d662ab052691ca66424bc86d2df80ea41f43abf937d3259dc4b2d0dfb48a6c9139ddd7f76966e928e635553ba76c5c879d7b35d49eb2e62b0871cdac638939e25e8a1e0ef9d5280fa8ca328b351c3c765989cbcf3daa8b6ccc3aaf9f3979c92b3720fc88dc95ed84a1be059c6499b9fda236e7e818b04b0bc39c1e876b193bfe5569753f88128cc08aaa9b63d1a16f80ef2554d7189c411f5869ca52c5b83fa36ff216b9c1d30062bebcfd2dc5bce0911934fda79a86f6e698ced759c3ff9b6477338f3da4f9cd8514ea9982ccafb341b2384dd902f3d1ab7ac61dd29c6f21ba5b862f3730e37cfdc4fd806c22f221",
-        ITERATIONS);
-
-    total++; passed += run_test_case(
-        "1c9240a5eb55d38af333888604f6b5f0473917c1402b80099dca5cbc207075c0", "42", "000000000000000000000002",
-        "2754776173206272696c6c69672c20616e642074686520736c6974687920746f7665730a446964206779726520616e642067696d626c6520696e2074686520776162653a0a416c6c206d696d737920776572652074686520626f726f676f7665732c0a416e6420746865206d6f6d65207261746873206f757467726162652e",
-        "62e6347f95ed87a45ffae7426f27a1df5fb69110044c0d73118effa95b01e5cf166d3df2d721caf9b21e5fb14c616871fd84c54f9d65b283196c7fe4f60553ebf39c6402c42234e32a356b3e764312a61a5532055716ead6962568f87d3f3f7704c6a8d1bcd1bf4d50d6154b6da731b187b58dfd728afa36757a797ac188d1",
-        ITERATIONS);
+    Chacha20ThreadPool pool(4);
+
+    for (Chacha20Kernel kernel : {Chacha20Kernel::Scalar, Chacha20Kernel::SSE2, Chacha20Kernel::AVX2, Chacha20Kernel::AVX512,
+                                  Chacha20Kernel::NEON, Chacha20Kernel::SVE2}) {
+        if (!Chacha20::kernel_supported(kernel)) {
+            std::cout << "Kernel " << Chacha20::kernel_name(kernel) << " not supported, skipping\n";
+            continue;
+        }
+        std::cout << "Kernel " << Chacha20::kernel_name(kernel) << "\n";
+
+        total++; passed += run_test_case(kernel,
+            "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "1", "000000000000004a00000000",
+            "4c616469657320616e642047656e746c656d656e206f662074686520636c617373206f66202739393a204966204920636f756c64206f6666657220796f75206f6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73637265656e20776f756c642062652069742e",
+            "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d807ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d");
+
+        total++; passed += run_test_case(kernel,
+            "0000000000000000000000000000000000000000000000000000000000000000", "0", "000000000000000000000000",
+            "00000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
+            "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586");
+
+        total++; passed += run_test_case(kernel,
+            "0000000000000000000000000000000000000000000000000000000000000001", "1", "000000000000000000000002",
+            "416e79207375626d697373696f6e20746f20746865204945544620696e74656e6465642062792074686520436f6e7472696275746f7220666f72207075626c69636174696f6e20617320616c6c206f722070617274206f6620616e204945544620496e7465726e65742d4472616674206f722052464320616e6420616e792073746174656d656e74206d6164652077697468696e2074686520636f6e74657874206f6620616e204945544620616374697669747920697320636f6e7369646572656420616e20224945544620436f6e747269627574696f6e222e20537563682073746174656d656e747320696e636c756465206f72616c2073746174656d656e747320696e20494554462073657373696f6e732c2061732077656c6c206173207772697474656e20616e6420656c656374726f6e696320636f6d6d756e69636174696f6e73206d61646520617420616e792074696d65206f7220706c6163652c207768696368206172652061646472657373656420746f",
+            "a3fbf07df3fa2fde4f376ca23e82737041605d9f4f4f57bd8cff2c1d4b7955ec2a97948bd3722915c8f3d337f7d370050e9e96d647b7c39f56e031ca5eb6250d4042e02785ececfa4b4bb5e8ead0440e20b6e8db09d881a7c6132f420e52795042bdfa7773d8a9051447b3291ce1411c680465552aa6c405b7764d5e87bea85ad00f8449ed8f72d0d662ab052691ca66424bc86d2df80ea41f43abf937d3259dc4b2d0dfb48a6c9139ddd7f76966e928e635553ba76c5c879d7b35d49eb2e62b0871cdac638939e25e8a1e0ef9d5280fa8ca328b351c3c765989cbcf3daa8b6ccc3aaf9f3979c92b3720fc88dc95ed84a1be059c6499b9fda236e7e818b04b0bc39c1e876b193bfe5569753f88128cc08aaa9b63d1a16f80ef2554d7189c411f5869ca52c5b83fa36ff216b9c1d30062bebcfd2dc5bce0911934fda79a86f6e698ced759c3ff9b6477338f3da4f9cd8514ea9982ccafb341b2384dd902f3d1ab7ac61dd29c6f21ba5b862f3730e37cfdc4fd806c22f221");
+
+        total++; passed += run_test_case(kernel,
+            "1c9240a5eb55d38af333888604f6b5f0473917c1402b80099dca5cbc207075c0", "42", "000000000000000000000002",
+            "2754776173206272696c6c69672c20616e642074686520736c6974687920746f7665730a446964206779726520616e642067696d626c6520696e2074686520776162653a0a416c6c206d696d737920776572652074686520626f726f676f7665732c0a416e6420746865206d6f6d65207261746873206f757467726162652e",
+            "62e6347f95ed87a45ffae7426f27a1df5fb69110044c0d73118effa95b01e5cf166d3df2d721caf9b21e5fb14c616871fd84c54f9d65b283196c7fe4f60553ebf39c6402c42234e32a356b3e764312a61a5532055716ead6962568f87d3f3f7704c6a8d1bcd1bf4d50d6154b6da731b187b58dfd728afa36757a797ac188d1");
+
+        for (std::size_t length : {511, 512, 1024, 4096 + 77}) {
+            total++; passed += run_chunk_test(kernel, length);
+        }
+
+        total++; passed += run_kernel_test(kernel);
+        total++; passed += run_seek_test(kernel);
+        total++; passed += run_parallel_test(kernel, pool);
+        total++; passed += run_stream_test(kernel);
+        total++; passed += run_reset_test(kernel);
+        total++; passed += run_batch_test(kernel);
+        total++; passed += run_async_test(kernel);
+        total++; passed += run_session_test(kernel);
+        total++; passed += run_keystream_ahead_test(kernel);
+        total++; passed += run_rng_test(kernel);
+        total++; passed += run_counter_test(kernel, pool);
+        total++; passed += run_allocator_test(kernel);
+        total++; passed += run_streaming_test(kernel, pool);
+        total++; passed += run_container_test(kernel, pool);
+        total++; passed += run_prepared_key_test(kernel);
+        total++; passed += run_xchacha_test(kernel);
+#if defined(CHACHA20_TRACE)
+        total++; passed += run_trace_test(kernel);
+#endif
+#if defined(__CUDACC__)
+        total++; passed += run_cuda_test(kernel);
+#endif
+        total++; passed += run_poly1305_test(kernel);
+        total++; passed += run_aead_test(kernel);
+
+        // Reduced round vectors are from https://datatracker.ietf.org/doc/html/draft-strombergson-chacha-test-vectors
+        total++; passed += run_reduced_round_test<Chacha8>(kernel, "ChaCha8",
+            "3e00ef2f895f40d67f5bb8e81f09a5a12c840ec3ce9a7f3b181be188ef711a1e984ce172b9216f419f445367456d5619314a42a3da86b001387bfdb80e0cfe42");
+        total++; passed += run_reduced_round_test<Chacha12>(kernel, "ChaCha12",
+            "9bf49a6a0755f953811fce125f2683d50429c3bb49e074147e0089a52eae155f0564f879d27ae3c02ce82834acfa8c793a629f2ca0de6919610be82f411326be");
+    }
 
     std::cout << passed << "/" << total << " test cases passed.\n";
 